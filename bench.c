@@ -0,0 +1,679 @@
+/**
+ * Benchmarks: synthetic scenes, built the same way every run, rendered at
+ * several resolutions. Results go out as JSON, one record per scene and
+ * resolution, so runs can be compared over time.
+ * (c) L. Diener 2011
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scenes.h"
+#include "importers.h"
+#include "timing.h"
+
+#define FOV 45.0f
+#define DEPTH 10.0f
+
+// The calls that make up a frame, timed separately. Drawing is the vertex
+// stage and rasterization, which take turns batch by batch (make STATS=1
+// and the counters have them apart).
+enum { STEP_CLEAR, STEP_CULL, STEP_DRAW, STEP_RESOLVE, STEPS };
+static const char* stepNames[STEPS] = { "clear", "cull", "draw", "resolve" };
+
+static const int resolutions[][2] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+
+// Scenes are built in eye space, in front of a camera at the origin that
+// looks down -z, to cover the view of a width x height frame. Depths are
+// distances from the camera.
+typedef struct view {
+	int width;
+	int height;
+	float aspect;
+	float tanHalf;
+} view;
+
+// Half the height of what is in view at depth z, and one pixel there.
+static float halfHeightAt(const view* v, float z) {
+	return z * v->tanHalf;
+}
+
+static float pixelAt(const view* v, float z) {
+	return 2.0f * halfHeightAt( v, z ) / v->height;
+}
+
+// Vertices and triangles of a scene being built. Counts are known up
+// front. Texture coordinates are 0 unless set.
+typedef struct meshBuilder {
+	vertexStreams v;
+	uint32_t* indices;
+	int vertices;
+	int tris;
+} meshBuilder;
+
+static meshBuilder makeMeshBuilder(int vertices, int tris) {
+	meshBuilder b;
+	b.v = makeVertexStreams( vertices );
+	addTexCoords( &b.v );
+	b.indices = (uint32_t*)malloc( sizeof(uint32_t) * 3 * tris );
+	b.vertices = 0;
+	b.tris = 0;
+	return b;
+}
+
+static int addVertex(meshBuilder* b, float x, float y, float z, float nx, float ny, float nz) {
+	int i = b->vertices++;
+	b->v.x[i] = x;
+	b->v.y[i] = y;
+	b->v.z[i] = z;
+	b->v.nx[i] = nx;
+	b->v.ny[i] = ny;
+	b->v.nz[i] = nz;
+	return i;
+}
+
+static void setTexCoord(meshBuilder* b, int i, float u, float v) {
+	b->v.u[i] = u;
+	b->v.v[i] = v;
+}
+
+// Adds a triangle wound counter-clockwise around the normal of its first
+// vertex, so it is front facing from that side.
+static void addTriangle(meshBuilder* b, int i0, int i1, int i2) {
+	const vertexStreams* v = &b->v;
+	vec3 e1 = makeVec3( v->x[i1] - v->x[i0], v->y[i1] - v->y[i0], v->z[i1] - v->z[i0] );
+	vec3 e2 = makeVec3( v->x[i2] - v->x[i0], v->y[i2] - v->y[i0], v->z[i2] - v->z[i0] );
+	vec3 n;
+	cross( &n, e1, e2 );
+	bool facing = n.x * v->nx[i0] + n.y * v->ny[i0] + n.z * v->nz[i0] > 0.0f;
+	uint32_t* t = b->indices + 3 * b->tris++;
+	t[0] = i0;
+	t[1] = facing ? i1 : i2;
+	t[2] = facing ? i2 : i1;
+}
+
+// Screen covering rectangle of quads at depth z, facing the camera. The
+// texture is laid across it once, turned by the given angle, roughly one
+// texel to a pixel for a 1024 texture in a 1280 wide frame.
+static void addGrid(meshBuilder* b, const view* v, float z, int cols, int rows, float degrees) {
+	float hh = halfHeightAt( v, z ) * 1.01f;
+	float hw = hh * v->aspect;
+	float c = cosf( degrees * (float)scalarPI / 180.0f ) * 1.25f;
+	float s = sinf( degrees * (float)scalarPI / 180.0f ) * 1.25f;
+	int first = b->vertices;
+	for( int y = 0; y <= rows; y++ ) {
+		for( int x = 0; x <= cols; x++ ) {
+			float px = -hw + 2.0f * hw * x / cols;
+			float py = -hh + 2.0f * hh * y / rows;
+			int i = addVertex( b, px, py, -z, 0, 0, 1 );
+			setTexCoord( b, i, (c * px - s * py) / (2.0f * hw), (s * px + c * py) / (2.0f * hw) );
+		}
+	}
+	for( int y = 0; y < rows; y++ ) {
+		for( int x = 0; x < cols; x++ ) {
+			int i = first + y * (cols + 1) + x;
+			addTriangle( b, i, i + 1, i + cols + 2 );
+			addTriangle( b, i, i + cols + 2, i + cols + 1 );
+		}
+	}
+}
+
+// Puts what was built into the scene as one object, as it is.
+static void addBuilt(scene* s, meshBuilder* b) {
+	b->v.count = b->vertices;
+	matrix world;
+	matrixId( &world );
+	addSceneObject( s, addSceneModel( s, makeModelFromStreams( b->v, b->indices, b->tris ) ), world );
+}
+
+// Same numbers on every machine, every run.
+static float randomUnit(uint32_t* state) {
+	*state = *state * 1664525u + 1013904223u;
+	return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// One screen of quads, param quads per row (rows to match the 16:9
+// frames), most of them under a pixel.
+static void makeGridScene(scene* s, const view* v, const model* suzanne, int param) {
+	int cols = param;
+	int rows = param * 9 / 16;
+	meshBuilder b = makeMeshBuilder( (cols + 1) * (rows + 1), cols * rows * 2 );
+	addGrid( &b, v, DEPTH, cols, rows, 0 );
+	addBuilt( s, &b );
+}
+
+// param layers of 2x2 screen covering quads, 8 triangles each, drawn front
+// to back (param > 0) or back to front (param < 0).
+static void makeLayerScene(scene* s, const view* v, const model* suzanne, int param) {
+	int layers = abs( param );
+	meshBuilder b = makeMeshBuilder( layers * 9, layers * 8 );
+	for( int i = 0; i < layers; i++ ) {
+		addGrid( &b, v, DEPTH + (param > 0 ? i : layers - 1 - i), 2, 2, 0 );
+	}
+	addBuilt( s, &b );
+}
+
+// One screen covering layer with the texture turned param degrees: with
+// texels in Z order, what a pixel costs should not depend on the angle.
+static void makeTurnedScene(scene* s, const view* v, const model* suzanne, int param) {
+	meshBuilder b = makeMeshBuilder( 9, 8 );
+	addGrid( &b, v, DEPTH, 2, 2, (float)param );
+	addBuilt( s, &b );
+}
+
+// param long triangles half a pixel thick, at random angles.
+static void makeSliverScene(scene* s, const view* v, const model* suzanne, int param) {
+	meshBuilder b = makeMeshBuilder( param * 3, param );
+	uint32_t seed = 12345;
+	for( int i = 0; i < param; i++ ) {
+		float z = DEPTH + 4.0f * randomUnit( &seed );
+		float hh = halfHeightAt( v, z );
+		float hw = hh * v->aspect;
+		float cx = (randomUnit( &seed ) * 2.0f - 1.0f) * hw;
+		float cy = (randomUnit( &seed ) * 2.0f - 1.0f) * hh;
+		float angle = randomUnit( &seed ) * (float)scalarPI;
+		float dx = cosf( angle ) * hw * 0.5f;
+		float dy = sinf( angle ) * hw * 0.5f;
+		float thick = 0.5f * pixelAt( v, z ) / hw * 2.0f;
+		int a = addVertex( &b, cx - dx, cy - dy, -z, 0, 0, 1 );
+		int c = addVertex( &b, cx + dx, cy + dy, -z, 0, 0, 1 );
+		int d = addVertex( &b, cx - dy * thick, cy + dx * thick, -z, 0, 0, 1 );
+		addTriangle( &b, a, c, d );
+	}
+	addBuilt( s, &b );
+}
+
+// A floor of param x param quads reaching far out in every direction from
+// just below the camera, so it crosses the near plane and reaches past the
+// screen edges: what a fly-through looks like. Textured, it repeats every
+// two units, from magnified close by to many texels a pixel far out.
+static void makeFloorScene(scene* s, const view* v, const model* suzanne, int param) {
+	float size = 4.0f * DEPTH;
+	meshBuilder b = makeMeshBuilder( (param + 1) * (param + 1), param * param * 2 );
+	for( int z = 0; z <= param; z++ ) {
+		for( int x = 0; x <= param; x++ ) {
+			float px = -size + 2.0f * size * x / param;
+			float pz = -size + 2.0f * size * z / param;
+			setTexCoord( &b, addVertex( &b, px, -1.0f, pz, 0, 1, 0 ), px * 0.5f, pz * 0.5f );
+		}
+	}
+	for( int z = 0; z < param; z++ ) {
+		for( int x = 0; x < param; x++ ) {
+			int i = z * (param + 1) + x;
+			addTriangle( &b, i, i + 1, i + param + 2 );
+			addTriangle( &b, i, i + param + 2, i + param + 1 );
+		}
+	}
+	addBuilt( s, &b );
+}
+
+// param copies of suzanne in a grid filling the screen.
+static void makeSuzanneScene(scene* s, const view* v, const model* suzanne, int param) {
+	int count = modelVertexCount( (model*)suzanne );
+	int tris = modelTriangleCount( (model*)suzanne );
+	meshBuilder b = makeMeshBuilder( count * param, tris * param );
+
+	int cols = (int)ceilf( sqrtf( param * v->aspect ) );
+	int rows = (param + cols - 1) / cols;
+	float hh = halfHeightAt( v, DEPTH );
+	float hw = hh * v->aspect;
+	float cell = fminf( 2.0f * hw / cols, 2.0f * hh / rows );
+	vec3 lo = suzanne->boundsMin;
+	vec3 hi = suzanne->boundsMax;
+	float size = fmaxf( hi.x - lo.x, fmaxf( hi.y - lo.y, hi.z - lo.z ) );
+	float scale = cell / size;
+
+	const vertexStreams* src = &suzanne->vertices;
+	for( int n = 0; n < param; n++ ) {
+		float ox = -hw + cell * (n % cols + 0.5f);
+		float oy = -hh + cell * (n / cols + 0.5f);
+		int first = b.vertices;
+		for( int i = 0; i < count; i++ ) {
+			addVertex( &b,
+				ox + (src->x[i] - (lo.x + hi.x) * 0.5f) * scale,
+				oy + (src->y[i] - (lo.y + hi.y) * 0.5f) * scale,
+				-DEPTH + (src->z[i] - (lo.z + hi.z) * 0.5f) * scale,
+				src->nx[i], src->ny[i], src->nz[i]
+			);
+		}
+		// Keep suzanne's own winding, back faces are part of the load.
+		for( int i = 0; i < tris * 3; i++ ) {
+			b.indices[b.tris * 3 + i] = first + suzanne->indices[i];
+		}
+		b.tris += tris;
+	}
+	addBuilt( s, &b );
+}
+
+// param x param objects sharing one suzanne, on a grid around the camera
+// at eye level, each turned some way: only those in the frustum should
+// cost anything.
+static void makeCityScene(scene* s, const view* v, const model* suzanne, int param) {
+	int count = modelVertexCount( (model*)suzanne );
+	int tris = modelTriangleCount( (model*)suzanne );
+	meshBuilder b = makeMeshBuilder( count, tris );
+	const vertexStreams* src = &suzanne->vertices;
+	for( int i = 0; i < count; i++ ) {
+		addVertex( &b, src->x[i], src->y[i], src->z[i], src->nx[i], src->ny[i], src->nz[i] );
+	}
+	memcpy( b.indices, suzanne->indices, sizeof(uint32_t) * 3 * tris );
+	b.tris = tris;
+	b.v.count = b.vertices;
+	int mesh = addSceneModel( s, makeModelFromStreams( b.v, b.indices, b.tris ) );
+
+	float spacing = 4.0f;
+	uint32_t seed = 12345;
+	for( int z = 0; z < param; z++ ) {
+		for( int x = 0; x < param; x++ ) {
+			matrix place, turn, world;
+			matrixTranslate( &place, -(x - param / 2 + 0.5f) * spacing, 1.0f, -(z - param / 2 + 0.5f) * spacing );
+			matrixRotY( &turn, randomUnit( &seed ) * 2.0f * (float)scalarPI );
+			matrixMult( &world, place, turn );
+			addSceneObject( s, mesh, world );
+		}
+	}
+}
+
+// The city, with param lights of random colours and short range over
+// its middle, each reaching a few copies: lighting should cost by the
+// lights near a vertex, not by all of them.
+static void makeLitCityScene(scene* s, const view* v, const model* suzanne, int param) {
+	makeCityScene( s, v, suzanne, 64 );
+	s->lights.lights[0].colour = makeColour( 0.25f, 0.25f, 0.25f );
+	float extent = 64.0f;
+	uint32_t seed = 777;
+	for( int i = 0; i < param; i++ ) {
+		float x = (randomUnit( &seed ) - 0.5f) * extent;
+		float z = (randomUnit( &seed ) - 0.5f) * extent;
+		colour c = makeColour( randomUnit( &seed ), randomUnit( &seed ), randomUnit( &seed ) );
+		addLight( &s->lights, makePointLight( makeVec3( x, 0.5f, z ), c, 6.0f ) );
+	}
+}
+
+// A sphere of param rings of 2 * param quads, far away: a lot of
+// triangles on a few pixels. With levels of detail for negative param.
+static void makeSphereScene(scene* s, const view* v, const model* suzanne, int param) {
+	int rows = abs( param );
+	int cols = 2 * rows;
+	meshBuilder b = makeMeshBuilder( (rows + 1) * (cols + 1), 2 * cols * rows );
+	float depth = 2.4f * DEPTH;
+	for( int y = 0; y <= rows; y++ ) {
+		float theta = (float)scalarPI * y / rows;
+		for( int x = 0; x <= cols; x++ ) {
+			float phi = 2.0f * (float)scalarPI * x / cols;
+			float nx = sinf( theta ) * cosf( phi );
+			float ny = cosf( theta );
+			float nz = sinf( theta ) * sinf( phi );
+			addVertex( &b, nx, ny, nz - depth, nx, ny, nz );
+		}
+	}
+
+	// Around the poles one of the two triangles of each quad is a point.
+	for( int y = 0; y < rows; y++ ) {
+		for( int x = 0; x < cols; x++ ) {
+			int i = y * (cols + 1) + x;
+			if( y != rows - 1 ) {
+				addTriangle( &b, i + cols + 2, i + cols + 1, i );
+			}
+			if( y != 0 ) {
+				addTriangle( &b, i, i + 1, i + cols + 2 );
+			}
+		}
+	}
+	addBuilt( s, &b );
+	if( param < 0 ) {
+		buildSceneLods( s, 0, 16 );
+	}
+}
+
+// param x param copies of one small rock, each their own object, on a
+// screen filling grid: lots of tiny draws of one model.
+static void makeRockScene(scene* s, const view* v, const model* suzanne, int param) {
+	int rows = 4;
+	int cols = 2 * rows;
+	meshBuilder b = makeMeshBuilder( (rows + 1) * (cols + 1), 2 * cols * rows );
+	for( int y = 0; y <= rows; y++ ) {
+		float theta = (float)scalarPI * y / rows;
+		for( int x = 0; x <= cols; x++ ) {
+			float phi = 2.0f * (float)scalarPI * (x % cols) / cols;
+			float nx = sinf( theta ) * cosf( phi );
+			float ny = cosf( theta );
+			float nz = sinf( theta ) * sinf( phi );
+
+			// Bumpy, but the same on both sides of the seam.
+			uint32_t bump = (uint32_t)(y * cols + x % cols + 1) * 2654435761u;
+			float r = y == 0 || y == rows ? 1.0f : 0.8f + 0.4f * (bump >> 8) * (1.0f / 16777216.0f);
+			addVertex( &b, nx * r, ny * r, nz * r, nx, ny, nz );
+		}
+	}
+	for( int y = 0; y < rows; y++ ) {
+		for( int x = 0; x < cols; x++ ) {
+			int i = y * (cols + 1) + x;
+			if( y != rows - 1 ) {
+				addTriangle( &b, i + cols + 2, i + cols + 1, i );
+			}
+			if( y != 0 ) {
+				addTriangle( &b, i, i + 1, i + cols + 2 );
+			}
+		}
+	}
+	b.v.count = b.vertices;
+	int rock = addSceneModel( s, makeModelFromStreams( b.v, b.indices, b.tris ) );
+
+	float hh = halfHeightAt( v, DEPTH );
+	float hw = hh * v->aspect;
+	float cell = 2.0f * hw / param;
+	uint32_t seed = 4711;
+	for( int z = 0; z < param; z++ ) {
+		for( int x = 0; x < param; x++ ) {
+			matrix place, turn, size, world;
+			matrixTranslate( &place, -(-hw + cell * (x + 0.5f)), -(-hh + cell * (z + 0.5f) * hh / hw), DEPTH );
+			matrixRotY( &turn, randomUnit( &seed ) * 2.0f * (float)scalarPI );
+
+			// matrixScale divides, like a camera zooming.
+			matrixScale( &size, 2.5f / cell, 2.5f / cell, 2.5f / cell );
+			matrixMult( &world, place, turn );
+			matrixMult( &world, world, size );
+			addSceneObject( s, rock, world );
+		}
+	}
+}
+
+typedef void (*sceneBuilder)(scene* s, const view* v, const model* suzanne, int param);
+
+// Textured scenes use a checker board, made once.
+static texture checker;
+
+// Scenes are drawn with the default pipeline state unless they say
+// otherwise, which zero initialized is.
+typedef struct benchScene {
+	const char* name;
+	sceneBuilder build;
+	int param;
+	pipelineState state;
+} benchScene;
+
+static const benchScene scenes[] = {
+	{ "grid", makeGridScene, 1280 },
+	{ "fullscreen", makeLayerScene, 1 },
+	{ "overdraw_front_to_back", makeLayerScene, 10 },
+	{ "overdraw_back_to_front", makeLayerScene, -10 },
+	{ "overdraw_flat", makeLayerScene, -10, { SHADE_FLAT, DEPTH_TEST_WRITE, COLOUR_WRITE } },
+	{ "overdraw_depth_only", makeLayerScene, -10, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_OFF } },
+	{ "overdraw_no_depth", makeLayerScene, -10, { SHADE_GOURAUD, DEPTH_OFF, COLOUR_WRITE } },
+	{ "overdraw_additive", makeLayerScene, -10, { SHADE_GOURAUD, DEPTH_TEST, COLOUR_ADD } },
+	{ "slivers", makeSliverScene, 4000 },
+	{ "floor", makeFloorScene, 64 },
+	{ "floor_nearest", makeFloorScene, 64, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_NEAREST } },
+	{ "floor_bilinear", makeFloorScene, 64, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_BILINEAR } },
+	{ "floor_trilinear", makeFloorScene, 64, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_TRILINEAR } },
+	{ "textured_0", makeTurnedScene, 0, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_BILINEAR } },
+	{ "textured_45", makeTurnedScene, 45, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_BILINEAR } },
+	{ "textured_90", makeTurnedScene, 90, { SHADE_GOURAUD, DEPTH_TEST_WRITE, COLOUR_WRITE, &checker, FILTER_BILINEAR } },
+	{ "suzanne_1", makeSuzanneScene, 1 },
+	{ "suzanne_64", makeSuzanneScene, 64 },
+	{ "suzanne_1024", makeSuzanneScene, 1024 },
+	{ "suzanne_1024_flat", makeSuzanneScene, 1024, { SHADE_FLAT, DEPTH_TEST_WRITE, COLOUR_WRITE } },
+	{ "city", makeCityScene, 64 },
+	{ "city_lights", makeLitCityScene, 256 },
+	{ "rocks", makeRockScene, 100 },
+	{ "sphere_far", makeSphereScene, 256 },
+	{ "sphere_far_lod", makeSphereScene, -256 },
+};
+
+#define SCENES ((int)(sizeof(scenes) / sizeof(scenes[0])))
+
+typedef struct options {
+	const char* output;
+	const char* only;
+	int threads;
+	pixelFormat format;
+	bool visibility;
+	int samples;
+	double seconds;
+} options;
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [options] [scene]\n"
+		"  -o file     write the JSON results there, default stdout\n"
+		"  -t threads  worker threads, default one per processor\n"
+		"  -p format   float, rgba8, rgb565 or half, default rgba8\n"
+		"  -V          draw into a visibility buffer, shade when resolving\n"
+		"  -A samples  multisample anti-aliasing, 2, 4 or 8 samples per pixel\n"
+		"  -s seconds  time to spend on each scene and resolution, default 0.5\n"
+		"  scene       only run scenes whose name starts with this\n",
+		name
+	);
+	exit(1);
+}
+
+static options parseOptions(int argc, char** argv) {
+	options o;
+	o.output = NULL;
+	o.only = NULL;
+	o.threads = processorCount();
+	o.format = PIXEL_RGBA8;
+	o.visibility = false;
+	o.samples = 1;
+	o.seconds = 0.5;
+
+	int c;
+	while( (c = getopt( argc, argv, "o:t:p:VA:s:" )) != -1 ) {
+		switch( c ) {
+			case 'o': o.output = optarg; break;
+			case 't': o.threads = atoi( optarg ); break;
+			case 's': o.seconds = atof( optarg ); break;
+			case 'V': o.visibility = true; break;
+			case 'A':
+				o.samples = atoi( optarg );
+				if( o.samples != 1 && o.samples != 2 && o.samples != 4 && o.samples != 8 ) {
+					usage( argv[0] );
+				}
+			break;
+			case 'p':
+				if( !pixelFormatNamed( optarg, &o.format ) ) {
+					usage( argv[0] );
+				}
+			break;
+			default: usage( argv[0] );
+		}
+	}
+	if( optind < argc ) {
+		o.only = argv[optind++];
+	}
+	if( optind != argc || o.threads < 1 || o.seconds < 0.0 ) {
+		usage( argv[0] );
+	}
+	return o;
+}
+
+// Times frames of one scene until the time is up, at least 3 after one
+// to warm up, and writes its record.
+static void runScene(FILE* out, tiler* t, const benchScene* b, const model* suzanne, int width, int height, const options* o, bool first) {
+	view v;
+	v.width = width;
+	v.height = height;
+	v.aspect = (float)width / (float)height;
+	v.tanHalf = tanf( FOV * (float)scalarPI / 360.0f );
+
+	scene sc = makeScene();
+	addLight( &sc.lights, makePointLight( makeVec3( 5, 5, 5 ), COLOUR_WHITE, 0 ) );
+	b->build( &sc, &v, suzanne, b->param );
+	t->state = b->state;
+	renderTarget rt = makeRenderTarget( width, height, o->format );
+	setVisibilityMode( &rt, o->visibility );
+	setMultisampling( &rt, o->samples );
+
+	matrix viewMatrix, pMatrix;
+	matrixId( &viewMatrix );
+	matrixPerspective( &pMatrix, FOV, v.aspect, 1.0, 32.0 );
+
+	int capacity = 64;
+	double* times[STEPS + 1];
+	for( int i = 0; i <= STEPS; i++ ) {
+		times[i] = (double*)malloc( sizeof(double) * capacity );
+	}
+	double* cycles = (double*)malloc( sizeof(double) * capacity );
+
+	int frames = 0;
+	double start = 0.0;
+	for( int f = -1; f < 3 || timeNow() - start < o->seconds; f++ ) {
+		if( f == 0 ) {
+			start = timeNow();
+		}
+
+		double step[STEPS] = { 0 };
+		uint64_t c0 = cycleCount();
+		double frameStart = timeNow();
+		clearTarget( &rt, COLOUR_BLACK, FLT_MIN );
+		double stamp = timeNow();
+		step[STEP_CLEAR] = stamp - frameStart;
+		cullScene( &sc, viewMatrix, pMatrix, &rt.stats );
+		double culled = timeNow();
+		step[STEP_CULL] = culled - stamp;
+		drawVisible( &sc, t, &rt, viewMatrix, pMatrix );
+		step[STEP_DRAW] = timeNow() - culled;
+		stamp = timeNow();
+		resolveTiled( t, &rt );
+		double frameEnd = timeNow();
+		step[STEP_RESOLVE] = frameEnd - stamp;
+		uint64_t c1 = cycleCount();
+		if( f < 0 ) {
+			continue;
+		}
+
+		if( frames == capacity ) {
+			capacity *= 2;
+			for( int i = 0; i <= STEPS; i++ ) {
+				times[i] = (double*)realloc( times[i], sizeof(double) * capacity );
+			}
+			cycles = (double*)realloc( cycles, sizeof(double) * capacity );
+		}
+		for( int i = 0; i < STEPS; i++ ) {
+			times[i][frames] = step[i];
+		}
+		times[STEPS][frames] = frameEnd - frameStart;
+		cycles[frames] = (double)(c1 - c0);
+		frames++;
+	}
+
+	// Medians throughout, one slow frame shouldn't move the numbers.
+	for( int i = 0; i <= STEPS; i++ ) {
+		sortTimes( times[i], frames );
+	}
+	sortTimes( cycles, frames );
+	double frame = percentile( times[STEPS], frames, 0.5 );
+	double pixels = (double)width * height;
+	int tris = sceneTriangleCount( &sc );
+	int drawn = 0;
+	for( int i = 0; i < sc.visibleCount; i++ ) {
+		drawn += sc.models[sceneObjectLod( &sc, sc.visible[i], viewMatrix, pMatrix, height )].triangleCount;
+	}
+	int vertices = 0;
+	for( int i = 0; i < sc.objectCount; i++ ) {
+		vertices += modelVertexCount( &sc.models[sc.objects[i].model] );
+	}
+
+	fprintf( out, "%s\t\t{\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"triangles\": %d, \"vertices\": %d, \"frames\": %d,\n",
+		first ? "" : ",\n", b->name, width, height, tris, vertices, frames
+	);
+	fprintf( out, "\t\t \"objects\": %d, \"objects_in_view\": %d, \"triangles_drawn\": %d, \"lights\": %d, \"texture_filter\": ", sc.objectCount, sc.visibleCount, drawn, sc.lights.count );
+	if( b->state.texture ) {
+		fprintf( out, "\"%s\",\n", textureFilterName( b->state.filter ) );
+	}
+	else {
+		fprintf( out, "null,\n" );
+	}
+	fprintf( out, "\t\t \"frame_ns\": %.0f, \"frame_ns_min\": %.0f, \"frame_ns_p99\": %.0f,\n",
+		frame * 1e9, times[STEPS][0] * 1e9, percentile( times[STEPS], frames, 0.99 ) * 1e9
+	);
+	fprintf( out, "\t\t \"triangles_per_s\": %.0f, \"pixels_per_s\": %.0f, \"cycles_per_pixel\": ",
+		tris / frame, pixels / frame
+	);
+	if( haveCycleCounter() ) {
+		fprintf( out, "%.3f,\n", percentile( cycles, frames, 0.5 ) / pixels );
+	}
+	else {
+		fprintf( out, "null,\n" );
+	}
+	fprintf( out, "\t\t \"stage_ns\": {" );
+	for( int i = 0; i < STEPS; i++ ) {
+		fprintf( out, "%s\"%s\": %.0f", i ? ", " : "", stepNames[i], percentile( times[i], frames, 0.5 ) * 1e9 );
+	}
+	fprintf( out, "}" );
+#ifdef RASTER_STATS
+	// Counters and stage times of the last frame, every frame is the same.
+	fprintf( out, ",\n\t\t \"counters\": {" );
+	for( int i = 0; i < STAT_COUNTERS; i++ ) {
+		fprintf( out, "%s\"%s\": %ld", i ? ", " : "", statCounterName( (statCounter)i ), rt.stats.counters[i] );
+	}
+	fprintf( out, "},\n\t\t \"stats_stage_ns\": {" );
+	for( int i = 0; i < STAGE_COUNT; i++ ) {
+		fprintf( out, "%s\"%s\": %.0f", i ? ", " : "", frameStageName( (frameStage)i ), rt.stats.seconds[i] * 1e9 );
+	}
+	fprintf( out, "}" );
+#endif
+	fprintf( out, "}" );
+	fflush( out );
+
+	fprintf( stderr, "%-24s %4dx%-4d %8d tris %9.3f ms\n", b->name, width, height, tris, frame * 1e3 );
+
+	for( int i = 0; i <= STEPS; i++ ) {
+		free( times[i] );
+	}
+	free( cycles );
+	freeRenderTarget( rt );
+	freeScene( &sc );
+}
+
+int main(int argc, char **argv) {
+	options o = parseOptions( argc, argv );
+
+	FILE* out = stdout;
+	if( o.output ) {
+		out = fopen( o.output, "w" );
+		if( !out ) {
+			fprintf(stderr, "Error: Couldn't open \"%s\" for writing.\n", o.output);
+			exit(1);
+		}
+	}
+
+	tiler t = makeTiler( o.threads );
+	model suzanne = makeModelFromFile( "suzanne.raw", t.pool );
+	checker = makeCheckerTexture( 1024, 64, makeColour( 0.9f, 0.9f, 0.9f ), makeColour( 0.2f, 0.3f, 0.6f ) );
+
+#ifdef RASTER_SIMD
+	const char* simd = "true";
+#else
+	const char* simd = "false";
+#endif
+	fprintf( out, "{\n\t\"threads\": %d,\n\t\"simd\": %s,\n\t\"format\": \"%s\",\n\t\"visibility\": %s,\n\t\"samples\": %d,\n\t\"runs\": [\n",
+		workerCount( t.pool ), simd, pixelFormatName( o.format ), o.visibility ? "true" : "false", o.samples
+	);
+	bool first = true;
+	for( int s = 0; s < SCENES; s++ ) {
+		if( o.only && strncmp( scenes[s].name, o.only, strlen( o.only ) ) != 0 ) {
+			continue;
+		}
+		for( int r = 0; r < (int)(sizeof(resolutions) / sizeof(resolutions[0])); r++ ) {
+			runScene( out, &t, &scenes[s], &suzanne, resolutions[r][0], resolutions[r][1], &o, first );
+			first = false;
+		}
+	}
+	fprintf( out, "\n\t]\n}\n" );
+
+	if( out != stdout && fclose( out ) != 0 ) {
+		fprintf(stderr, "Error: Couldn't write \"%s\".\n", o.output);
+		exit(1);
+	}
+	freeModel( &suzanne );
+	freeTexture( &checker );
+	freeTiler( &t );
+	return 0;
+}
@@ -4,66 +4,702 @@
  * (c) L. Diener 2010
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "buffers.h"
 #include "vectors.h"
-#include "bmp_handler.h"
+#include "images.h"
 
+#include <float.h>
 #include <stdlib.h>
+#include <string.h>
 /*#include <sys/ipc.h>
 #include <sys/shm.h>*/
 
-buffer makeBuffer(int width, int height) {
+// Everything is cache line aligned, so SIMD loads of a block row never
+// straddle more lines than they have to.
+#define BUFFER_ALIGN 64
+
+static void* alignedAlloc(size_t size) {
+	void* p = NULL;
+	if( posix_memalign( &p, BUFFER_ALIGN, size ) != 0 ) {
+		fprintf(stderr, "Error: Out of memory allocating %lu bytes.\n", (unsigned long)size);
+		exit(1);
+	}
+	return p;
+}
+
+static const char* formatNames[] = { "float", "rgba8", "rgb565", "half" };
+
+const char* pixelFormatName(pixelFormat format) {
+	return formatNames[format];
+}
+
+bool pixelFormatNamed(const char* name, pixelFormat* format) {
+	for( int i = 0; i < 4; i++ ) {
+		if( strcmp( name, formatNames[i] ) == 0 ) {
+			*format = (pixelFormat)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+float halfToFloat(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t rest = h & 0x7fff;
+	uint32_t bits;
+	if( rest == 0 ) {
+		bits = sign;
+	}
+	else if( rest < 0x0400 ) {
+		// Denormal, not produced by floatToHalf but valid.
+		float f = rest * (1.0f / 16777216.0f);
+		memcpy( &bits, &f, sizeof(bits) );
+		bits |= sign;
+	}
+	else if( rest >= 0x7c00 ) {
+		bits = sign | 0x7f800000 | ((rest & 0x3ff) << 13);
+	}
+	else {
+		bits = sign | ((rest + ((127 - 15) << 10)) << 13);
+	}
+	float f;
+	memcpy( &f, &bits, sizeof(f) );
+	return f;
+}
+
+colour unpackPixel(const void* src, pixelFormat format) {
+	switch( format ) {
+		case PIXEL_RGBA8: {
+			const uint8_t* p = (const uint8_t*)src;
+			return makeColourA( p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f, p[3] / 255.0f );
+		}
+
+		case PIXEL_RGB565: {
+			uint16_t v;
+			memcpy( &v, src, sizeof(v) );
+			return makeColour( (v >> 11) / 31.0f, ((v >> 5) & 63) / 63.0f, (v & 31) / 31.0f );
+		}
+
+		case PIXEL_HALF: {
+			uint16_t v[4];
+			memcpy( v, src, sizeof(v) );
+			return makeColourA( halfToFloat( v[0] ), halfToFloat( v[1] ), halfToFloat( v[2] ), halfToFloat( v[3] ) );
+		}
+
+		default: {
+			colour c;
+			memcpy( &c, src, sizeof(c) );
+			return c;
+		}
+	}
+}
+
+static void* pixelAt(buffer b, int x, int y) {
+	return (uint8_t*)b.data + (size_t)(x + b.width * y) * pixelSize( b.format );
+}
+
+// Fills count pixels from dst with one already packed pixel.
+static void fillPixels(void* dst, pixelFormat format, const void* pixel, int count) {
+	switch( pixelSize( format ) ) {
+		case 2: {
+			uint16_t v;
+			memcpy( &v, pixel, sizeof(v) );
+			for( int i = 0; i < count; i++ ) {
+				((uint16_t*)dst)[i] = v;
+			}
+		}
+		break;
+
+		case 4: {
+			uint32_t v;
+			memcpy( &v, pixel, sizeof(v) );
+			for( int i = 0; i < count; i++ ) {
+				((uint32_t*)dst)[i] = v;
+			}
+		}
+		break;
+
+		case 8: {
+			uint64_t v;
+			memcpy( &v, pixel, sizeof(v) );
+			for( int i = 0; i < count; i++ ) {
+				((uint64_t*)dst)[i] = v;
+			}
+		}
+		break;
+
+		default: {
+			colour v;
+			memcpy( &v, pixel, sizeof(v) );
+			for( int i = 0; i < count; i++ ) {
+				((colour*)dst)[i] = v;
+			}
+		}
+		break;
+	}
+}
+
+buffer makeBuffer(int width, int height, pixelFormat format) {
 	buffer b;
 	b.width = width;
 	b.firstLine = 0;
 	b.size = height;
+	b.format = format;
 	/*b.memid = shmget(
 		(key_t)0,
 		sizeof( colour ) * width * height,
 		0660|IPC_CREAT|IPC_PRIVATE
 	);*/
-	b.data = (colour*)malloc(sizeof( colour ) * width * height);
+	b.data = alignedAlloc((size_t)pixelSize( format ) * width * height);
 	return b;
 }
 
+// A view onto lines [firstLine, size) of the parent. Shares the data, so
+// coordinates stay absolute.
 buffer partialBuffer(buffer b, int index, int parts) {
+	return alignedPartialBuffer( b, index, parts, 1 );
+}
+
+// Same, but splits only at multiples of align lines from the top.
+buffer alignedPartialBuffer(buffer b, int index, int parts, int align) {
 	buffer p = b;
-	p.size /= parts;
-	p.firstLine += p.size * index;
+	int lines = b.size - b.firstLine;
+	int units = (lines + align - 1) / align;
+	int first = align * ((units * index) / parts);
+	int last = align * ((units * (index + 1)) / parts);
+	p.firstLine = b.firstLine + (first < lines ? first : lines);
+	p.size = b.firstLine + (last < lines ? last : lines);
 	return p;
 }
 
 inline void setPixel(buffer b, int x, int y, colour c) {
-	b.data[x+b.width*y] = c;
+	packPixel( pixelAt( b, x, y ), b.format, c );
+}
+
+colour getPixel(buffer b, int x, int y) {
+	return unpackPixel( pixelAt( b, x, y ), b.format );
 }
 
 void expose(buffer b, scalar factor, scalar gamma) {
 	for( int x = 0; x < b.width; x++ ) {
 		for( int y = b.firstLine; y < b.size; y++ ) {
-			scale( &b.data[x+b.width*y], factor );
-			applyGamma( &b.data[x+b.width*y], 1.0f / gamma);
-			clip( &b.data[x+b.width*y] );
+			colour c = getPixel( b, x, y );
+			scale( &c, factor );
+			applyGamma( &c, 1.0f / gamma);
+			clip( &c );
+			setPixel( b, x, y, c );
 		}
 	}
 }
 
 void clear(buffer b) {
-	for( int x = 0; x < b.width; x++ ) {
-		for( int y = b.firstLine; y < b.size; y++ ) {
-			b.data[x+b.width*y] = COLOUR_BLACK;
+	uint8_t pixel[sizeof(colour)];
+	packPixel( pixel, b.format, COLOUR_BLACK );
+	fillPixels( pixelAt( b, 0, b.firstLine ), b.format, pixel, b.width * (b.size - b.firstLine) );
+}
+
+// One line of the buffer as RGB8, whatever its format.
+static void rowToRGB(buffer b, int y, uint8_t* rgb) {
+	const uint8_t* src = (const uint8_t*)pixelAt( b, 0, y );
+	switch( b.format ) {
+		case PIXEL_RGBA8:
+			for( int x = 0; x < b.width; x++, src += 4, rgb += 3 ) {
+				rgb[0] = src[0];
+				rgb[1] = src[1];
+				rgb[2] = src[2];
+			}
+		break;
+
+		case PIXEL_FLOAT: {
+			const colour* c = (const colour*)src;
+			for( int x = 0; x < b.width; x++, rgb += 3 ) {
+				rgb[0] = (uint8_t)unitToInt( c[x].r, 255 );
+				rgb[1] = (uint8_t)unitToInt( c[x].g, 255 );
+				rgb[2] = (uint8_t)unitToInt( c[x].b, 255 );
+			}
 		}
+		break;
+
+		default:
+			for( int x = 0; x < b.width; x++, src += pixelSize( b.format ), rgb += 3 ) {
+				colour c = unpackPixel( src, b.format );
+				rgb[0] = (uint8_t)unitToInt( c.r, 255 );
+				rgb[1] = (uint8_t)unitToInt( c.g, 255 );
+				rgb[2] = (uint8_t)unitToInt( c.b, 255 );
+			}
+		break;
 	}
 }
 
+// Format from the extension: .png, .ppm or BMP otherwise. Lines go bottom
+// up in buffers, so the last one is the top of the image.
 void writeToImage(buffer b, const char* filename) {
-	bmp_init( filename, b.width, b.size );
-	for( int y = b.firstLine; y < b.size; y++ ) {
-		for( int x = 0; x < b.width; x++ ) {
-			vec3 c = getRGB( b.data[x+b.width*y] );
-			bmp_pixel( (int)c.x, (int)c.y, (int)c.z );
+	imageWriter w = makeImageWriter( filename, imageFormatFor( filename ), b.width, b.size - b.firstLine );
+	for( int y = b.size - 1; y >= b.firstLine; y-- ) {
+		rowToRGB( b, y, imageRow( &w ) );
+		writeImageRow( &w );
+	}
+	freeImageWriter( &w );
+}
+
+depthBuffer makeDepthBuffer(int width, int height) {
+	depthBuffer d;
+	d.width = width;
+	d.height = height;
+	d.samples = 1;
+	d.pitch = width;
+	d.blocksX = (width + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+	d.blocksY = (height + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+	d.data = (float*)alignedAlloc(sizeof( float ) * width * height);
+	d.blockMin = (float*)alignedAlloc(sizeof( float ) * d.blocksX * d.blocksY);
+	return d;
+}
+
+void clearDepth(depthBuffer* d, float value) {
+	for( size_t i = 0; i < (size_t)d->pitch * d->height * d->samples; i++ ) {
+		d->data[i] = value;
+	}
+	for( int i = 0; i < d->blocksX * d->blocksY; i++ ) {
+		d->blockMin[i] = value;
+	}
+}
+
+void freeDepthBuffer(depthBuffer d) {
+	free(d.data);
+	free(d.blockMin);
+}
+
+renderTarget makeRenderTarget(int width, int height, pixelFormat format) {
+	renderTarget rt;
+	rt.colour = makeBuffer( width, height, format );
+	rt.depth = makeDepthBuffer( width, height );
+	rt.blockFrame = (unsigned int*)calloc( rt.depth.blocksX * rt.depth.blocksY, sizeof(unsigned int) );
+	rt.frame = 0;
+#ifdef RASTER_STATS
+	rt.overdraw = (uint16_t*)alignedAlloc( sizeof(uint16_t) * width * height );
+#else
+	rt.overdraw = NULL;
+#endif
+	rt.ids = NULL;
+	rt.shading = NULL;
+	rt.shadingCount = 0;
+	rt.shadingCapacity = 0;
+	rt.samples = 1;
+	memset( rt.sampleX, 0, sizeof(rt.sampleX) );
+	memset( rt.sampleY, 0, sizeof(rt.sampleY) );
+	rt.mixed = NULL;
+	rt.sampleColours = NULL;
+	clearTarget( &rt, COLOUR_BLACK, FLT_MIN );
+	return rt;
+}
+
+// O(blocks): only the depth bounds (and overdraw counts, with
+// RASTER_STATS) are reset right away.
+void clearTarget(renderTarget* rt, colour c, float depth) {
+	int blocks = rt->depth.blocksX * rt->depth.blocksY;
+
+	rt->clearColour = c;
+	packPixel( rt->clearPixel, rt->colour.format, c );
+	rt->clearDepth = depth;
+	rt->frame++;
+	if( rt->frame == 0 ) {
+		// Wrapped around, make sure no block looks current by accident.
+		for( int i = 0; i < blocks; i++ ) {
+			rt->blockFrame[i] = 0;
+		}
+		rt->frame = 1;
+	}
+
+	for( int i = 0; i < blocks; i++ ) {
+		rt->depth.blockMin[i] = depth;
+	}
+
+	rt->shadingCount = 0;
+	memset( &rt->stats, 0, sizeof(frameStats) );
+	rt->stats.frame = rt->frame;
+	if( rt->overdraw ) {
+		memset( rt->overdraw, 0, sizeof(uint16_t) * rt->depth.width * rt->depth.height );
+	}
+}
+
+// Fills one block's pixels with the clear colour.
+static void fillBlock(renderTarget* rt, int bx, int by) {
+	int width = rt->colour.width;
+	int x0 = bx * DEPTH_BLOCK;
+	int x1 = (bx + 1) * DEPTH_BLOCK < width ? (bx + 1) * DEPTH_BLOCK : width;
+	int y1 = (by + 1) * DEPTH_BLOCK < rt->depth.height ? (by + 1) * DEPTH_BLOCK : rt->depth.height;
+	for( int y = by * DEPTH_BLOCK; y < y1; y++ ) {
+		fillPixels( pixelAt( rt->colour, x0, y ), rt->colour.format, rt->clearPixel, x1 - x0 );
+	}
+}
+
+// Actually clear one block, if it has not been this frame.
+void prepareBlock(renderTarget* rt, int bx, int by) {
+	int i = by * rt->depth.blocksX + bx;
+	if( rt->blockFrame[i] == rt->frame ) {
+		return;
+	}
+	rt->blockFrame[i] = rt->frame;
+
+	// Visibility mode colours every pixel when resolving anyway.
+	if( !rt->ids ) {
+		fillBlock( rt, bx, by );
+	}
+
+	int width = rt->colour.width;
+	int x1 = (bx + 1) * DEPTH_BLOCK < width ? (bx + 1) * DEPTH_BLOCK : width;
+	int y1 = (by + 1) * DEPTH_BLOCK < rt->depth.height ? (by + 1) * DEPTH_BLOCK : rt->depth.height;
+	int x0 = bx * DEPTH_BLOCK;
+	int samples = rt->samples;
+
+	// Multisampled, lines are padded to whole blocks: every line of a
+	// block is one run of depths. The value is read once, the compiler
+	// can not know the stores leave it alone.
+	int run = samples > 1 ? samples * DEPTH_BLOCK : x1 - x0;
+	float clear = rt->clearDepth;
+	for( int y = by * DEPTH_BLOCK; y < y1; y++ ) {
+		size_t start = sampleIndex( &rt->depth, x0, y, 0 );
+		float* depths = &rt->depth.data[start];
+		for( int k = 0; k < run; k++ ) {
+			depths[k] = clear;
+		}
+		if( rt->ids ) {
+			uint32_t* ids = &rt->ids[start];
+			for( int k = 0; k < run; k++ ) {
+				ids[k] = NO_TRIANGLE;
+			}
+		}
+	}
+
+	// Pixels split into samples last frame are one colour again.
+	if( samples > 1 ) {
+		rt->mixed[i] = 0;
+	}
+}
+
+void setVisibilityMode(renderTarget* rt, bool on) {
+	if( on && !rt->ids ) {
+		rt->ids = (uint32_t*)alignedAlloc( sizeof(uint32_t) * rt->depth.pitch * rt->depth.height * rt->samples );
+	}
+	if( !on && rt->ids ) {
+		free( rt->ids );
+		rt->ids = NULL;
+	}
+
+	// Blocks cleared for the other mode are not cleared for this one.
+	memset( rt->blockFrame, 0, sizeof(unsigned int) * rt->depth.blocksX * rt->depth.blocksY );
+}
+
+// Direct3D's standard sample positions, y flipped since lines go bottom up.
+static const int samplePattern2[2][2] = { { 4, -4 }, { -4, 4 } };
+static const int samplePattern4[4][2] = { { -2, 6 }, { 6, 2 }, { -6, -2 }, { 2, -6 } };
+static const int samplePattern8[8][2] = {
+	{ 1, 3 }, { -1, -3 }, { 5, -1 }, { -3, 5 },
+	{ -5, -5 }, { -7, 1 }, { 3, -7 }, { 7, 7 }
+};
+
+void setMultisampling(renderTarget* rt, int samples) {
+	const int (*pattern)[2];
+	switch( samples ) {
+		case 1: pattern = NULL; break;
+		case 2: pattern = samplePattern2; break;
+		case 4: pattern = samplePattern4; break;
+		case 8: pattern = samplePattern8; break;
+		default:
+			fprintf(stderr, "Error: %d samples per pixel, not 1, 2, 4 or 8.\n", samples);
+			exit(1);
+	}
+
+	int pixels = rt->depth.width * rt->depth.height;
+	rt->samples = samples;
+	rt->depth.samples = samples;
+	rt->depth.pitch = samples > 1 ? rt->depth.blocksX * DEPTH_BLOCK : rt->depth.width;
+	size_t depths = (size_t)rt->depth.pitch * rt->depth.height * samples;
+	for( int s = 0; s < MAX_SAMPLES; s++ ) {
+		rt->sampleX[s] = pattern && s < samples ? pattern[s][0] : 0;
+		rt->sampleY[s] = pattern && s < samples ? pattern[s][1] : 0;
+	}
+	free( rt->depth.data );
+	rt->depth.data = (float*)alignedAlloc( sizeof(float) * depths );
+	if( rt->ids ) {
+		free( rt->ids );
+		rt->ids = (uint32_t*)alignedAlloc( sizeof(uint32_t) * depths );
+	}
+
+	// Sample colours are only ever touched for pixels on edges, so most of
+	// their pages are never actually mapped in.
+	free( rt->mixed );
+	free( rt->sampleColours );
+	rt->mixed = NULL;
+	rt->sampleColours = NULL;
+	if( samples > 1 ) {
+		rt->mixed = (uint64_t*)calloc( rt->depth.blocksX * rt->depth.blocksY, sizeof(uint64_t) );
+		rt->sampleColours = alignedAlloc( (size_t)pixelSize( rt->colour.format ) * pixels * samples );
+	}
+
+	memset( rt->blockFrame, 0, sizeof(unsigned int) * rt->depth.blocksX * rt->depth.blocksY );
+}
+
+uint32_t reserveShading(renderTarget* rt, uint32_t count) {
+	uint32_t first = rt->shadingCount;
+	if( count > NO_TRIANGLE - first ) {
+		fprintf(stderr, "Error: Too many triangles in one frame.\n");
+		exit(1);
+	}
+	if( first + count > rt->shadingCapacity ) {
+		uint32_t capacity = rt->shadingCapacity ? rt->shadingCapacity : 4096;
+		while( capacity < first + count ) {
+			capacity = capacity < NO_TRIANGLE / 2 ? capacity * 2 : NO_TRIANGLE;
+		}
+		rt->shading = (triShading*)realloc( rt->shading, sizeof(triShading) * capacity );
+		if( !rt->shading ) {
+			fprintf(stderr, "Error: Out of memory for %u triangles.\n", capacity);
+			exit(1);
+		}
+		rt->shadingCapacity = capacity;
+	}
+	rt->shadingCount = first + count;
+	return first;
+}
+
+// Colour of a kept triangle at pixel (x, y).
+static colour shadePixel(const triShading* t, int x, int y) {
+	float fx = (float)(x - t->ox);
+	float fy = (float)(y - t->oy);
+	colour c;
+	c.r = (t->r[0] + t->r[2] * fy) + t->r[1] * fx;
+	c.g = (t->g[0] + t->g[2] * fy) + t->g[1] * fx;
+	c.b = (t->b[0] + t->b[2] * fy) + t->b[1] * fx;
+	c.a = 1.0f;
+	if( t->texture ) {
+		float u;
+		float v;
+		float lod;
+		texturePixel( t->texture, t->q, t->u, t->v, fx, fy, &u, &v, &lod );
+		colour texel = sampleTexture( t->texture, t->filter, u, v, lod );
+		c.r *= texel.r;
+		c.g *= texel.g;
+		c.b *= texel.b;
+	}
+	return c;
+}
+
+// Average of a pixel's packed samples. Bytes average as they are,
+// rounded; samples is a power of two.
+static inline void averageSamples(uint8_t* dst, const uint8_t* slots, int samples, pixelFormat format) {
+	if( format == PIXEL_RGBA8 ) {
+		int shift = __builtin_ctz( samples );
+		unsigned int sum[4] = { 0, 0, 0, 0 };
+		for( int s = 0; s < samples; s++ ) {
+			for( int c = 0; c < 4; c++ ) {
+				sum[c] += slots[s * 4 + c];
+			}
+		}
+		for( int c = 0; c < 4; c++ ) {
+			dst[c] = (uint8_t)((sum[c] + samples / 2) >> shift);
 		}
+		return;
+	}
+	size_t stride = pixelSize( format );
+	colour sum = makeColourA( 0.0f, 0.0f, 0.0f, 0.0f );
+	for( int s = 0; s < samples; s++ ) {
+		colour c = unpackPixel( slots + s * stride, format );
+		sum.r += c.r;
+		sum.g += c.g;
+		sum.b += c.b;
+		sum.a += c.a;
+	}
+	float scale = 1.0f / samples;
+	packPixel( dst, format, makeColourA( sum.r * scale, sum.g * scale, sum.b * scale, sum.a * scale ) );
+}
+
+// Colour of a multisampled pixel whose samples see different triangles,
+// shading each of them once. The samples are packed, which clamps them,
+// and averaged as averageBlock does drawn ones, so a pixel comes out the
+// same as it would have drawing colours straight away.
+static void shadeSamples(renderTarget* rt, int x, int y, uint8_t* dst, frameStats* counts) {
+	int samples = rt->samples;
+	pixelFormat format = rt->colour.format;
+	size_t stride = pixelSize( format );
+	uint32_t seen[MAX_SAMPLES];
+	uint8_t shades[MAX_SAMPLES][sizeof(colour)];
+	uint8_t slots[MAX_SAMPLES * sizeof(colour)];
+	int n = 0;
+	for( int s = 0; s < samples; s++ ) {
+		uint32_t id = rt->ids[sampleIndex( &rt->depth, x, y, s )];
+		int k = 0;
+		while( k < n && seen[k] != id ) {
+			k++;
+		}
+		if( k == n ) {
+			seen[n] = id;
+			if( id == NO_TRIANGLE ) {
+				memcpy( shades[n], rt->clearPixel, stride );
+			}
+			else {
+				packPixel( shades[n], format, shadePixel( &rt->shading[id], x, y ) );
+				STATS_ADD( counts, STAT_PIXELS_SHADED, 1 );
+			}
+			n++;
+		}
+		memcpy( slots + s * stride, shades[k], stride );
+	}
+	averageSamples( dst, slots, samples, format );
+}
+
+// Whether all samples of the pixel whose first id is at ids see the same
+// triangle.
+static inline bool sameIds(const uint32_t* ids, int samples) {
+	for( int s = 1; s < samples; s++ ) {
+		if( ids[s * DEPTH_BLOCK] != ids[0] ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Colours one block that was drawn to from the triangles nearest in each
+// pixel, evaluating their planes as drawing would have. Neighbours mostly
+// share a triangle, so the row values are only redone when it changes.
+// Multisampled pixels that have different triangles in their samples are
+// left to shadeSamples.
+static inline __attribute__((always_inline)) void shadeBlockAs(renderTarget* rt, int bx, int by, pixelFormat format, frameStats* counts) {
+	int width = rt->colour.width;
+	int samples = rt->samples;
+	int x0 = bx * DEPTH_BLOCK;
+	int x1 = (bx + 1) * DEPTH_BLOCK < width ? (bx + 1) * DEPTH_BLOCK : width;
+	int y1 = (by + 1) * DEPTH_BLOCK < rt->depth.height ? (by + 1) * DEPTH_BLOCK : rt->depth.height;
+	size_t stride = pixelSize( format );
+	for( int y = by * DEPTH_BLOCK; y < y1; y++ ) {
+		const uint32_t* ids = &rt->ids[sampleIndex( &rt->depth, x0, y, 0 )];
+		uint8_t* dst = (uint8_t*)pixelAt( rt->colour, 0, y );
+		uint32_t last = NO_TRIANGLE;
+		const triShading* t = NULL;
+		float rr = 0.0f;
+		float gr = 0.0f;
+		float br = 0.0f;
+		for( int x = x0; x < x1; x++ ) {
+			if( samples > 1 && !sameIds( &ids[x - x0], samples ) ) {
+				shadeSamples( rt, x, y, dst + x * stride, counts );
+				continue;
+			}
+			uint32_t id = ids[x - x0];
+			if( id == NO_TRIANGLE ) {
+				memcpy( dst + x * stride, rt->clearPixel, stride );
+				continue;
+			}
+			if( id != last ) {
+				last = id;
+				t = &rt->shading[last];
+				float fy = (float)(y - t->oy);
+				rr = t->r[0] + t->r[2] * fy;
+				gr = t->g[0] + t->g[2] * fy;
+				br = t->b[0] + t->b[2] * fy;
+			}
+			float fx = (float)(x - t->ox);
+			colour c;
+			c.r = rr + t->r[1] * fx;
+			c.g = gr + t->g[1] * fx;
+			c.b = br + t->b[1] * fx;
+			c.a = 1.0f;
+			if( t->texture ) {
+				float u;
+				float v;
+				float lod;
+				texturePixel( t->texture, t->q, t->u, t->v, fx, (float)(y - t->oy), &u, &v, &lod );
+				colour texel = sampleTexture( t->texture, t->filter, u, v, lod );
+				c.r *= texel.r;
+				c.g *= texel.g;
+				c.b *= texel.b;
+			}
+			packPixel( dst + x * stride, format, c );
+			STATS_ADD( counts, STAT_PIXELS_SHADED, 1 );
+		}
+	}
+}
+
+static void shadeBlock(renderTarget* rt, int bx, int by, frameStats* counts) {
+	switch( rt->colour.format ) {
+		case PIXEL_RGBA8: shadeBlockAs( rt, bx, by, PIXEL_RGBA8, counts ); break;
+		case PIXEL_RGB565: shadeBlockAs( rt, bx, by, PIXEL_RGB565, counts ); break;
+		case PIXEL_HALF: shadeBlockAs( rt, bx, by, PIXEL_HALF, counts ); break;
+		default: shadeBlockAs( rt, bx, by, PIXEL_FLOAT, counts ); break;
+	}
+}
+
+// The pixel with the lowest set bit of a block's mixed flags.
+static int mixedPixel(const renderTarget* rt, int bx, int by, uint64_t bits) {
+	int b = __builtin_ctzll( bits );
+	return (by * DEPTH_BLOCK + b / DEPTH_BLOCK) * rt->colour.width + bx * DEPTH_BLOCK + b % DEPTH_BLOCK;
+}
+
+// Average of the samples of every mixed pixel in one block, into colour.
+static void averageBlock(renderTarget* rt, int bx, int by) {
+	int samples = rt->samples;
+	pixelFormat format = rt->colour.format;
+	size_t stride = pixelSize( format );
+	uint64_t mixed = rt->mixed[by * rt->depth.blocksX + bx];
+
+	// The samples were written while drawing, long since gone from the
+	// cache: ask for all of the block's at once rather than one by one.
+	for( uint64_t bits = mixed; bits; bits &= bits - 1 ) {
+		__builtin_prefetch( (const uint8_t*)rt->sampleColours + (size_t)mixedPixel( rt, bx, by, bits ) * samples * stride );
+	}
+	for( uint64_t bits = mixed; bits; bits &= bits - 1 ) {
+		int i = mixedPixel( rt, bx, by, bits );
+		const uint8_t* slots = (const uint8_t*)rt->sampleColours + (size_t)i * samples * stride;
+		averageSamples( (uint8_t*)rt->colour.data + (size_t)i * stride, slots, samples, format );
+	}
+}
+
+// Blocks not drawn to at all just get the clear colour: the rest of
+// clearing them waits until they are drawn to, which may be never.
+// Multisampled, only blocks that have mixed pixels are looked at any
+// closer.
+void resolveBlocks(renderTarget* rt, int by0, int by1, frameStats* counts) {
+	for( int by = by0; by < by1; by++ ) {
+		for( int bx = 0; bx < rt->depth.blocksX; bx++ ) {
+			int i = by * rt->depth.blocksX + bx;
+			if( rt->blockFrame[i] != rt->frame ) {
+				fillBlock( rt, bx, by );
+			}
+			else if( rt->ids ) {
+				shadeBlock( rt, bx, by, counts );
+			}
+			else if( rt->samples > 1 && rt->mixed[i] ) {
+				averageBlock( rt, bx, by );
+			}
+		}
+	}
+}
+
+void resolveTarget(renderTarget* rt) {
+	resolveBlocks( rt, 0, rt->depth.blocksY, &rt->stats );
+}
+
+void freeRenderTarget(renderTarget rt) {
+	freeBuffer( rt.colour );
+	freeDepthBuffer( rt.depth );
+	free( rt.blockFrame );
+	free( rt.overdraw );
+	free( rt.ids );
+	free( rt.shading );
+	free( rt.mixed );
+	free( rt.sampleColours );
+}
+
+frameStats targetStats(const renderTarget* rt) {
+	return rt->stats;
+}
+
+void writeOverdrawImage(const renderTarget* rt, const char* filename) {
+	if( !rt->overdraw ) {
+		fprintf(stderr, "Warning: No overdraw counts for \"%s\", build with make STATS=1.\n", filename);
+		return;
 	}
-	bmp_close();
+	writeHeatMap( rt->overdraw, rt->depth.width, rt->depth.height, filename );
 }
 
 void freeBuffer(buffer b) {
@@ -8,24 +8,354 @@
 
 #include "scalars.h"
 #include "colours.h"
+#include "stats.h"
+#include "textures.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #define SHMKEY "RTSharedMemoryBuffer"
 
+// How colour buffers store pixels. PIXEL_FLOAT is the colour struct as it
+// is, RGBA8 is four bytes r, g, b, a, RGB565 one 16 bit word with red on
+// top and HALF four half floats r, g, b, a. Packed formats are clamped
+// and converted when written.
+typedef enum pixelFormat {
+	PIXEL_FLOAT,
+	PIXEL_RGBA8,
+	PIXEL_RGB565,
+	PIXEL_HALF
+} pixelFormat;
+
+// Lines firstLine up to (not including) size are ours.
 typedef struct buffer {
 	int width;
 	int firstLine;
 	int size;
 	// int memid;
-	colour* data;
+	pixelFormat format;
+	void* data;
 } buffer;
 
-buffer makeBuffer(int width, int height);
+// Depth buffer, greater is nearer. Keeps a conservative bound per block of
+// DEPTH_BLOCK x DEPTH_BLOCK pixels: nothing in the block is further away
+// than it, so anything not nearer than the bound can be skipped. With
+// more than one sample per pixel, there are that many depths per pixel,
+// found with sampleIndex.
+#define DEPTH_BLOCK 8
+
+typedef struct depthBuffer {
+	int width;
+	int height;
+	int samples;
+	int pitch;
+	int blocksX;
+	int blocksY;
+	float* data;
+	float* blockMin;
+} depthBuffer;
+
+// Where the depth of sample s of pixel (x, y) is. Multisampled, each line
+// of a block keeps its samples together, a row of DEPTH_BLOCK per sample,
+// so a block's samples are as close together as its pixels are without
+// multisampling; pitch is then the width rounded up to whole blocks.
+static inline size_t sampleIndex(const depthBuffer* d, int x, int y, int s) {
+	int x0 = x & ~(DEPTH_BLOCK - 1);
+	return ((size_t)y * d->pitch + x0) * d->samples + s * DEPTH_BLOCK + (x - x0);
+}
+
+// Samples per pixel, at most.
+#define MAX_SAMPLES 8
+
+// What the visibility mode keeps of each triangle drawn, to shade it
+// later: its colour planes, value at (ox, oy), d/dx, d/dy, and for
+// textured ones the texture and planes of 1/w, u/w and v/w.
+typedef struct triShading {
+	float r[3];
+	float g[3];
+	float b[3];
+	float q[3];
+	float u[3];
+	float v[3];
+	const texture* texture;
+	textureFilter filter;
+	int ox;
+	int oy;
+} triShading;
+
+// Pixels no triangle was drawn to, in visibility mode.
+#define NO_TRIANGLE 0xffffffffu
+
+// Colour and depth that live across frames. Clearing only bumps the frame
+// number; blocks not yet drawn to this frame are cleared when first
+// touched (prepareBlock). resolveTarget fills the colour of the rest and
+// leaves their depth for whatever touches them next.
+typedef struct renderTarget {
+	buffer colour;
+	depthBuffer depth;
+	colour clearColour;
+	uint8_t clearPixel[sizeof(colour)];
+	float clearDepth;
+	unsigned int frame;
+	unsigned int* blockFrame;
+
+	// This frame's statistics, reset by clearTarget. With RASTER_STATS,
+	// overdraw counts the depth test passes of each pixel.
+	frameStats stats;
+	uint16_t* overdraw;
+
+	// Visibility mode, if ids is there: drawing only writes depth and the
+	// number of the nearest triangle, and every pixel drawn to is shaded
+	// once, from shading[id], when the target is resolved. Multisampled,
+	// ids are kept per sample, laid out like depth, and pixels whose
+	// samples see different triangles are shaded once per triangle.
+	uint32_t* ids;
+	triShading* shading;
+	uint32_t shadingCount;
+	uint32_t shadingCapacity;
+
+	// Multisampling, if samples is more than 1: edges and depth are
+	// tested per sample, at sampleX[s], sampleY[s] sixteenths of a pixel
+	// off the pixel's centre, but colours are worked out once per pixel.
+	// A pixel whose samples all have the same colour keeps it in colour,
+	// like without multisampling. Once they may differ, its bit in mixed
+	// is set (mixedBit) and its samples' colours are in sampleColours,
+	// samples of them per pixel in the target's format. Resolving writes
+	// their average to colour.
+	int samples;
+	int sampleX[MAX_SAMPLES];
+	int sampleY[MAX_SAMPLES];
+	uint64_t* mixed;
+	void* sampleColours;
+} renderTarget;
+
+// The mixed flags of a block are one word, a bit per pixel, line by line:
+// blocks with none are skipped with one look, and the flags of a line of
+// a block come out with a shift.
+static inline uint64_t* mixedWord(const renderTarget* rt, int x, int y) {
+	return &rt->mixed[(y / DEPTH_BLOCK) * rt->depth.blocksX + x / DEPTH_BLOCK];
+}
+
+static inline uint64_t mixedBit(int x, int y) {
+	return (uint64_t)1 << ((y & (DEPTH_BLOCK - 1)) * DEPTH_BLOCK + (x & (DEPTH_BLOCK - 1)));
+}
+
+static inline int pixelSize(pixelFormat format) {
+	switch( format ) {
+		case PIXEL_RGBA8: return 4;
+		case PIXEL_RGB565: return 2;
+		case PIXEL_HALF: return 8;
+		default: return sizeof( colour );
+	}
+}
+
+// Names as used on command lines: float, rgba8, rgb565, half.
+const char* pixelFormatName(pixelFormat format);
+bool pixelFormatNamed(const char* name, pixelFormat* format);
+float halfToFloat(uint16_t h);
+colour unpackPixel(const void* src, pixelFormat format);
+
+// Packing is inline, so loops that write a known format only get the code
+// for that one. Halves are rounded to nearest and clamped to the largest
+// finite half; anything below the smallest normal half becomes zero.
+static inline uint16_t floatToHalf(float f) {
+	uint32_t bits;
+	memcpy( &bits, &f, sizeof(bits) );
+	uint32_t sign = (bits >> 16) & 0x8000;
+	bits &= 0x7fffffff;
+	if( bits < 0x38800000 ) {
+		return (uint16_t)sign;
+	}
+	bits = bits < 0x477fe000 ? bits : 0x477fe000;
+	bits += 0xfff + ((bits >> 13) & 1);
+	return (uint16_t)(sign | ((bits >> 13) - ((127 - 15) << 10)));
+}
+
+static inline int unitToInt(scalar v, int max) {
+	v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+	return (int)lrintf( v * max );
+}
+
+static inline void packPixel(void* dst, pixelFormat format, colour c) {
+	switch( format ) {
+		case PIXEL_RGBA8: {
+			uint8_t* p = (uint8_t*)dst;
+			p[0] = (uint8_t)unitToInt( c.r, 255 );
+			p[1] = (uint8_t)unitToInt( c.g, 255 );
+			p[2] = (uint8_t)unitToInt( c.b, 255 );
+			p[3] = (uint8_t)unitToInt( c.a, 255 );
+		}
+		break;
+
+		case PIXEL_RGB565: {
+			uint16_t v = (uint16_t)(
+				(unitToInt( c.r, 31 ) << 11) |
+				(unitToInt( c.g, 63 ) << 5) |
+				unitToInt( c.b, 31 )
+			);
+			memcpy( dst, &v, sizeof(v) );
+		}
+		break;
+
+		case PIXEL_HALF: {
+			uint16_t v[4] = {
+				floatToHalf( c.r ), floatToHalf( c.g ),
+				floatToHalf( c.b ), floatToHalf( c.a )
+			};
+			memcpy( dst, v, sizeof(v) );
+		}
+		break;
+
+		default:
+			memcpy( dst, &c, sizeof(c) );
+		break;
+	}
+}
+
+// Whether two packed pixels are the same. Pixels are compared as whole
+// words, so with the stride known where it is inlined, this is a load and
+// a compare or two rather than a call to memcmp.
+static inline bool samePixel(const void* a, const void* b, size_t stride) {
+	if( stride == 2 ) {
+		uint16_t x, y;
+		memcpy( &x, a, 2 );
+		memcpy( &y, b, 2 );
+		return x == y;
+	}
+	if( stride == 4 ) {
+		uint32_t x, y;
+		memcpy( &x, a, 4 );
+		memcpy( &y, b, 4 );
+		return x == y;
+	}
+	uint64_t x[2], y[2];
+	memcpy( x, a, stride );
+	memcpy( y, b, stride );
+	return x[0] == y[0] && (stride == 8 || x[1] == y[1]);
+}
+
+// Copies packed pixel a if pick is set, b if not, to dst, masking words
+// rather than branching: along edges, picks are anything but predictable.
+// dst may be a or b.
+static inline void pickPixel(void* dst, const void* a, const void* b, bool pick, size_t stride) {
+	uint64_t m = -(uint64_t)pick;
+	uint64_t x[2] = { 0, 0 };
+	uint64_t y[2] = { 0, 0 };
+	memcpy( x, a, stride );
+	memcpy( y, b, stride );
+	x[0] = (x[0] & m) | (y[0] & ~m);
+	x[1] = (x[1] & m) | (y[1] & ~m);
+	memcpy( dst, x, stride );
+}
+
+buffer makeBuffer(int width, int height, pixelFormat format);
 buffer partialBuffer(buffer b, int index, int parts);
+buffer alignedPartialBuffer(buffer b, int index, int parts, int align);
 void setPixel(buffer b, int x, int y, colour c);
+colour getPixel(buffer b, int x, int y);
 void expose(buffer b, scalar factor, scalar gamma);
 void writeToImage(buffer b, const char* filename);
 void freeBuffer(buffer b);
 void freePartialBuffer(buffer b);
 void clear(buffer b);
 
+depthBuffer makeDepthBuffer(int width, int height);
+void clearDepth(depthBuffer* d, float value);
+void freeDepthBuffer(depthBuffer d);
+
+renderTarget makeRenderTarget(int width, int height, pixelFormat format);
+void clearTarget(renderTarget* rt, colour c, float depth);
+void prepareBlock(renderTarget* rt, int bx, int by);
+void setVisibilityMode(renderTarget* rt, bool on);
+
+// 1 (off), 2, 4 or 8 samples per pixel, in the standard Direct3D
+// patterns. Like switching visibility mode, this leaves the contents of
+// the target undefined until it is cleared.
+void setMultisampling(renderTarget* rt, int samples);
+
+// Numbers count triangles from the first one this frame. Returns the
+// first of count new ones.
+uint32_t reserveShading(renderTarget* rt, uint32_t count);
+
+// Multisampled pixel (x, y) as its samples, the first time they are
+// about to differ: every one starts out as what the pixel was. Returns
+// where they are.
+static inline __attribute__((always_inline)) uint8_t* splitPixel(renderTarget* rt, int x, int y, size_t stride) {
+	int i = y * rt->colour.width + x;
+	int samples = rt->samples;
+	uint8_t* slots = (uint8_t*)rt->sampleColours + (size_t)i * samples * stride;
+	uint64_t* word = mixedWord( rt, x, y );
+	uint64_t bit = mixedBit( x, y );
+	if( !(*word & bit) ) {
+		const uint8_t* pixel = (const uint8_t*)rt->colour.data + (size_t)i * stride;
+		for( int s = 0; s < samples; s++ ) {
+			memcpy( slots + s * stride, pixel, stride );
+		}
+		*word |= bit;
+	}
+	return slots;
+}
+
+// Writes a packed pixel to the samples in mask of multisampled pixel
+// (x, y), splitting it up if its samples end up different and keeping it
+// as one colour again once they are all the same, as they mostly are
+// along edges shared by triangles of one mesh. Inline like packPixel, so
+// every copy only moves pixels of its one format.
+static inline __attribute__((always_inline)) void writeSamples(renderTarget* rt, int x, int y, pixelFormat format, const void* packed, int mask) {
+	size_t stride = pixelSize( format );
+	int i = y * rt->colour.width + x;
+	int samples = rt->samples;
+	uint8_t* pixel = (uint8_t*)rt->colour.data + (size_t)i * stride;
+	uint8_t* slots = (uint8_t*)rt->sampleColours + (size_t)i * samples * stride;
+	uint64_t* word = mixedWord( rt, x, y );
+	uint64_t bit = mixedBit( x, y );
+
+	// A pixel that is one colour has it in every sample, and its samples
+	// are not read then; a split one's colour is not looked at before it
+	// is resolved, so it can be written either way.
+	bool split = (*word & bit) != 0;
+	const uint8_t* from[2] = { pixel, slots };
+	const uint8_t* old = from[split];
+	size_t step = split * stride;
+	bool differ = false;
+	for( int s = 0; s < samples; s++ ) {
+		uint8_t* slot = slots + s * stride;
+		pickPixel( slot, packed, old + s * step, (mask >> s) & 1, stride );
+		differ |= !samePixel( slot, packed, stride );
+	}
+	memcpy( pixel, packed, stride );
+	*word = (*word & ~bit) | (differ ? bit : 0);
+}
+
+// The same, adding c to what the samples hold.
+static inline __attribute__((always_inline)) void addSamples(renderTarget* rt, int x, int y, pixelFormat format, colour c, int mask) {
+	size_t stride = pixelSize( format );
+	int i = y * rt->colour.width + x;
+	if( mask == (1 << rt->samples) - 1 && !(*mixedWord( rt, x, y ) & mixedBit( x, y )) ) {
+		uint8_t* pixel = (uint8_t*)rt->colour.data + (size_t)i * stride;
+		colour old = unpackPixel( pixel, format );
+		packPixel( pixel, format, makeColour( c.r + old.r, c.g + old.g, c.b + old.b ) );
+		return;
+	}
+	uint8_t* slots = splitPixel( rt, x, y, stride );
+	for( int s = 0; s < rt->samples; s++ ) {
+		if( (mask >> s) & 1 ) {
+			colour old = unpackPixel( slots + s * stride, format );
+			packPixel( slots + s * stride, format, makeColour( c.r + old.r, c.g + old.g, c.b + old.b ) );
+		}
+	}
+}
+
+// Finishes the block rows by0 up to by1: fills what was not drawn to
+// with the clear colour and, in visibility mode, shades what was;
+// multisampled, it averages the samples of pixels that have different
+// ones. resolveTarget does all rows.
+void resolveBlocks(renderTarget* rt, int by0, int by1, frameStats* counts);
+void resolveTarget(renderTarget* rt);
+void freeRenderTarget(renderTarget rt);
+
+frameStats targetStats(const renderTarget* rt);
+void writeOverdrawImage(const renderTarget* rt, const char* filename);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,319 @@
+/**
+ * Renders frames without a window, for timing and for machines without
+ * a display. Prints frame time statistics, optionally saves the frames.
+ * (c) L. Diener 2011
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scenes.h"
+#include "importers.h"
+#include "timing.h"
+
+typedef struct options {
+	const char* mesh;
+	const char* output;
+	const char* heatMap;
+	const char* texture;
+	bool stats;
+	bool visibility;
+	int frames;
+	int samples;
+	int width;
+	int height;
+	int threads;
+	int city;
+	int lights;
+	pixelFormat format;
+	pipelineState state;
+	float distance;
+	float spin;
+	float fov;
+	float lod;
+} options;
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m file     mesh to render (.raw, .mesh, .obj, .ply), default suzanne.raw\n"
+		"  -n frames   number of frames, default 100\n"
+		"  -s WxH      resolution, default 1280x720\n"
+		"  -t threads  worker threads, default one per processor\n"
+		"  -p format   float, rgba8, rgb565 or half, default rgba8\n"
+		"  -V          draw into a visibility buffer, shade when resolving\n"
+		"  -A samples  multisample anti-aliasing, 2, 4 or 8 samples per pixel\n"
+		"  -F          flat shading\n"
+		"  -D mode     depth test-write, test, write or off, default test-write\n"
+		"  -C mode     colours write, add or off, default write\n"
+		"  -T file     texture the mesh with a binary PPM file, or \"checker\";\n"
+		"              meshes without texture coordinates get them projected\n"
+		"              onto them from the front\n"
+		"  -f filter   nearest, bilinear or trilinear, default trilinear\n"
+		"  -d dist     camera distance, default 6\n"
+		"  -r angle    rotation per frame in radians, default 0.02\n"
+		"  -v degrees  vertical field of view, default 45\n"
+		"  -c n        render an n x n city of copies of the mesh around a\n"
+		"              turning camera instead, most of them out of view\n"
+		"  -L n        with -c, add n coloured lights of short range to the city\n"
+		"  -l pixels   draw coarser versions of the mesh where they are off\n"
+		"              by at most this many pixels, default off\n"
+		"  -o pattern  save frames, e.g. frame%%04d.png (.bmp, .ppm, .png)\n"
+		"  -S          print the last frame's statistics (make STATS=1)\n"
+		"  -H file     save the last frame's overdraw heat map (make STATS=1)\n",
+		name
+	);
+	exit(1);
+}
+
+// Pipeline state modes by name, in enum order.
+static const char* depthModeNames[DEPTH_MODES] = { "test-write", "test", "write", "off" };
+static const char* colourModeNames[COLOUR_MODES] = { "write", "add", "off" };
+
+static int namedMode(const char** names, int count, const char* name, const char* program) {
+	for( int i = 0; i < count; i++ ) {
+		if( !strcmp( names[i], name ) ) {
+			return i;
+		}
+	}
+	usage( program );
+	return 0;
+}
+
+static options parseOptions(int argc, char** argv) {
+	options o;
+	o.mesh = "suzanne.raw";
+	o.output = NULL;
+	o.heatMap = NULL;
+	o.texture = NULL;
+	o.stats = false;
+	o.visibility = false;
+	o.frames = 100;
+	o.samples = 1;
+	o.width = 1280;
+	o.height = 720;
+	o.threads = processorCount();
+	o.city = 0;
+	o.lights = 0;
+	o.format = PIXEL_RGBA8;
+	o.state = makePipelineState();
+	o.distance = 6.0f;
+	o.spin = 0.02f;
+	o.fov = 45.0f;
+	o.lod = 0.0f;
+
+	int c;
+	while( (c = getopt( argc, argv, "m:n:s:t:p:VA:FD:C:T:f:d:r:v:c:L:l:o:SH:" )) != -1 ) {
+		switch( c ) {
+			case 'm': o.mesh = optarg; break;
+			case 'n': o.frames = atoi( optarg ); break;
+			case 't': o.threads = atoi( optarg ); break;
+			case 'p':
+				if( !pixelFormatNamed( optarg, &o.format ) ) {
+					usage( argv[0] );
+				}
+			break;
+			case 'V': o.visibility = true; break;
+			case 'A':
+				o.samples = atoi( optarg );
+				if( o.samples != 1 && o.samples != 2 && o.samples != 4 && o.samples != 8 ) {
+					usage( argv[0] );
+				}
+			break;
+			case 'F': o.state.shade = SHADE_FLAT; break;
+			case 'D': o.state.depth = (depthMode)namedMode( depthModeNames, DEPTH_MODES, optarg, argv[0] ); break;
+			case 'C': o.state.colour = (colourMode)namedMode( colourModeNames, COLOUR_MODES, optarg, argv[0] ); break;
+			case 'T': o.texture = optarg; break;
+			case 'f':
+				if( !textureFilterNamed( optarg, &o.state.filter ) ) {
+					usage( argv[0] );
+				}
+			break;
+			case 'd': o.distance = atof( optarg ); break;
+			case 'r': o.spin = atof( optarg ); break;
+			case 'v': o.fov = atof( optarg ); break;
+			case 'c': o.city = atoi( optarg ); break;
+			case 'L': o.lights = atoi( optarg ); break;
+			case 'l': o.lod = atof( optarg ); break;
+			case 'o': o.output = optarg; break;
+			case 'S': o.stats = true; break;
+			case 'H': o.heatMap = optarg; break;
+			case 's':
+				if( sscanf( optarg, "%dx%d", &o.width, &o.height ) != 2 ) {
+					usage( argv[0] );
+				}
+			break;
+			default: usage( argv[0] );
+		}
+	}
+	if( optind != argc || o.frames < 1 || o.width < 1 || o.height < 1 || o.threads < 1 || o.city < 0 || o.lights < 0 || o.lights > MAX_LIGHTS - 1 || o.lod < 0.0f ) {
+		usage( argv[0] );
+	}
+	return o;
+}
+
+// Texture coordinates for a mesh without any: x and y across its bounds,
+// the texture seen straight on from the front, repeated four times.
+static void projectTexCoords(model* m) {
+	vertexStreams* v = &m->vertices;
+	vec3 lo = m->boundsMin;
+	vec3 hi = m->boundsMax;
+	float size = fmaxf( hi.x - lo.x, hi.y - lo.y );
+	addTexCoords( v );
+	for( int i = 0; i < v->count; i++ ) {
+		v->u[i] = 2.0f * (v->x[i] - lo.x) / size;
+		v->v[i] = 2.0f * (v->y[i] - lo.y) / size;
+	}
+}
+
+// Lights of random colours over the city, n of them, each reaching a
+// few of its copies of the mesh.
+static void lightCity(scene* s, int mesh, int city, int n) {
+	const model* m = &s->models[mesh];
+	vec3 lo = m->boundsMin;
+	vec3 hi = m->boundsMax;
+	float size = fmaxf( hi.x - lo.x, fmaxf( hi.y - lo.y, hi.z - lo.z ) );
+	float extent = 2.0f * size * city;
+	uint32_t seed = 54321;
+	for( int i = 0; i < n; i++ ) {
+		float p[5];
+		for( int k = 0; k < 5; k++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			p[k] = (seed >> 8) * (1.0f / 16777216.0f);
+		}
+		colour c = makeColour( 0.3f + 0.7f * p[2], 0.3f + 0.7f * p[3], 0.3f + 0.7f * p[4] );
+		vec3 at = makeVec3( (p[0] - 0.5f) * extent, hi.y + size * 0.5f, (p[1] - 0.5f) * extent );
+		addLight( &s->lights, makePointLight( at, c, 3.0f * size ) );
+	}
+}
+
+// Copies of the mesh on a grid, two of its sizes apart, each turned some
+// random way. The camera stands in the middle, between four of them.
+static void buildCity(scene* s, int mesh, int n) {
+	const model* m = &s->models[mesh];
+	vec3 lo = m->boundsMin;
+	vec3 hi = m->boundsMax;
+	float spacing = 2.0f * fmaxf( hi.x - lo.x, fmaxf( hi.y - lo.y, hi.z - lo.z ) );
+	uint32_t seed = 12345;
+	for( int z = 0; z < n; z++ ) {
+		for( int x = 0; x < n; x++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			matrix place, turn, world;
+
+			// matrixTranslate moves the world the other way, like a camera.
+			matrixTranslate( &place, -(x - n / 2 + 0.5f) * spacing, 0, -(z - n / 2 + 0.5f) * spacing );
+			matrixRotY( &turn, (seed >> 8) * (2.0f * (float)scalarPI / 16777216.0f) );
+			matrixMult( &world, place, turn );
+			addSceneObject( s, mesh, world );
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	options o = parseOptions( argc, argv );
+
+	tiler frameTiler = makeTiler( o.threads );
+	frameTiler.state = o.state;
+	scene frameScene = makeScene();
+	int mesh = addSceneModel( &frameScene, makeModelFromFile( o.mesh, frameTiler.pool ) );
+	texture tex;
+	if( o.texture ) {
+		tex = strcmp( o.texture, "checker" ) ?
+			makeTextureFromFile( o.texture ) :
+			makeCheckerTexture( 256, 16, COLOUR_WHITE, makeColour( 0.2f, 0.3f, 0.6f ) );
+		frameTiler.state.texture = &tex;
+		if( !frameScene.models[mesh].vertices.u ) {
+			projectTexCoords( &frameScene.models[mesh] );
+		}
+	}
+	if( o.lod > 0.0f ) {
+		frameScene.lodPixels = o.lod;
+		buildSceneLods( &frameScene, mesh, 8 );
+	}
+	// A white light over everything, dimmed when there are others.
+	scalar key = o.lights ? 0.25f : 1.0f;
+	addLight( &frameScene.lights, makePointLight( makeVec3( 5, 5, 5 ), makeColour( key, key, key ), 0 ) );
+	if( o.city ) {
+		buildCity( &frameScene, mesh, o.city );
+		lightCity( &frameScene, mesh, o.city, o.lights );
+	}
+	else {
+		matrix world;
+		matrixId( &world );
+		addSceneObject( &frameScene, mesh, world );
+	}
+	renderTarget frameTarget = makeRenderTarget( o.width, o.height, o.format );
+	setVisibilityMode( &frameTarget, o.visibility );
+	setMultisampling( &frameTarget, o.samples );
+	double* times = (double*)malloc( sizeof(double) * o.frames );
+
+	matrix pMatrix;
+	matrixPerspective( &pMatrix, o.fov, (float)o.width / (float)o.height, 1.0, 32.0 );
+
+	for( int f = 0; f < o.frames; f++ ) {
+		double start = timeNow();
+		STATS_STAGE( &frameTarget.stats, STAGE_CLEAR, clearTarget( &frameTarget, COLOUR_BLACK, FLT_MIN ) );
+
+		// The model turns in front of the camera, or the camera turns in
+		// the city.
+		matrix viewMatrix, rotMatrix;
+		matrixRotY( &rotMatrix, o.spin * f );
+		if( o.city ) {
+			viewMatrix = rotMatrix;
+		}
+		else {
+			matrixTranslate( &viewMatrix, 0, 0, o.distance );
+			moveSceneObject( &frameScene, 0, rotMatrix );
+		}
+
+		drawScene( &frameScene, &frameTiler, &frameTarget, viewMatrix, pMatrix );
+		STATS_STAGE( &frameTarget.stats, STAGE_RESOLVE, resolveTiled( &frameTiler, &frameTarget ) );
+		times[f] = timeNow() - start;
+
+		// Saving is not part of the frame time.
+		if( o.output ) {
+			char name[4096];
+			snprintf( name, sizeof(name), o.output, f );
+			writeToImage( frameTarget.colour, name );
+		}
+	}
+
+	double total = 0.0;
+	for( int f = 0; f < o.frames; f++ ) {
+		total += times[f];
+	}
+	sortTimes( times, o.frames );
+
+	printf( "%s: %d objects, %d triangles, %d objects in view, %d levels of detail, %d lights, %dx%d, %d threads, %d frames\n",
+		o.mesh, frameScene.objectCount, sceneTriangleCount( &frameScene ), frameScene.visibleCount,
+		frameScene.modelCount - 1, frameScene.lights.count, o.width, o.height,
+		workerCount( frameTiler.pool ), o.frames
+	);
+	printf( "frame ms: min %.3f  median %.3f  p99 %.3f  max %.3f  mean %.3f\n",
+		times[0] * 1e3,
+		percentile( times, o.frames, 0.5 ) * 1e3,
+		percentile( times, o.frames, 0.99 ) * 1e3,
+		times[o.frames - 1] * 1e3,
+		total / o.frames * 1e3
+	);
+	if( o.stats ) {
+		frameStats stats = targetStats( &frameTarget );
+		printFrameStats( stdout, &stats );
+	}
+	if( o.heatMap ) {
+		writeOverdrawImage( &frameTarget, o.heatMap );
+	}
+
+	free( times );
+	freeRenderTarget( frameTarget );
+	freeScene( &frameScene );
+	freeTiler( &frameTiler );
+	if( o.texture ) {
+		freeTexture( &tex );
+	}
+	return 0;
+}
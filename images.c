@@ -0,0 +1,263 @@
+/**
+ * Image output: BMP, binary PPM and PNG (stored, uncompressed deflate).
+ * Rows are written top to bottom, one call each, and writers share no
+ * state, so any number of them can be in use on different threads.
+ * (c) L. Diener 2011
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "images.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Largest stored deflate block.
+#define DEFLATE_STORED 65535
+
+static uint32_t crcTable[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void makeCrcTable() {
+	for( uint32_t i = 0; i < 256; i++ ) {
+		uint32_t c = i;
+		for( int k = 0; k < 8; k++ ) {
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		crcTable[0][i] = c;
+	}
+	for( uint32_t i = 0; i < 256; i++ ) {
+		for( int t = 1; t < 8; t++ ) {
+			crcTable[t][i] = (crcTable[t - 1][i] >> 8) ^ crcTable[0][crcTable[t - 1][i] & 0xff];
+		}
+	}
+}
+
+// CRC-32 as PNG chunks use it, eight bytes at a time.
+static uint32_t crc32(const uint8_t* p, size_t n) {
+	uint32_t c = 0xffffffffu;
+	while( n >= 8 ) {
+		uint32_t lo = c ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		c =
+			crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+			crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+			crcTable[3][p[4]] ^ crcTable[2][p[5]] ^
+			crcTable[1][p[6]] ^ crcTable[0][p[7]];
+		p += 8;
+		n -= 8;
+	}
+	while( n-- ) {
+		c = crcTable[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffffu;
+}
+
+// Adler-32 as zlib streams end with it, reduced only every 5552 bytes.
+static uint32_t adler32(uint32_t adler, const uint8_t* p, size_t n) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	while( n > 0 ) {
+		size_t run = n < 5552 ? n : 5552;
+		n -= run;
+		while( run-- ) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+static uint8_t* put16le(uint8_t* p, uint32_t v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	return p + 2;
+}
+
+static uint8_t* put32le(uint8_t* p, uint32_t v) {
+	put16le( p, v & 0xffff );
+	put16le( p + 2, v >> 16 );
+	return p + 4;
+}
+
+static uint8_t* put32be(uint8_t* p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+	return p + 4;
+}
+
+static void writeBytes(imageWriter* w, const void* data, size_t size) {
+	if( fwrite( data, 1, size, w->file ) != size ) {
+		fprintf(stderr, "Error: Couldn't write \"%s\".\n", w->name);
+		exit(1);
+	}
+}
+
+// A PNG chunk whose data is already in place after 8 free bytes at p.
+static void writeChunk(imageWriter* w, const char* type, uint8_t* p, size_t size) {
+	put32be( p, (uint32_t)size );
+	memcpy( p + 4, type, 4 );
+	put32be( p + 8 + size, crc32( p + 4, size + 4 ) );
+	writeBytes( w, p, size + 12 );
+}
+
+static size_t rowBytes(const imageWriter* w) {
+	switch( w->format ) {
+		case IMAGE_BMP: return ((size_t)w->width * 3 + 3) & ~(size_t)3;
+		case IMAGE_PNG: return (size_t)w->width * 3 + 1;
+		default: return (size_t)w->width * 3;
+	}
+}
+
+imageFormat imageFormatFor(const char* filename) {
+	const char* extension = strrchr( filename, '.' );
+	if( extension && strcasecmp( extension, ".png" ) == 0 ) {
+		return IMAGE_PNG;
+	}
+	if( extension && strcasecmp( extension, ".ppm" ) == 0 ) {
+		return IMAGE_PPM;
+	}
+	return IMAGE_BMP;
+}
+
+imageWriter makeImageWriter(const char* filename, imageFormat format, int width, int height) {
+	imageWriter w;
+	w.name = filename;
+	w.format = format;
+	w.width = width;
+	w.height = height;
+	w.rows = 0;
+	w.adler = 1;
+	w.file = fopen( filename, "wb" );
+	if( !w.file ) {
+		fprintf(stderr, "Error: Couldn't open \"%s\" for writing.\n", filename);
+		exit(1);
+	}
+
+	size_t bytes = rowBytes( &w );
+	w.offset = format == IMAGE_PNG ? 1 : 0;
+	w.row = (uint8_t*)calloc( bytes, 1 );
+	w.chunk = NULL;
+
+	uint8_t header[64];
+	uint8_t* p = header;
+	switch( format ) {
+		case IMAGE_BMP:
+			// Negative height: rows go top to bottom.
+			*p++ = 'B';
+			*p++ = 'M';
+			p = put32le( p, 54 + bytes * height );
+			p = put32le( p, 0 );
+			p = put32le( p, 54 );
+			p = put32le( p, 40 );
+			p = put32le( p, width );
+			p = put32le( p, (uint32_t)-height );
+			p = put16le( p, 1 );
+			p = put16le( p, 24 );
+			for( int i = 0; i < 6; i++ ) {
+				p = put32le( p, 0 );
+			}
+			writeBytes( &w, header, p - header );
+		break;
+
+		case IMAGE_PPM: {
+			int n = snprintf( (char*)header, sizeof(header), "P6\n%d %d\n255\n", width, height );
+			writeBytes( &w, header, n );
+		}
+		break;
+
+		case IMAGE_PNG: {
+			pthread_once( &crcOnce, makeCrcTable );
+			writeBytes( &w, "\x89PNG\r\n\x1a\n", 8 );
+			p = put32be( header + 8, width );
+			p = put32be( p, height );
+			*p++ = 8; // bits per channel
+			*p++ = 2; // RGB
+			*p++ = 0;
+			*p++ = 0; // no filter
+			*p++ = 0;
+			writeChunk( &w, "IHDR", header, p - header - 8 );
+
+			// Room for the zlib header, the stored block headers, the
+			// checksum and the chunk around it all.
+			size_t blocks = (bytes + DEFLATE_STORED - 1) / DEFLATE_STORED;
+			w.chunk = (uint8_t*)malloc( 8 + 2 + blocks * 5 + bytes + 4 + 4 );
+		}
+		break;
+	}
+	return w;
+}
+
+uint8_t* imageRow(imageWriter* w) {
+	return w->row + w->offset;
+}
+
+void writeImageRow(imageWriter* w) {
+	size_t bytes = rowBytes( w );
+	switch( w->format ) {
+		case IMAGE_BMP: {
+			uint8_t* p = w->row;
+			for( int x = 0; x < w->width; x++, p += 3 ) {
+				uint8_t r = p[0];
+				p[0] = p[2];
+				p[2] = r;
+			}
+			writeBytes( w, w->row, bytes );
+		}
+		break;
+
+		case IMAGE_PPM:
+			writeBytes( w, w->row, bytes );
+		break;
+
+		case IMAGE_PNG: {
+			// One IDAT chunk per row: the row (filter byte 0 in front) as
+			// stored deflate blocks, opened and closed by the zlib header
+			// and checksum on the first and last row.
+			bool last = w->rows == w->height - 1;
+			uint8_t* p = w->chunk + 8;
+			if( w->rows == 0 ) {
+				*p++ = 0x78;
+				*p++ = 0x01;
+			}
+			for( size_t done = 0; done < bytes; ) {
+				size_t n = bytes - done < DEFLATE_STORED ? bytes - done : DEFLATE_STORED;
+				*p++ = last && done + n == bytes ? 1 : 0;
+				p = put16le( p, (uint32_t)n );
+				p = put16le( p, (uint32_t)~n & 0xffff );
+				memcpy( p, w->row + done, n );
+				p += n;
+				done += n;
+			}
+			w->adler = adler32( w->adler, w->row, bytes );
+			if( last ) {
+				p = put32be( p, w->adler );
+			}
+			writeChunk( w, "IDAT", w->chunk, p - w->chunk - 8 );
+		}
+		break;
+	}
+	w->rows++;
+}
+
+void freeImageWriter(imageWriter* w) {
+	if( w->format == IMAGE_PNG ) {
+		uint8_t end[12];
+		writeChunk( w, "IEND", end, 0 );
+	}
+	if( w->rows != w->height ) {
+		fprintf(stderr, "Warning: \"%s\" got %d of %d rows.\n", w->name, w->rows, w->height);
+	}
+	if( fclose( w->file ) != 0 ) {
+		fprintf(stderr, "Error: Couldn't write \"%s\".\n", w->name);
+		exit(1);
+	}
+	free( w->row );
+	free( w->chunk );
+}
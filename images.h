@@ -0,0 +1,48 @@
+/**
+ * Image output: BMP, binary PPM and PNG (stored, uncompressed deflate).
+ * Rows are written top to bottom, one call each, and writers share no
+ * state, so any number of them can be in use on different threads.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __IMAGES_H__
+#define __IMAGES_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum imageFormat {
+	IMAGE_BMP,
+	IMAGE_PPM,
+	IMAGE_PNG
+} imageFormat;
+
+typedef struct imageWriter {
+	FILE* file;
+	const char* name;
+	imageFormat format;
+	int width;
+	int height;
+	int rows;
+
+	// The row being filled, with room for what the format puts in
+	// front of the pixels.
+	uint8_t* row;
+	size_t offset;
+
+	// PNG rows are wrapped into a chunk here, with the checksum of the
+	// image data so far.
+	uint8_t* chunk;
+	uint32_t adler;
+} imageWriter;
+
+imageFormat imageFormatFor(const char* filename);
+imageWriter makeImageWriter(const char* filename, imageFormat format, int width, int height);
+
+// Where the next row's pixels go: width RGB8 triples. writeImageRow then
+// writes them out.
+uint8_t* imageRow(imageWriter* w);
+void writeImageRow(imageWriter* w);
+void freeImageWriter(imageWriter* w);
+
+#endif
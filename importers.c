@@ -0,0 +1,1241 @@
+/**
+ * Wavefront OBJ and PLY (ASCII and binary) importers. Files are mapped,
+ * split into chunks on line or record boundaries and parsed on all the
+ * threads of a worker pool.
+ * (c) L. Diener 2011
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "importers.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Text is cut into chunks of about this size, binary data into chunks of
+// this many records.
+#define IMPORT_CHUNK (1 << 20)
+#define IMPORT_RECORDS (1 << 16)
+
+typedef struct mappedFile {
+	const char* name;
+	const char* data;
+	const char* end;
+	size_t size;
+} mappedFile;
+
+static void importError(const char* name, const char* what) {
+	fprintf(stderr, "Error: \"%s\" %s.\n", name, what);
+	exit(1);
+}
+
+static mappedFile mapFile(const char* name) {
+	mappedFile f;
+	f.name = name;
+
+	int fd = open(name, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Error: Couldn't open \"%s\".\n", name);
+		exit(1);
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size == 0) {
+		importError(name, "is empty");
+	}
+	f.size = (size_t)info.st_size;
+	void* data = mmap(NULL, f.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		importError(name, "could not be mapped");
+	}
+	posix_madvise(data, f.size, POSIX_MADV_SEQUENTIAL);
+
+	f.data = (const char*)data;
+	f.end = f.data + f.size;
+	return f;
+}
+
+static void unmapFile(mappedFile* f) {
+	munmap((void*)f->data, f->size);
+}
+
+// Drops the pages of a parsed chunk, so the file never needs to be all in
+// memory at once. They are simply read again if touched again.
+static void releasePages(const void* start, const void* end) {
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t)start / page * page;
+	madvise((void*)first, (uintptr_t)end - first, MADV_DONTNEED);
+}
+
+// Text scanning. Lines never include their '\n', '\r' counts as space.
+
+static bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skipSpaces(const char* p, const char* end) {
+	while(p < end && isSpace(*p)) {
+		p++;
+	}
+	return p;
+}
+
+static const char* lineEnd(const char* p, const char* end) {
+	const char* n = (const char*)memchr(p, '\n', end - p);
+	return n ? n : end;
+}
+
+static bool atSeparator(const char* p, const char* end) {
+	return p == end || isSpace(*p);
+}
+
+// Splits [start, end) into chunks that begin at line starts. Returns the
+// chunk count, starts gets one more entry than that.
+static int splitLines(const char* start, const char* end, const char*** starts) {
+	size_t size = end - start;
+	int count = (int)(size / IMPORT_CHUNK) + 1;
+	const char** s = (const char**)malloc(sizeof(const char*) * (count + 1));
+
+	s[0] = start;
+	for(int i = 1; i < count; i++) {
+		const char* p = start + size / count * i;
+		p = p > s[i - 1] ? p : s[i - 1];
+		p = lineEnd(p, end);
+		s[i] = p < end ? p + 1 : end;
+	}
+	s[count] = end;
+
+	*starts = s;
+	return count;
+}
+
+static bool parseInt(const char** pp, const char* end, long* out) {
+	const char* p = *pp;
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	if(p == end || *p < '0' || *p > '9') {
+		return false;
+	}
+
+	long v = 0;
+	while(p < end && *p >= '0' && *p <= '9') {
+		if(v < 100000000000L) {
+			v = v * 10 + (*p - '0');
+		}
+		p++;
+	}
+	*out = negative ? -v : v;
+	*pp = p;
+	return true;
+}
+
+// Decimal float parser, a lot faster than strtod. Up to 19 significant
+// digits are kept in an integer, which is then scaled once.
+static bool parseFloat(const char** pp, const char* end, float* out) {
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char* p = *pp;
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	while(p < end && *p >= '0' && *p <= '9') {
+		if(digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa != 0;
+		}
+		else {
+			exponent++;
+		}
+		any = true;
+		p++;
+	}
+	if(p < end && *p == '.') {
+		p++;
+		while(p < end && *p >= '0' && *p <= '9') {
+			if(digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+			any = true;
+			p++;
+		}
+	}
+	if(!any) {
+		return false;
+	}
+
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		long e;
+		if(parseInt(&q, end, &e)) {
+			exponent += e > 1000 ? 1000 : (e < -1000 ? -1000 : (int)e);
+			p = q;
+		}
+	}
+
+	double v = (double)mantissa;
+	if(exponent < 0 && exponent >= -22) {
+		v /= powers[-exponent];
+	}
+	else if(exponent > 0 && exponent <= 22) {
+		v *= powers[exponent];
+	}
+	else if(exponent != 0) {
+		v *= pow(10.0, exponent);
+	}
+
+	*out = (float)(negative ? -v : v);
+	*pp = p;
+	return true;
+}
+
+static bool parseFloats(const char** p, const char* end, float* out, int count) {
+	for(int i = 0; i < count; i++) {
+		*p = skipSpaces(*p, end);
+		if(!parseFloat(p, end, &out[i]) || !atSeparator(*p, end)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// OBJ: v, vn, vt and f lines, polygons are fanned into triangles.
+
+#define OBJ_NO_NORMAL 0xffffffffu
+#define OBJ_NO_TEXCOORD 0xffffffffu
+
+enum { OBJ_OTHER, OBJ_POSITION, OBJ_NORMAL, OBJ_TEXCOORD, OBJ_FACE };
+
+typedef struct objChunk {
+	const char* start;
+	const char* end;
+
+	// Counts from the first pass, where the second one starts writing.
+	int positions;
+	int normals;
+	int texCoords;
+	int triangles;
+	int positionBase;
+	int normalBase;
+	int texCoordBase;
+	int triangleBase;
+
+	bool hasNormals;
+	bool missingNormals;
+	bool hasTexCoords;
+	bool bad;
+} objChunk;
+
+typedef struct objImport {
+	objChunk* chunks;
+
+	int positionCount;
+	int normalCount;
+	int texCoordCount;
+	int triangleCount;
+
+	// Positions go to x, y, z. nx, ny and nz are only used if vertices
+	// end up being the positions.
+	vertexStreams positions;
+	scalar* nx;
+	scalar* ny;
+	scalar* nz;
+	scalar* tu;
+	scalar* tv;
+
+	// Texture coordinate indices are only kept if there are any.
+	uint32_t* positionIndices;
+	uint32_t* normalIndices;
+	uint32_t* texCoordIndices;
+} objImport;
+
+static int objLineType(const char** p, const char* end) {
+	const char* q = skipSpaces(*p, end);
+	int type = OBJ_OTHER;
+	if(end - q >= 2 && q[0] == 'v' && isSpace(q[1])) {
+		type = OBJ_POSITION;
+		q += 2;
+	}
+	else if(end - q >= 3 && q[0] == 'v' && q[1] == 'n' && isSpace(q[2])) {
+		type = OBJ_NORMAL;
+		q += 3;
+	}
+	else if(end - q >= 3 && q[0] == 'v' && q[1] == 't' && isSpace(q[2])) {
+		type = OBJ_TEXCOORD;
+		q += 3;
+	}
+	else if(end - q >= 2 && q[0] == 'f' && isSpace(q[1])) {
+		type = OBJ_FACE;
+		q += 2;
+	}
+	*p = q;
+	return type;
+}
+
+static void objCount(void* arg, int index) {
+	objChunk* c = &((objImport*)arg)->chunks[index];
+	for(const char* line = c->start; line < c->end; ) {
+		const char* end = lineEnd(line, c->end);
+		const char* p = line;
+		switch(objLineType(&p, end)) {
+			case OBJ_POSITION:
+				c->positions++;
+			break;
+
+			case OBJ_NORMAL:
+				c->normals++;
+			break;
+
+			case OBJ_TEXCOORD:
+				c->texCoords++;
+			break;
+
+			case OBJ_FACE: {
+				int corners = 0;
+				while((p = skipSpaces(p, end)) < end) {
+					corners++;
+					while(p < end && !isSpace(*p)) {
+						p++;
+					}
+				}
+				c->triangles += corners > 2 ? corners - 2 : 0;
+			}
+			break;
+		}
+		line = end + 1;
+	}
+	releasePages(c->start, c->end);
+}
+
+// OBJ indices start at 1, negative ones count back from the last element
+// defined so far.
+static bool objIndex(long i, int defined, int total, uint32_t* out) {
+	long r = i > 0 ? i - 1 : defined + i;
+	if(i == 0 || r < 0 || r >= total) {
+		return false;
+	}
+	*out = (uint32_t)r;
+	return true;
+}
+
+// One face corner: p, p/t, p//n or p/t/n. Missing indices are 0.
+static bool objCorner(const char** p, const char* end, long* position, long* texCoord, long* normal) {
+	*texCoord = 0;
+	*normal = 0;
+	if(!parseInt(p, end, position)) {
+		return false;
+	}
+	if(*p < end && **p == '/') {
+		(*p)++;
+		if(!atSeparator(*p, end) && **p != '/' && !parseInt(p, end, texCoord)) {
+			return false;
+		}
+		if(*p < end && **p == '/') {
+			(*p)++;
+			if(!parseInt(p, end, normal)) {
+				return false;
+			}
+		}
+	}
+	return atSeparator(*p, end);
+}
+
+static void objParse(void* arg, int index) {
+	objImport* im = (objImport*)arg;
+	objChunk* c = &im->chunks[index];
+	int position = c->positionBase;
+	int normal = c->normalBase;
+	int texCoord = c->texCoordBase;
+	int triangle = c->triangleBase;
+	float v[3];
+
+	for(const char* line = c->start; line < c->end && !c->bad; ) {
+		const char* end = lineEnd(line, c->end);
+		const char* p = line;
+		switch(objLineType(&p, end)) {
+			case OBJ_POSITION:
+				c->bad |= !parseFloats(&p, end, v, 3);
+				im->positions.x[position] = v[0];
+				im->positions.y[position] = v[1];
+				im->positions.z[position] = v[2];
+				position++;
+			break;
+
+			case OBJ_NORMAL:
+				c->bad |= !parseFloats(&p, end, v, 3);
+				im->nx[normal] = v[0];
+				im->ny[normal] = v[1];
+				im->nz[normal] = v[2];
+				normal++;
+			break;
+
+			// u [v [w]], w is of no use here.
+			case OBJ_TEXCOORD:
+				v[1] = 0.0f;
+				c->bad |= !parseFloats(&p, end, v, 1);
+				p = skipSpaces(p, end);
+				c->bad |= p < end && !parseFloats(&p, end, &v[1], 1);
+				im->tu[texCoord] = v[0];
+				im->tv[texCoord] = v[1];
+				texCoord++;
+			break;
+
+			case OBJ_FACE: {
+				uint32_t first[3] = { 0, 0, 0 };
+				uint32_t prev[3] = { 0, 0, 0 };
+				uint32_t cur[3];
+				int corners = 0;
+				while((p = skipSpaces(p, end)) < end) {
+					long pi;
+					long ti;
+					long ni;
+					if(!objCorner(&p, end, &pi, &ti, &ni) || !objIndex(pi, position, im->positionCount, &cur[0])) {
+						c->bad = true;
+						break;
+					}
+
+					// Texture indices are ignored in files without vt lines.
+					if(ti == 0 || !im->texCoordIndices) {
+						cur[2] = OBJ_NO_TEXCOORD;
+					}
+					else if(objIndex(ti, texCoord, im->texCoordCount, &cur[2])) {
+						c->hasTexCoords = true;
+					}
+					else {
+						c->bad = true;
+						break;
+					}
+					if(ni == 0) {
+						cur[1] = OBJ_NO_NORMAL;
+						c->missingNormals = true;
+					}
+					else if(objIndex(ni, normal, im->normalCount, &cur[1])) {
+						c->hasNormals = true;
+					}
+					else {
+						c->bad = true;
+						break;
+					}
+
+					if(corners == 0) {
+						memcpy(first, cur, sizeof(cur));
+					}
+					else if(corners >= 2) {
+						uint32_t* pi3 = &im->positionIndices[triangle * 3];
+						uint32_t* ni3 = &im->normalIndices[triangle * 3];
+						pi3[0] = first[0];
+						pi3[1] = prev[0];
+						pi3[2] = cur[0];
+						ni3[0] = first[1];
+						ni3[1] = prev[1];
+						ni3[2] = cur[1];
+						if(im->texCoordIndices) {
+							uint32_t* ti3 = &im->texCoordIndices[triangle * 3];
+							ti3[0] = first[2];
+							ti3[1] = prev[2];
+							ti3[2] = cur[2];
+						}
+						triangle++;
+					}
+					memcpy(prev, cur, sizeof(cur));
+					corners++;
+				}
+			}
+			break;
+		}
+		line = end + 1;
+	}
+	releasePages(c->start, c->end);
+}
+
+// Makes one vertex per distinct position, normal and texture coordinate
+// triple. Each position keeps a chain of the vertices made from it,
+// usually just one.
+static vertexStreams objWeld(objImport* im, bool missingNormals) {
+	int corners = im->triangleCount * 3;
+	if(missingNormals) {
+		smoothNormals(&im->positions, im->positionIndices, im->triangleCount);
+	}
+
+	int* head = (int*)malloc(sizeof(int) * im->positionCount);
+	for(int i = 0; i < im->positionCount; i++) {
+		head[i] = -1;
+	}
+	int* next = (int*)malloc(sizeof(int) * corners);
+	uint32_t* positionOf = (uint32_t*)malloc(sizeof(uint32_t) * corners);
+	uint32_t* normalOf = im->normalIndices;
+	uint32_t* texCoordOf = im->texCoordIndices;
+
+	int count = 0;
+	for(int i = 0; i < corners; i++) {
+		uint32_t p = im->positionIndices[i];
+		uint32_t n = im->normalIndices[i];
+		uint32_t t = texCoordOf ? texCoordOf[i] : OBJ_NO_TEXCOORD;
+		int u = head[p];
+		while(u != -1 && (normalOf[u] != n || (texCoordOf && texCoordOf[u] != t))) {
+			u = next[u];
+		}
+		if(u == -1) {
+			// Never ahead of i, so normalOf and texCoordOf can share the
+			// corner arrays.
+			u = count++;
+			positionOf[u] = p;
+			normalOf[u] = n;
+			if(texCoordOf) {
+				texCoordOf[u] = t;
+			}
+			next[u] = head[p];
+			head[p] = u;
+		}
+		im->positionIndices[i] = u;
+	}
+	free(head);
+	free(next);
+
+	vertexStreams v = makeVertexStreams(count);
+	vertexStreams* s = &im->positions;
+	if(texCoordOf) {
+		addTexCoords(&v);
+	}
+	for(int u = 0; u < count; u++) {
+		uint32_t p = positionOf[u];
+		uint32_t n = normalOf[u];
+		v.x[u] = s->x[p];
+		v.y[u] = s->y[p];
+		v.z[u] = s->z[p];
+		v.nx[u] = n == OBJ_NO_NORMAL ? s->nx[p] : im->nx[n];
+		v.ny[u] = n == OBJ_NO_NORMAL ? s->ny[p] : im->ny[n];
+		v.nz[u] = n == OBJ_NO_NORMAL ? s->nz[p] : im->nz[n];
+		if(texCoordOf && texCoordOf[u] != OBJ_NO_TEXCOORD) {
+			v.u[u] = im->tu[texCoordOf[u]];
+			v.v[u] = im->tv[texCoordOf[u]];
+		}
+	}
+	free(positionOf);
+	freeVertexStreams(s);
+	return v;
+}
+
+model makeModelFromObjFile(const char* file, workerPool* pool) {
+	mappedFile f = mapFile(file);
+	objImport im;
+	memset(&im, 0, sizeof(im));
+
+	const char** starts;
+	int chunkCount = splitLines(f.data, f.end, &starts);
+	im.chunks = (objChunk*)calloc(chunkCount, sizeof(objChunk));
+	for(int i = 0; i < chunkCount; i++) {
+		im.chunks[i].start = starts[i];
+		im.chunks[i].end = starts[i + 1];
+	}
+	free(starts);
+
+	// Count first, so every chunk knows where its output goes.
+	runJobs(pool, objCount, &im, chunkCount);
+	for(int i = 0; i < chunkCount; i++) {
+		objChunk* c = &im.chunks[i];
+		c->positionBase = im.positionCount;
+		c->normalBase = im.normalCount;
+		c->texCoordBase = im.texCoordCount;
+		c->triangleBase = im.triangleCount;
+		im.positionCount += c->positions;
+		im.normalCount += c->normals;
+		im.texCoordCount += c->texCoords;
+		im.triangleCount += c->triangles;
+	}
+	if(im.positionCount == 0 || im.triangleCount == 0) {
+		importError(file, "has no faces");
+	}
+
+	im.positions = makeVertexStreams(im.positionCount);
+	im.nx = makeScalarArray(im.normalCount);
+	im.ny = makeScalarArray(im.normalCount);
+	im.nz = makeScalarArray(im.normalCount);
+	im.tu = makeScalarArray(im.texCoordCount);
+	im.tv = makeScalarArray(im.texCoordCount);
+	im.positionIndices = (uint32_t*)malloc(sizeof(uint32_t) * im.triangleCount * 3);
+	im.normalIndices = (uint32_t*)malloc(sizeof(uint32_t) * im.triangleCount * 3);
+	if(im.texCoordCount > 0) {
+		im.texCoordIndices = (uint32_t*)malloc(sizeof(uint32_t) * im.triangleCount * 3);
+	}
+
+	runJobs(pool, objParse, &im, chunkCount);
+	bool hasNormals = false;
+	bool missingNormals = false;
+	bool hasTexCoords = false;
+	for(int i = 0; i < chunkCount; i++) {
+		if(im.chunks[i].bad) {
+			importError(file, "has malformed lines or indices out of range");
+		}
+		hasNormals |= im.chunks[i].hasNormals;
+		missingNormals |= im.chunks[i].missingNormals;
+		hasTexCoords |= im.chunks[i].hasTexCoords;
+	}
+	if(!hasTexCoords) {
+		free(im.texCoordIndices);
+		im.texCoordIndices = NULL;
+	}
+	free(im.chunks);
+	unmapFile(&f);
+
+	// Without normals or texture coordinates, positions are the vertices
+	// as they are.
+	vertexStreams vertices;
+	if(hasNormals || hasTexCoords) {
+		vertices = objWeld(&im, missingNormals);
+	}
+	else {
+		vertices = im.positions;
+		smoothNormals(&vertices, im.positionIndices, im.triangleCount);
+	}
+	free(im.nx);
+	free(im.ny);
+	free(im.nz);
+	free(im.tu);
+	free(im.tv);
+	free(im.normalIndices);
+	free(im.texCoordIndices);
+
+	return makeModelFromStreams(vertices, im.positionIndices, im.triangleCount);
+}
+
+// PLY: a text header describing elements and their properties, followed
+// by ASCII lines or binary records. Only vertex positions, normals,
+// texture coordinates and face index lists are used.
+
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPERTIES 32
+
+typedef enum plyType {
+	PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+	PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+} plyType;
+
+static const int plyTypeSizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+
+// What a property ends up as. Coordinates are in stream order.
+enum { PLY_X, PLY_Y, PLY_Z, PLY_NX, PLY_NY, PLY_NZ, PLY_U, PLY_V, PLY_INDICES, PLY_UNUSED };
+
+enum { PLY_ASCII, PLY_LITTLE_ENDIAN, PLY_BIG_ENDIAN };
+
+typedef struct plyProperty {
+	plyType type;
+	plyType countType;
+	int use;
+} plyProperty;
+
+typedef struct plyElement {
+	bool vertex;
+	bool face;
+	long count;
+	int propertyCount;
+	plyProperty properties[PLY_MAX_PROPERTIES];
+
+	// Bytes per binary record, 0 if it has lists.
+	int stride;
+} plyElement;
+
+// A range of lines (ASCII) or records (binary).
+typedef struct plyChunk {
+	const char* start;
+	const char* end;
+	long first;
+	long count;
+	int triangles;
+	int triangleBase;
+	bool bad;
+} plyChunk;
+
+typedef struct plyImport {
+	const char* name;
+	int format;
+	bool swap;
+	plyElement elements[PLY_MAX_ELEMENTS];
+	int elementCount;
+	plyElement* vertex;
+	plyElement* face;
+
+	// Where each element's lines start, for ASCII files.
+	long firstLine[PLY_MAX_ELEMENTS];
+
+	plyChunk* chunks;
+	int chunkCount;
+
+	vertexStreams vertices;
+	bool hasNormals;
+	bool hasTexCoords;
+	uint32_t* indices;
+	int triangleCount;
+} plyImport;
+
+static bool wordIs(const char* p, const char* end, const char* word) {
+	size_t n = strlen(word);
+	return (size_t)(end - p) >= n && memcmp(p, word, n) == 0 && atSeparator(p + n, end);
+}
+
+// Next word on a header line, and its end.
+static const char* nextWord(const char** p, const char* end, const char** wordEnd) {
+	const char* w = skipSpaces(*p, end);
+	const char* e = w;
+	while(e < end && !isSpace(*e)) {
+		e++;
+	}
+	*wordEnd = e;
+	*p = e;
+	return w;
+}
+
+static plyType plyTypeNamed(const char* w, const char* end) {
+	static const char* names[][2] = {
+		{ "", "" },
+		{ "char", "int8" }, { "uchar", "uint8" },
+		{ "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" },
+		{ "float", "float32" }, { "double", "float64" }
+	};
+	for(int t = PLY_INT8; t <= PLY_FLOAT64; t++) {
+		if(wordIs(w, end, names[t][0]) || wordIs(w, end, names[t][1])) {
+			return (plyType)t;
+		}
+	}
+	return PLY_NONE;
+}
+
+static int plyUse(const plyElement* e, const char* w, const char* end, bool list) {
+	static const char* names[][3] = {
+		{ "x" }, { "y" }, { "z" }, { "nx" }, { "ny" }, { "nz" },
+		{ "u", "s", "texture_u" }, { "v", "t", "texture_v" }
+	};
+	if(e->vertex && !list) {
+		for(int i = PLY_X; i <= PLY_V; i++) {
+			for(int j = 0; j < 3; j++) {
+				if(names[i][j] && wordIs(w, end, names[i][j])) {
+					return i;
+				}
+			}
+		}
+	}
+	if(e->face && list && (wordIs(w, end, "vertex_indices") || wordIs(w, end, "vertex_index"))) {
+		return PLY_INDICES;
+	}
+	return PLY_UNUSED;
+}
+
+// Reads the header, returns where the data starts.
+static const char* plyHeader(plyImport* im, const mappedFile* f) {
+	const char* line = f->data;
+	if(!wordIs(line, lineEnd(line, f->end), "ply")) {
+		importError(f->name, "is not a PLY file");
+	}
+
+	bool hasFormat = false;
+	plyElement* e = NULL;
+	while(true) {
+		line = lineEnd(line, f->end) + 1;
+		if(line >= f->end) {
+			importError(f->name, "has no end_header");
+		}
+		const char* end = lineEnd(line, f->end);
+		const char* p = line;
+		const char* we;
+		const char* w = nextWord(&p, end, &we);
+
+		if(wordIs(w, we, "end_header")) {
+			break;
+		}
+		else if(wordIs(w, we, "format")) {
+			w = nextWord(&p, end, &we);
+			if(wordIs(w, we, "ascii")) {
+				im->format = PLY_ASCII;
+			}
+			else if(wordIs(w, we, "binary_little_endian")) {
+				im->format = PLY_LITTLE_ENDIAN;
+			}
+			else if(wordIs(w, we, "binary_big_endian")) {
+				im->format = PLY_BIG_ENDIAN;
+			}
+			else {
+				importError(f->name, "has an unknown format");
+			}
+			hasFormat = true;
+		}
+		else if(wordIs(w, we, "element")) {
+			if(im->elementCount == PLY_MAX_ELEMENTS) {
+				importError(f->name, "has too many elements");
+			}
+			e = &im->elements[im->elementCount++];
+			memset(e, 0, sizeof(plyElement));
+			w = nextWord(&p, end, &we);
+			e->vertex = wordIs(w, we, "vertex");
+			e->face = wordIs(w, we, "face");
+			w = nextWord(&p, end, &we);
+			if(!parseInt(&w, we, &e->count) || e->count < 0 || e->count > INT32_MAX) {
+				importError(f->name, "has a bad element count");
+			}
+		}
+		else if(wordIs(w, we, "property")) {
+			if(!e || e->propertyCount == PLY_MAX_PROPERTIES) {
+				importError(f->name, "has a bad property");
+			}
+			plyProperty* prop = &e->properties[e->propertyCount++];
+			prop->countType = PLY_NONE;
+			w = nextWord(&p, end, &we);
+			bool list = wordIs(w, we, "list");
+			if(list) {
+				w = nextWord(&p, end, &we);
+				prop->countType = plyTypeNamed(w, we);
+				w = nextWord(&p, end, &we);
+			}
+			prop->type = plyTypeNamed(w, we);
+			w = nextWord(&p, end, &we);
+			prop->use = plyUse(e, w, we, list);
+			if(prop->type == PLY_NONE || (list && prop->countType == PLY_NONE)) {
+				importError(f->name, "has a property of unknown type");
+			}
+		}
+	}
+	if(!hasFormat) {
+		importError(f->name, "has no format");
+	}
+
+	for(int i = 0; i < im->elementCount; i++) {
+		plyElement* el = &im->elements[i];
+		bool uses[PLY_UNUSED + 1] = { false };
+		bool lists = false;
+		el->stride = 0;
+		for(int j = 0; j < el->propertyCount; j++) {
+			uses[el->properties[j].use] = true;
+			lists |= el->properties[j].countType != PLY_NONE;
+			el->stride += plyTypeSizes[el->properties[j].type];
+		}
+		el->stride = lists ? 0 : el->stride;
+
+		if(el->vertex && !im->vertex && uses[PLY_X] && uses[PLY_Y] && uses[PLY_Z]) {
+			im->vertex = el;
+			im->hasNormals = uses[PLY_NX] && uses[PLY_NY] && uses[PLY_NZ];
+			im->hasTexCoords = uses[PLY_U] && uses[PLY_V];
+		}
+		if(el->face && !im->face && uses[PLY_INDICES]) {
+			im->face = el;
+		}
+	}
+	if(!im->vertex || !im->face || im->vertex->count == 0 || im->face->count == 0) {
+		importError(f->name, "has no vertex positions or no faces");
+	}
+
+	return lineEnd(line, f->end) + 1;
+}
+
+// Stores a vertex property, or does nothing if it is not one we use.
+static void plyStore(plyImport* im, int use, long vertex, float v) {
+	scalar* streams[8] = {
+		im->vertices.x, im->vertices.y, im->vertices.z,
+		im->vertices.nx, im->vertices.ny, im->vertices.nz,
+		im->vertices.u, im->vertices.v
+	};
+	if(use <= PLY_V && streams[use]) {
+		streams[use][vertex] = v;
+	}
+}
+
+// Fans a polygon into triangles, one corner at a time. Returns false for
+// indices that are out of range.
+static bool plyCorner(plyImport* im, long corner, long index, uint32_t* first, uint32_t* prev, int* triangle) {
+	if(index < 0 || index >= im->vertex->count) {
+		return false;
+	}
+	if(corner == 0) {
+		*first = (uint32_t)index;
+	}
+	else if(corner >= 2) {
+		uint32_t* t = &im->indices[*triangle * 3];
+		t[0] = *first;
+		t[1] = *prev;
+		t[2] = (uint32_t)index;
+		(*triangle)++;
+	}
+	*prev = (uint32_t)index;
+	return true;
+}
+
+// ASCII: every record is a line. Lines are counted first so each chunk
+// knows which element its lines belong to, then vertices are parsed and
+// triangles counted, then faces parsed.
+
+static void plyAsciiLines(void* arg, int index) {
+	plyChunk* c = &((plyImport*)arg)->chunks[index];
+	for(const char* p = c->start; p < c->end; p++) {
+		p = (const char*)memchr(p, '\n', c->end - p);
+		if(!p) {
+			break;
+		}
+		c->count++;
+	}
+	releasePages(c->start, c->end);
+}
+
+static int plyElementAt(plyImport* im, long line) {
+	for(int i = 0; i < im->elementCount; i++) {
+		if(line >= im->firstLine[i] && line < im->firstLine[i] + im->elements[i].count) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Walks the lines of a chunk. The first time round, vertices are parsed
+// and triangles counted, the second time faces are parsed.
+static void plyAsciiWalk(plyImport* im, plyChunk* c, bool faces) {
+	int vertexElement = (int)(im->vertex - im->elements);
+	int faceElement = (int)(im->face - im->elements);
+	long vertexFirst = im->firstLine[vertexElement];
+	long faceFirst = im->firstLine[faceElement];
+	int triangle = c->triangleBase;
+
+	// Chunks with nothing of interest are skipped outright.
+	long last = c->first + c->count + 1;
+	bool vertices = !faces && c->first < vertexFirst + im->vertex->count && last > vertexFirst;
+	if(!vertices && !(c->first < faceFirst + im->face->count && last > faceFirst)) {
+		return;
+	}
+
+	long number = c->first;
+	for(const char* line = c->start; line < c->end && !c->bad; number++) {
+		const char* end = lineEnd(line, c->end);
+		const char* p = line;
+		int element = plyElementAt(im, number);
+		line = end + 1;
+		if(element != faceElement && !(element == vertexElement && !faces)) {
+			continue;
+		}
+
+		plyElement* e = &im->elements[element];
+		for(int i = 0; i < e->propertyCount && !c->bad; i++) {
+			plyProperty* prop = &e->properties[i];
+			p = skipSpaces(p, end);
+			if(prop->countType == PLY_NONE) {
+				float v;
+				c->bad |= !parseFloat(&p, end, &v);
+				if(element == vertexElement) {
+					plyStore(im, prop->use, number - vertexFirst, v);
+				}
+				continue;
+			}
+
+			long n = 0;
+			c->bad |= !parseInt(&p, end, &n) || n < 0;
+			if(prop->use == PLY_INDICES && !faces) {
+				c->triangles += n > 2 ? (int)n - 2 : 0;
+				break;
+			}
+
+			uint32_t first = 0;
+			uint32_t prev = 0;
+			for(long j = 0; j < n && !c->bad; j++) {
+				float item;
+				long index;
+				p = skipSpaces(p, end);
+				if(prop->use == PLY_INDICES) {
+					c->bad |= !parseInt(&p, end, &index) || !plyCorner(im, j, index, &first, &prev, &triangle);
+				}
+				else {
+					c->bad |= !parseFloat(&p, end, &item);
+				}
+			}
+		}
+	}
+}
+
+static void plyAsciiVertices(void* arg, int index) {
+	plyImport* im = (plyImport*)arg;
+	plyAsciiWalk(im, &im->chunks[index], false);
+	releasePages(im->chunks[index].start, im->chunks[index].end);
+}
+
+static void plyAsciiFaces(void* arg, int index) {
+	plyImport* im = (plyImport*)arg;
+	plyAsciiWalk(im, &im->chunks[index], true);
+	releasePages(im->chunks[index].start, im->chunks[index].end);
+}
+
+// Binary: vertex records have a fixed size and are split by count. Face
+// records vary, so they are walked once up front to find where chunks
+// start and how many triangles come before each.
+
+static double plyValue(const plyImport* im, const unsigned char* p, plyType type) {
+	unsigned char b[8];
+	int size = plyTypeSizes[type];
+	for(int i = 0; i < size; i++) {
+		b[i] = p[im->swap ? size - 1 - i : i];
+	}
+
+	switch(type) {
+		case PLY_INT8: { int8_t v; memcpy(&v, b, 1); return v; }
+		case PLY_UINT8: { uint8_t v; memcpy(&v, b, 1); return v; }
+		case PLY_INT16: { int16_t v; memcpy(&v, b, 2); return v; }
+		case PLY_UINT16: { uint16_t v; memcpy(&v, b, 2); return v; }
+		case PLY_INT32: { int32_t v; memcpy(&v, b, 4); return v; }
+		case PLY_UINT32: { uint32_t v; memcpy(&v, b, 4); return v; }
+		case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+		case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+		default: return 0;
+	}
+}
+
+// Size of the binary record at p, or 0 if it runs past end. Also counts
+// the triangles in its index list.
+static size_t plyRecordSize(const plyImport* im, const plyElement* e, const unsigned char* p, const unsigned char* end, int* triangles) {
+	const unsigned char* start = p;
+	for(int i = 0; i < e->propertyCount; i++) {
+		const plyProperty* prop = &e->properties[i];
+		if(prop->countType == PLY_NONE) {
+			p += plyTypeSizes[prop->type];
+			continue;
+		}
+		if(end - p < plyTypeSizes[prop->countType]) {
+			return 0;
+		}
+		double n = plyValue(im, p, prop->countType);
+		if(n < 0 || n > INT32_MAX) {
+			return 0;
+		}
+		p += plyTypeSizes[prop->countType];
+		if(prop->use == PLY_INDICES && n > 2) {
+			*triangles += (int)n - 2;
+		}
+		if((double)(end - p) < n * plyTypeSizes[prop->type]) {
+			return 0;
+		}
+		p += (size_t)n * plyTypeSizes[prop->type];
+	}
+	return p <= end ? (size_t)(p - start) : 0;
+}
+
+static void plyBinaryVertices(void* arg, int index) {
+	plyImport* im = (plyImport*)arg;
+	plyChunk* c = &im->chunks[index];
+	const plyElement* e = im->vertex;
+	const unsigned char* p = (const unsigned char*)c->start;
+
+	for(long v = c->first; v < c->first + c->count; v++) {
+		for(int i = 0; i < e->propertyCount; i++) {
+			const plyProperty* prop = &e->properties[i];
+			if(prop->use <= PLY_V) {
+				plyStore(im, prop->use, v, (float)plyValue(im, p, prop->type));
+			}
+			p += plyTypeSizes[prop->type];
+		}
+	}
+	releasePages(c->start, p);
+}
+
+static void plyBinaryFaces(void* arg, int index) {
+	plyImport* im = (plyImport*)arg;
+	plyChunk* c = &im->chunks[index];
+	const plyElement* e = im->face;
+	const unsigned char* p = (const unsigned char*)c->start;
+	int triangle = c->triangleBase;
+
+	// Bounds were checked by the walk that made the chunks.
+	for(long f = 0; f < c->count && !c->bad; f++) {
+		for(int i = 0; i < e->propertyCount; i++) {
+			const plyProperty* prop = &e->properties[i];
+			if(prop->countType == PLY_NONE) {
+				p += plyTypeSizes[prop->type];
+				continue;
+			}
+			long n = (long)plyValue(im, p, prop->countType);
+			p += plyTypeSizes[prop->countType];
+			if(prop->use != PLY_INDICES) {
+				p += n * plyTypeSizes[prop->type];
+				continue;
+			}
+
+			uint32_t first = 0;
+			uint32_t prev = 0;
+			for(long j = 0; j < n; j++) {
+				double index = plyValue(im, p, prop->type);
+				c->bad |= !plyCorner(im, j, (long)index, &first, &prev, &triangle);
+				p += plyTypeSizes[prop->type];
+			}
+		}
+	}
+	releasePages(c->start, p);
+}
+
+static void plyAscii(plyImport* im, workerPool* pool, const char* body, const char* end) {
+	const char** starts;
+	im->chunkCount = splitLines(body, end, &starts);
+	im->chunks = (plyChunk*)calloc(im->chunkCount, sizeof(plyChunk));
+	for(int i = 0; i < im->chunkCount; i++) {
+		im->chunks[i].start = starts[i];
+		im->chunks[i].end = starts[i + 1];
+	}
+	free(starts);
+
+	long line = 0;
+	for(int i = 0; i < im->elementCount; i++) {
+		im->firstLine[i] = line;
+		line += im->elements[i].count;
+	}
+
+	runJobs(pool, plyAsciiLines, im, im->chunkCount);
+	line = 0;
+	for(int i = 0; i < im->chunkCount; i++) {
+		im->chunks[i].first = line;
+		line += im->chunks[i].count;
+	}
+
+	runJobs(pool, plyAsciiVertices, im, im->chunkCount);
+	for(int i = 0; i < im->chunkCount; i++) {
+		im->chunks[i].triangleBase = im->triangleCount;
+		im->triangleCount += im->chunks[i].triangles;
+	}
+	if(im->triangleCount == 0) {
+		importError(im->name, "has no faces");
+	}
+
+	im->indices = (uint32_t*)malloc(sizeof(uint32_t) * im->triangleCount * 3);
+	runJobs(pool, plyAsciiFaces, im, im->chunkCount);
+}
+
+// Start of the given element's binary records.
+static const unsigned char* plySkipTo(plyImport* im, const plyElement* wanted, const unsigned char* p, const unsigned char* end) {
+	for(const plyElement* e = im->elements; e != wanted; e++) {
+		if(e->stride) {
+			if((size_t)(end - p) / e->stride < (size_t)e->count) {
+				importError(im->name, "is truncated");
+			}
+			p += (size_t)e->stride * e->count;
+			continue;
+		}
+		for(long i = 0; i < e->count; i++) {
+			int unused = 0;
+			size_t size = plyRecordSize(im, e, p, end, &unused);
+			if(size == 0) {
+				importError(im->name, "is truncated");
+			}
+			p += size;
+		}
+	}
+	return p;
+}
+
+static void plyBinary(plyImport* im, workerPool* pool, const char* body, const char* end) {
+	uint16_t one = 1;
+	bool littleEndian = *(unsigned char*)&one == 1;
+	im->swap = littleEndian != (im->format == PLY_LITTLE_ENDIAN);
+
+	const unsigned char* data = (const unsigned char*)body;
+	const unsigned char* dataEnd = (const unsigned char*)end;
+	const plyElement* v = im->vertex;
+	const plyElement* fe = im->face;
+	if(v->stride == 0) {
+		importError(im->name, "has lists in its vertices");
+	}
+	const unsigned char* vertices = plySkipTo(im, v, data, dataEnd);
+	if((size_t)(dataEnd - vertices) / v->stride < (size_t)v->count) {
+		importError(im->name, "is truncated");
+	}
+	const unsigned char* faces = plySkipTo(im, fe, data, dataEnd);
+
+	int vertexChunks = (int)((v->count + IMPORT_RECORDS - 1) / IMPORT_RECORDS);
+	im->chunkCount = vertexChunks;
+	im->chunks = (plyChunk*)calloc(vertexChunks, sizeof(plyChunk));
+	for(int i = 0; i < vertexChunks; i++) {
+		plyChunk* c = &im->chunks[i];
+		c->first = (long)i * IMPORT_RECORDS;
+		c->count = v->count - c->first < IMPORT_RECORDS ? v->count - c->first : IMPORT_RECORDS;
+		c->start = (const char*)(vertices + (size_t)c->first * v->stride);
+	}
+	runJobs(pool, plyBinaryVertices, im, im->chunkCount);
+	free(im->chunks);
+
+	// Walk the faces once, recording where each chunk starts.
+	im->chunkCount = (int)((fe->count + IMPORT_RECORDS - 1) / IMPORT_RECORDS);
+	im->chunks = (plyChunk*)calloc(im->chunkCount, sizeof(plyChunk));
+	const unsigned char* p = faces;
+	for(long f = 0; f < fe->count; f++) {
+		if(f % IMPORT_RECORDS == 0) {
+			plyChunk* c = &im->chunks[f / IMPORT_RECORDS];
+			c->start = (const char*)p;
+			c->first = f;
+			c->count = fe->count - f < IMPORT_RECORDS ? fe->count - f : IMPORT_RECORDS;
+			c->triangleBase = im->triangleCount;
+		}
+		size_t size = plyRecordSize(im, fe, p, dataEnd, &im->triangleCount);
+		if(size == 0) {
+			importError(im->name, "is truncated");
+		}
+		p += size;
+	}
+	if(im->triangleCount == 0) {
+		importError(im->name, "has no faces");
+	}
+
+	im->indices = (uint32_t*)malloc(sizeof(uint32_t) * im->triangleCount * 3);
+	runJobs(pool, plyBinaryFaces, im, im->chunkCount);
+}
+
+model makeModelFromPlyFile(const char* file, workerPool* pool) {
+	mappedFile f = mapFile(file);
+	plyImport im;
+	memset(&im, 0, sizeof(im));
+	im.name = file;
+
+	const char* body = plyHeader(&im, &f);
+	if(body > f.end) {
+		importError(file, "is truncated");
+	}
+	im.vertices = makeVertexStreams((int)im.vertex->count);
+	if(im.hasTexCoords) {
+		addTexCoords(&im.vertices);
+	}
+
+	if(im.format == PLY_ASCII) {
+		plyAscii(&im, pool, body, f.end);
+	}
+	else {
+		plyBinary(&im, pool, body, f.end);
+	}
+	for(int i = 0; i < im.chunkCount; i++) {
+		if(im.chunks[i].bad) {
+			importError(file, "has malformed records or indices out of range");
+		}
+	}
+	free(im.chunks);
+	unmapFile(&f);
+
+	if(!im.hasNormals) {
+		smoothNormals(&im.vertices, im.indices, im.triangleCount);
+	}
+	return makeModelFromStreams(im.vertices, im.indices, im.triangleCount);
+}
+
+model makeModelFromFile(const char* file, workerPool* pool) {
+	const char* extension = strrchr(file, '.');
+	if(extension && strcasecmp(extension, ".obj") == 0) {
+		return makeModelFromObjFile(file, pool);
+	}
+	if(extension && strcasecmp(extension, ".ply") == 0) {
+		return makeModelFromPlyFile(file, pool);
+	}
+	return makeModelFromMeshFile(file);
+}
@@ -0,0 +1,21 @@
+/**
+ * Wavefront OBJ and PLY (ASCII and binary) importers. Files are mapped,
+ * split into chunks on line or record boundaries and parsed on all the
+ * threads of a worker pool.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __IMPORTERS_H__
+#define __IMPORTERS_H__
+
+#include "models.h"
+#include "workers.h"
+
+model makeModelFromObjFile(const char* file, workerPool* pool);
+model makeModelFromPlyFile(const char* file, workerPool* pool);
+
+// Picks an importer by extension, anything not .obj or .ply goes to
+// makeModelFromMeshFile.
+model makeModelFromFile(const char* file, workerPool* pool);
+
+#endif
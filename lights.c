@@ -0,0 +1,95 @@
+/**
+ * Lights: point, directional and spot, with colours and ranges. Placed in
+ * the world, moved into eye space once per frame for the vertex stage,
+ * which only evaluates the ones that reach what it is lighting.
+ * (c) L. Diener 2011
+ */
+
+#include "lights.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+light makePointLight(vec3 position, colour c, scalar range) {
+	light l;
+	memset( &l, 0, sizeof(l) );
+	l.type = LIGHT_POINT;
+	l.position = position;
+	l.colour = c;
+	l.range = range;
+	return l;
+}
+
+light makeDirectionalLight(vec3 direction, colour c) {
+	light l;
+	memset( &l, 0, sizeof(l) );
+	l.type = LIGHT_DIRECTIONAL;
+	normalized3( &l.direction, direction );
+	l.colour = c;
+	return l;
+}
+
+light makeSpotLight(vec3 position, vec3 direction, colour c, scalar range, scalar innerDegrees, scalar outerDegrees) {
+	light l = makePointLight( position, c, range );
+	l.type = LIGHT_SPOT;
+	normalized3( &l.direction, direction );
+	l.innerCos = scalarCos( innerDegrees * (scalar)scalarPI / 180.0f );
+	l.outerCos = scalarCos( outerDegrees * (scalar)scalarPI / 180.0f );
+	return l;
+}
+
+lightList makeLightList() {
+	lightList l;
+	memset( &l, 0, sizeof(l) );
+	return l;
+}
+
+void freeLightList(lightList* l) {
+	free( l->lights );
+	free( l->eye );
+}
+
+int addLight(lightList* l, light li) {
+	if( l->count == MAX_LIGHTS ) {
+		fprintf(stderr, "Error: More than %d lights.\n", MAX_LIGHTS);
+		exit(1);
+	}
+	if( l->count == l->capacity ) {
+		l->capacity = l->capacity ? l->capacity * 2 : 8;
+		l->lights = (light*)realloc( l->lights, sizeof(light) * l->capacity );
+		l->eye = (eyeLight*)realloc( l->eye, sizeof(eyeLight) * l->capacity );
+	}
+	l->lights[l->count] = li;
+	return l->count++;
+}
+
+void viewLights(lightList* l, matrix view) {
+	for( int i = 0; i < l->count; i++ ) {
+		const light* li = &l->lights[i];
+		eyeLight* e = &l->eye[i];
+		e->type = li->type;
+		matrixApply( &e->position, view, li->position );
+		e->direction = makeVec3( 0, 0, 0 );
+		if( li->type != LIGHT_POINT ) {
+			matrixApplyNormal( &e->direction, view, li->direction );
+		}
+		e->r = li->colour.r;
+		e->g = li->colour.g;
+		e->b = li->colour.b;
+		e->range = li->type == LIGHT_DIRECTIONAL ? 0.0f : li->range;
+		e->invRange2 = e->range > 0.0f ? 1.0f / (e->range * e->range) : 0.0f;
+		e->outerCos = li->outerCos;
+		e->invCone = li->innerCos > li->outerCos ? 1.0f / (li->innerCos - li->outerCos) : 1e6f;
+	}
+}
+
+bool lightReaches(const eyeLight* l, vec3 centre, scalar radius) {
+	if( l->range <= 0.0f ) {
+		return true;
+	}
+	scalar reach = l->range + radius;
+	vec3 d;
+	sub3( &d, centre, l->position );
+	return dot3( d, d ) < reach * reach;
+}
@@ -0,0 +1,74 @@
+/**
+ * Lights: point, directional and spot, with colours and ranges. Placed in
+ * the world, moved into eye space once per frame for the vertex stage,
+ * which only evaluates the ones that reach what it is lighting.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include <stdbool.h>
+
+#include "colours.h"
+#include "matrices.h"
+
+// Lights per list, at most.
+#define MAX_LIGHTS 1024
+
+typedef enum lightType {
+	LIGHT_POINT,
+	LIGHT_DIRECTIONAL,
+	LIGHT_SPOT
+} lightType;
+
+// World space light. Point and spot lights fade out towards their range
+// and give no light from there on; a range of 0 reaches everywhere,
+// unfaded. Directions are the way the light shines. Spot lights are full
+// within the inner cone and fade out towards the outer one.
+typedef struct light {
+	lightType type;
+	vec3 position;
+	vec3 direction;
+	colour colour;
+	scalar range;
+	scalar innerCos;
+	scalar outerCos;
+} light;
+
+// The same in eye space, with what the vertex stage needs precomputed.
+typedef struct eyeLight {
+	lightType type;
+	vec3 position;
+	vec3 direction;
+	scalar r;
+	scalar g;
+	scalar b;
+	scalar range;
+	scalar invRange2;
+	scalar outerCos;
+	scalar invCone;
+} eyeLight;
+
+typedef struct lightList {
+	light* lights;
+	eyeLight* eye;
+	int count;
+	int capacity;
+} lightList;
+
+light makePointLight(vec3 position, colour c, scalar range);
+light makeDirectionalLight(vec3 direction, colour c);
+light makeSpotLight(vec3 position, vec3 direction, colour c, scalar range, scalar innerDegrees, scalar outerDegrees);
+
+lightList makeLightList();
+void freeLightList(lightList* l);
+int addLight(lightList* l, light li);
+
+// Moves the lights into the eye space of a view, for the frame.
+void viewLights(lightList* l, matrix view);
+
+// Whether an eye space light can reach anything in a sphere.
+bool lightReaches(const eyeLight* l, vec3 centre, scalar radius);
+
+#endif
@@ -9,42 +9,31 @@
 #define WIDTH 320
 #define HEIGHT 240
 
-#include "rasterizer.h"
+#include "scenes.h"
+#include "importers.h"
 
-buffer frameBuffer;
-model globalModel;
+renderTarget frameTarget;
+tiler frameTiler;
+scene globalScene;
 float rotAngle;
 
 void display() {
-	clear(frameBuffer);
+	STATS_STAGE(&frameTarget.stats, STAGE_CLEAR, clearTarget(&frameTarget, COLOUR_BLACK, FLT_MIN));
 
-	// Initialize z buffer
-	float* zbuf = (float*)malloc( sizeof(float) * WIDTH * HEIGHT );
-	for( int y = 0; y < HEIGHT; y++ ) {
-		for( int x = 0; x < WIDTH; x++ ) {
-			zbuf[y*WIDTH+x] = FLT_MIN;
-		}
-	}
-
-	matrix transMatrix, rotMatrixA, mvMatrixO;
-	matrixTranslate(&transMatrix, 0, 0, 6);
+	matrix viewMatrix, rotMatrixA;
+	matrixTranslate(&viewMatrix, 0, 0, 6);
 	matrixRotY(&rotMatrixA, rotAngle);
-	matrixMult(&mvMatrixO, transMatrix, rotMatrixA);
+	moveSceneObject(&globalScene, 0, rotMatrixA);
 
 	matrix pMatrixO;
 	matrixPerspective(&pMatrixO, 45, 4.0/3.0, 1.0, 32.0 );
 
-	applyTransforms(&globalModel, mvMatrixO, pMatrixO);
-	shade(&globalModel, 5, 5, 5);
-
-	rasterize(&globalModel, &frameBuffer, zbuf);
+	drawScene(&globalScene, &frameTiler, &frameTarget, viewMatrix, pMatrixO);
+	STATS_STAGE(&frameTarget.stats, STAGE_RESOLVE, resolveTiled(&frameTiler, &frameTarget));
 
 	// Copy img's buffer to the screen
-	glDrawPixels(WIDTH, HEIGHT, GL_RGBA, GL_FLOAT, frameBuffer.data);
+	glDrawPixels(WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, frameTarget.colour.data);
 	rotAngle += 0.02;
-	
-	// Leaking memory is rude.
-	free( zbuf );
 
 	glutSwapBuffers();
 }
@@ -60,7 +49,30 @@ void keyboard(unsigned char key, int x, int y) {
 		break;
 
 		case 's':
-			writeToImage(frameBuffer, "out.bmp");
+			writeToImage(frameTarget.colour, "out.bmp");
+		break;
+
+		// Visibility buffer on or off.
+		case 'v':
+			setVisibilityMode(&frameTarget, !frameTarget.ids);
+		break;
+
+		// Multisampling: off, 2, 4, 8 samples, off again.
+		case 'a':
+			setMultisampling(&frameTarget, frameTarget.samples == 8 ? 1 : frameTarget.samples * 2);
+		break;
+
+		// Flat shading on or off.
+		case 'f':
+			frameTiler.state.shade = frameTiler.state.shade == SHADE_FLAT ? SHADE_GOURAUD : SHADE_FLAT;
+		break;
+
+		// Statistics of the frame on screen (make STATS=1).
+		case 'd': {
+			frameStats stats = targetStats(&frameTarget);
+			printFrameStats(stdout, &stats);
+			writeOverdrawImage(&frameTarget, "overdraw.bmp");
+		}
 		break;
 
 		default:
@@ -69,12 +81,16 @@ void keyboard(unsigned char key, int x, int y) {
 }
 
 int main(int argc, char **argv) {
-
-	globalModel = makeModelFromMeshFile("suzanne.raw");
-
-	frameBuffer = makeBuffer(320,240);
+	frameTarget = makeRenderTarget(WIDTH, HEIGHT, PIXEL_RGBA8);
+	frameTiler = makeTiler(processorCount());
 
 	glutInit(&argc, argv);
+	globalScene = makeScene();
+	addLight(&globalScene.lights, makePointLight(makeVec3(5, 5, 5), COLOUR_WHITE, 0));
+	matrix world;
+	matrixId(&world);
+	addSceneObject(&globalScene, addSceneModel(&globalScene, makeModelFromFile(argc > 1 ? argv[1] : "suzanne.raw", frameTiler.pool)), world);
+
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
 	glutInitWindowSize(WIDTH, HEIGHT);
 	glutCreateWindow("Rasterizer");
@@ -213,7 +213,7 @@ void matrixApplyPerspective(vec3* r, matrix a, vec3 b) {
 	r->z = a.v[8] * b.x + a.v[9] * b.y + a.v[10] * b.z + a.v[11];
 	scalar w = a.v[12] * b.x + a.v[13] * b.y + a.v[14] * b.z + a.v[15];
 	
-	if(scalarAbs(w) > 0.00001) {
+	if(scalarAbs(w) > PERSPECTIVE_EPSILON) {
 		r->x /= w;
 		r->y /= w;
 		r->z /= w;
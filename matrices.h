@@ -34,6 +34,8 @@ void matrixScale(matrix* m, scalar x, scalar y, scalar z);
 void matrixRotY(matrix* m, scalar a);
 void matrixTranslate(matrix* m, scalar x, scalar y, scalar z);
 void matrixPerspective(matrix* m, scalar degrees, scalar aspect, scalar near, scalar far);
+// Divides by w, unless it is no bigger than PERSPECTIVE_EPSILON.
+#define PERSPECTIVE_EPSILON 0.00001f
 void matrixApplyPerspective(vec3* r, matrix a, vec3 b);
 
 #endif
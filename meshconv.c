@@ -0,0 +1,23 @@
+/**
+ * Converts raw meshes to binary mesh files that can be mapped directly.
+ * (c) L. Diener 2011
+ */
+
+#include "models.h"
+
+int main(int argc, char **argv) {
+	if(argc != 3) {
+		fprintf(stderr, "Usage: %s in.raw out.mesh\n", argv[0]);
+		return 1;
+	}
+
+	model m = makeModelFromMeshFile(argv[1]);
+	writeMeshFile(&m, argv[2]);
+	printf(
+		"%s: %d triangles, %d vertices\n",
+		argv[2], modelTriangleCount(&m), modelVertexCount(&m)
+	);
+	freeModel(&m);
+
+	return 0;
+}
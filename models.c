@@ -4,21 +4,71 @@
  * (c) L. Diener 2011
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "models.h"
 
-void readRawMesh(model* newModel, const char *filename) {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef RASTER_SIMD
+#include <emmintrin.h>
+#endif
+
+vertexStreams makeVertexStreams(int count) {
+	vertexStreams s;
+	s.count = count;
+	s.x = makeScalarArray(count);
+	s.y = makeScalarArray(count);
+	s.z = makeScalarArray(count);
+	s.nx = makeScalarArray(count);
+	s.ny = makeScalarArray(count);
+	s.nz = makeScalarArray(count);
+	s.u = NULL;
+	s.v = NULL;
+	return s;
+}
+
+// Zeroed texture coordinate streams, for meshes that have some.
+void addTexCoords(vertexStreams* s) {
+	s->u = makeScalarArray(s->count);
+	s->v = makeScalarArray(s->count);
+	memset(s->u, 0, sizeof(scalar) * s->count);
+	memset(s->v, 0, sizeof(scalar) * s->count);
+}
+
+void freeVertexStreams(vertexStreams* s) {
+	free(s->x);
+	free(s->y);
+	free(s->z);
+	free(s->nx);
+	free(s->ny);
+	free(s->nz);
+	free(s->u);
+	free(s->v);
+}
+
+float* readRawMesh(const char *filename, int* tris) {
 	FILE *file = fopen(filename, "rb");
-	size_t res;
 
+	float* mesh;
 	int triangleCount;
 	if (file) {
-		if(!sizeof(float) == 4) {
+		if(sizeof(float) != 4) {
 			fprintf(stderr, "No 4 byte floats.");
 			exit(1);
 		}
-		res = fread(&triangleCount, sizeof(int), 1, file);
-		newModel->mesh = (float*)malloc(triangleCount * 18 * sizeof(float));
-		res = fread(newModel->mesh, 18 * sizeof(float), triangleCount, file);
+		if(fread(&triangleCount, sizeof(int), 1, file) != 1 || triangleCount <= 0) {
+			fprintf(stderr, "Error: \"%s\" has no valid triangle count.\n", filename);
+			exit(1);
+		}
+		mesh = (float*)malloc(triangleCount * 18 * sizeof(float));
+		if(fread(mesh, 18 * sizeof(float), triangleCount, file) != (size_t)triangleCount) {
+			fprintf(stderr, "Error: \"%s\" is truncated.\n", filename);
+			exit(1);
+		}
 
 		fclose(file);
 	}
@@ -27,109 +77,710 @@ void readRawMesh(model* newModel, const char *filename) {
 		exit(1);
 	}
 
-	newModel->triangleCount = triangleCount;
+	*tris = triangleCount;
+	return mesh;
+}
+
+vertexOutput makeVertexOutput(int count) {
+	vertexOutput o;
+	o.capacity = count;
+
+	// Padded like the streams, the vertex stage runs over the tail.
+	size_t padded = ((count + SCALAR_LANES - 1) / SCALAR_LANES + 1) * SCALAR_LANES;
+	void* p = NULL;
+	if(posix_memalign(&p, 64, padded * sizeof(postVertex)) != 0) {
+		fprintf(stderr, "Error: Out of memory allocating %d vertices.\n", count);
+		exit(1);
+	}
+	o.vertices = (postVertex*)p;
+	o.clipNear = 0;
+	return o;
+}
+
+void freeVertexOutput(vertexOutput* o) {
+	free(o->vertices);
 }
 
-void prepareMesh(model* newModel) {
-	newModel->curTriangle = 0;
+// Bounding sphere of one vertex chunk, centred on its box, for culling
+// lights per chunk.
+static void boundChunk(const vertexStreams* v, int c, scalar* s) {
+	int start = c * VERTEX_CHUNK;
+	int end = v->count - start < VERTEX_CHUNK ? v->count : start + VERTEX_CHUNK;
+	vec3 lo = makeVec3(v->x[start], v->y[start], v->z[start]);
+	vec3 hi = lo;
+	for(int i = start + 1; i < end; i++) {
+		lo = makeVec3(fminf(lo.x, v->x[i]), fminf(lo.y, v->y[i]), fminf(lo.z, v->z[i]));
+		hi = makeVec3(fmaxf(hi.x, v->x[i]), fmaxf(hi.y, v->y[i]), fmaxf(hi.z, v->z[i]));
+	}
+	vec3 centre = makeVec3((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+	scalar radius = 0.0f;
+	for(int i = start; i < end; i++) {
+		radius = fmaxf(radius, dist3(centre, makeVec3(v->x[i], v->y[i], v->z[i])));
+	}
+	s[0] = centre.x;
+	s[1] = centre.y;
+	s[2] = centre.z;
+	s[3] = radius;
+}
+
+// All of them, for models in memory. Reads all the positions, once.
+static void boundChunks(model* m) {
+	int chunks = vertexChunks(m->vertices.count);
+	m->chunkSpheres = (scalar*)malloc(sizeof(scalar) * 4 * (chunks ? chunks : 1));
+	m->sphereState = NULL;
+	for(int c = 0; c < chunks; c++) {
+		boundChunk(&m->vertices, c, &m->chunkSpheres[c * 4]);
+	}
+}
 
-	newModel->triangles = (triangle*)malloc(sizeof(triangle) * newModel->triangleCount);
-	for (int i = 0; i < newModel->triangleCount; i++) {
-		newModel->triangles[i].ID = i;
+// The sphere of a chunk. Where the file had none, the first thread to get
+// to a chunk bounds it for good; any other one drawing the same chunk
+// meanwhile bounds it again into scratch rather than wait.
+static const scalar* chunkSphere(const model* m, int chunk, scalar* scratch) {
+	scalar* s = &m->chunkSpheres[chunk * 4];
+	if(!m->sphereState || __sync_fetch_and_add(&m->sphereState[chunk], 0) == 2) {
+		return s;
+	}
+	if(__sync_bool_compare_and_swap(&m->sphereState[chunk], 0, 1)) {
+		boundChunk(&m->vertices, chunk, s);
+		__sync_bool_compare_and_swap(&m->sphereState[chunk], 1, 2);
+		return s;
 	}
+	boundChunk(&m->vertices, chunk, scratch);
+	return scratch;
 }
 
+static void meshFileError(const char* filename, const char* what) {
+	fprintf(stderr, "Error: \"%s\" %s.\n", filename, what);
+	exit(1);
+}
+
+// Maps a binary mesh file. Nothing but the header is looked at, pages are
+// read in as the streams get used. Returns false if the file is not a
+// mesh file at all.
+static bool mapMeshFile(model* m, const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Error: Couldn't open \"%s\".\n", filename);
+		exit(1);
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(meshHeader)) {
+		close(fd);
+		return false;
+	}
+	size_t size = (size_t)info.st_size;
+	meshHeader* header = (meshHeader*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(header == MAP_FAILED) {
+		meshFileError(filename, "could not be mapped");
+	}
+	if(header->magic != MESH_MAGIC) {
+		munmap(header, size);
+		return false;
+	}
+
+	if(header->version < 1 || header->version > MESH_VERSION) {
+		meshFileError(filename, "has an unsupported version");
+	}
+	if(header->vertexCount == 0 || header->vertexCount > INT32_MAX || header->triangleCount == 0 || header->triangleCount > INT32_MAX / 3) {
+		meshFileError(filename, "has bad counts");
+	}
+	if(!(header->flags & MESH_INDEXED) && header->vertexCount != header->triangleCount * 3) {
+		meshFileError(filename, "has no indices and a vertex count that does not match");
+	}
+
+	if(header->version == 1 && (header->flags & MESH_TEXCOORDS)) {
+		meshFileError(filename, "has texture coordinates in a version 1 header");
+	}
+
+	// Streams have to be aligned and inside the file. The vertex stage reads
+	// whole SIMD lanes, so vertex streams have to be padded to them, as
+	// writeMeshFile does.
+	bool texCoords = (header->flags & MESH_TEXCOORDS) != 0;
+	bool spheres = header->version >= 3;
+	int chunks = vertexChunks((int)header->vertexCount);
+	uint64_t padded = ((uint64_t)header->vertexCount + SCALAR_LANES - 1) / SCALAR_LANES * SCALAR_LANES;
+	for(int i = 0; i < 10; i++) {
+		if((i == 6 && !(header->flags & MESH_INDEXED)) || ((i == 7 || i == 8) && !texCoords) || (i == 9 && !spheres)) {
+			continue;
+		}
+		uint64_t length = i == 6 ? (uint64_t)header->triangleCount * 3 * sizeof(uint32_t) :
+			i == 9 ? (uint64_t)chunks * 4 * sizeof(float) :
+			padded * sizeof(float);
+		if(header->streams[i] % MESH_ALIGN != 0 || header->streams[i] > size || length > size - header->streams[i]) {
+			meshFileError(filename, "is truncated or has bad stream offsets");
+		}
+	}
+
+	char* base = (char*)header;
+	m->mapping = header;
+	m->mappingSize = size;
+	m->triangleCount = header->triangleCount;
+	m->vertices.count = header->vertexCount;
+	m->vertices.x = (scalar*)(base + header->streams[0]);
+	m->vertices.y = (scalar*)(base + header->streams[1]);
+	m->vertices.z = (scalar*)(base + header->streams[2]);
+	m->vertices.nx = (scalar*)(base + header->streams[3]);
+	m->vertices.ny = (scalar*)(base + header->streams[4]);
+	m->vertices.nz = (scalar*)(base + header->streams[5]);
+	m->vertices.u = texCoords ? (scalar*)(base + header->streams[7]) : NULL;
+	m->vertices.v = texCoords ? (scalar*)(base + header->streams[8]) : NULL;
+	m->boundsMin = makeVec3(header->bounds[0], header->bounds[1], header->bounds[2]);
+	m->boundsMax = makeVec3(header->bounds[3], header->bounds[4], header->bounds[5]);
+
+	// Index values are trusted, checking them would page in everything.
+	if(header->flags & MESH_INDEXED) {
+		m->indices = (uint32_t*)(base + header->streams[6]);
+	}
+	else {
+		m->indices = (uint32_t*)malloc(sizeof(uint32_t) * header->vertexCount);
+		for(uint32_t i = 0; i < header->vertexCount; i++) {
+			m->indices[i] = i;
+		}
+	}
+
+	// Older files leave the chunk spheres to be worked out as chunks get
+	// drawn, reading everything here would page in the whole file.
+	m->output = makeVertexOutput(m->vertices.count);
+	if(spheres) {
+		m->chunkSpheres = (scalar*)(base + header->streams[9]);
+		m->sphereState = NULL;
+	}
+	else {
+		m->chunkSpheres = (scalar*)malloc(sizeof(scalar) * 4 * chunks);
+		m->sphereState = (int*)calloc(chunks, sizeof(int));
+	}
+	return true;
+}
+
+// Loads either a binary mesh file or a raw one.
 model makeModelFromMeshFile(const char* file) {
 	model newModel;
-	readRawMesh(&newModel, file);
-	prepareMesh(&newModel);
+	if(mapMeshFile(&newModel, file)) {
+		return newModel;
+	}
+
+	int tris;
+	float* mesh = readRawMesh(file, &tris);
+	newModel = makeModelFromMesh(mesh, tris);
+	free(mesh);
 	return newModel;
 }
 
+// Writes a stream, zero padded to the next MESH_ALIGN boundary.
+static void writeMeshStream(FILE* file, const void* data, size_t size, const char* filename) {
+	static const char zeroes[MESH_ALIGN] = { 0 };
+	size_t padding = (MESH_ALIGN - size % MESH_ALIGN) % MESH_ALIGN;
+	if(fwrite(data, 1, size, file) != size || fwrite(zeroes, 1, padding, file) != padding) {
+		meshFileError(filename, "could not be written");
+	}
+}
+
+void writeMeshFile(model* m, const char* filename) {
+	FILE* file = fopen(filename, "wb");
+	if(!file) {
+		fprintf(stderr, "Error: Couldn't open \"%s\" for writing.\n", filename);
+		exit(1);
+	}
+
+	meshHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MESH_MAGIC;
+	header.version = MESH_VERSION;
+	header.flags = MESH_INDEXED | (m->vertices.u ? MESH_TEXCOORDS : 0);
+	header.vertexCount = m->vertices.count;
+	header.triangleCount = m->triangleCount;
+	header.bounds[0] = m->boundsMin.x;
+	header.bounds[1] = m->boundsMin.y;
+	header.bounds[2] = m->boundsMin.z;
+	header.bounds[3] = m->boundsMax.x;
+	header.bounds[4] = m->boundsMax.y;
+	header.bounds[5] = m->boundsMax.z;
+
+	// Spheres a mapped older file has not needed yet get bounded now.
+	int chunks = vertexChunks(m->vertices.count);
+	if(m->sphereState) {
+		for(int c = 0; c < chunks; c++) {
+			chunkSphere(m, c, NULL);
+		}
+	}
+
+	size_t streamSize = (size_t)header.vertexCount * sizeof(float);
+	size_t indexSize = (size_t)header.triangleCount * 3 * sizeof(uint32_t);
+	size_t sphereSize = (size_t)chunks * 4 * sizeof(float);
+	uint64_t offset = (sizeof(header) + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+	for(int i = 0; i < 10; i++) {
+		if((i == 7 || i == 8) && !m->vertices.u) {
+			continue;
+		}
+		header.streams[i] = offset;
+		offset += ((i == 6 ? indexSize : i == 9 ? sphereSize : streamSize) + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+	}
+
+	writeMeshStream(file, &header, sizeof(header), filename);
+	const scalar* streams[6] = {
+		m->vertices.x, m->vertices.y, m->vertices.z,
+		m->vertices.nx, m->vertices.ny, m->vertices.nz
+	};
+	for(int i = 0; i < 6; i++) {
+		writeMeshStream(file, streams[i], streamSize, filename);
+	}
+	writeMeshStream(file, m->indices, indexSize, filename);
+	if(m->vertices.u) {
+		writeMeshStream(file, m->vertices.u, streamSize, filename);
+		writeMeshStream(file, m->vertices.v, streamSize, filename);
+	}
+	writeMeshStream(file, m->chunkSpheres, sphereSize, filename);
+
+	if(fclose(file) != 0) {
+		meshFileError(filename, "could not be written");
+	}
+}
+
+// Hash of a raw vertex, position and normal, by bit pattern.
+static uint32_t hashVertex(const float* v) {
+	uint32_t h = 2166136261u;
+	for(int i = 0; i < 6; i++) {
+		uint32_t bits;
+		memcpy(&bits, &v[i], sizeof(bits));
+		h = (h ^ bits) * 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+// Raw meshes are position, normal, position, normal, ... per triangle.
+// Vertices that are bit for bit identical are welded into one, so they
+// get transformed and shaded once.
 model makeModelFromMesh(float* renderMesh, int tris) {
+	int count = tris * 3;
+
+	// Open addressing table of raw vertex numbers, at most half full.
+	int tableSize = 1;
+	while(tableSize < count * 2) {
+		tableSize *= 2;
+	}
+	int* table = (int*)malloc(sizeof(int) * tableSize);
+	for(int i = 0; i < tableSize; i++) {
+		table[i] = -1;
+	}
+
+	uint32_t* indices = (uint32_t*)malloc(sizeof(uint32_t) * count);
+	int* unique = (int*)malloc(sizeof(int) * count);
+	int uniqueCount = 0;
+	for(int i = 0; i < count; i++) {
+		const float* raw = &renderMesh[i * 6];
+		uint32_t slot = hashVertex(raw) & (tableSize - 1);
+		while(table[slot] != -1 && memcmp(&renderMesh[unique[table[slot]] * 6], raw, sizeof(float) * 6) != 0) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if(table[slot] == -1) {
+			table[slot] = uniqueCount;
+			unique[uniqueCount++] = i;
+		}
+		indices[i] = table[slot];
+	}
+	free(table);
+
+	vertexStreams v = makeVertexStreams(uniqueCount);
+	for(int i = 0; i < uniqueCount; i++) {
+		const float* raw = &renderMesh[unique[i] * 6];
+		v.x[i] = raw[0];
+		v.y[i] = raw[1];
+		v.z[i] = raw[2];
+		v.nx[i] = raw[3];
+		v.ny[i] = raw[4];
+		v.nz[i] = raw[5];
+	}
+	free(unique);
+	return makeModelFromStreams(v, indices, tris);
+}
+
+model makeModelFromStreams(vertexStreams vertices, uint32_t* indices, int tris) {
 	model newModel;
-	newModel.mesh = (float*)malloc(sizeof(float) * tris * 18);
-	memcpy(newModel.mesh, renderMesh, sizeof(float) * tris * 18);
 	newModel.triangleCount = tris;
-	prepareMesh(&newModel);
+	newModel.indices = indices;
+	newModel.vertices = vertices;
+	newModel.mapping = NULL;
+	newModel.mappingSize = 0;
+	newModel.output = makeVertexOutput(vertices.count);
+
+	newModel.boundsMin = makeVec3(vertices.x[0], vertices.y[0], vertices.z[0]);
+	newModel.boundsMax = newModel.boundsMin;
+	for(int i = 1; i < vertices.count; i++) {
+		newModel.boundsMin = makeVec3(fminf(newModel.boundsMin.x, vertices.x[i]), fminf(newModel.boundsMin.y, vertices.y[i]), fminf(newModel.boundsMin.z, vertices.z[i]));
+		newModel.boundsMax = makeVec3(fmaxf(newModel.boundsMax.x, vertices.x[i]), fmaxf(newModel.boundsMax.y, vertices.y[i]), fmaxf(newModel.boundsMax.z, vertices.z[i]));
+	}
+	boundChunks(&newModel);
 	return newModel;
 }
 
-void freeModel(model* m) {
-	free(m->mesh);
-	free(m->triangles);
-}
+// Area weighted average of the normals of the faces around each vertex.
+void smoothNormals(vertexStreams* v, const uint32_t* indices, int tris) {
+	memset(v->nx, 0, sizeof(scalar) * v->count);
+	memset(v->ny, 0, sizeof(scalar) * v->count);
+	memset(v->nz, 0, sizeof(scalar) * v->count);
+
+	for(int i = 0; i < tris; i++) {
+		const uint32_t* t = &indices[i * 3];
+		vec3 a = makeVec3(v->x[t[1]] - v->x[t[0]], v->y[t[1]] - v->y[t[0]], v->z[t[1]] - v->z[t[0]]);
+		vec3 b = makeVec3(v->x[t[2]] - v->x[t[0]], v->y[t[2]] - v->y[t[0]], v->z[t[2]] - v->z[t[0]]);
+		vec3 n = makeVec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+		for(int j = 0; j < 3; j++) {
+			v->nx[t[j]] += n.x;
+			v->ny[t[j]] += n.y;
+			v->nz[t[j]] += n.z;
+		}
+	}
 
-int modelTrianglesLeft(model* m) {
-	return(m->curTriangle != m->triangleCount);
+	for(int i = 0; i < v->count; i++) {
+		scalar len = scalarSqrt(v->nx[i] * v->nx[i] + v->ny[i] * v->ny[i] + v->nz[i] * v->nz[i]);
+		if(len > 0.0f) {
+			v->nx[i] /= len;
+			v->ny[i] /= len;
+			v->nz[i] /= len;
+		}
+		else {
+			v->nz[i] = 1.0f;
+		}
+	}
 }
 
-triangle* modelNextTriangle(model* m) {
-	return &m->triangles[m->curTriangle++];
+void freeModel(model* m) {
+	if(m->mapping) {
+		if(!(m->mapping->flags & MESH_INDEXED)) {
+			free(m->indices);
+		}
+		if(!(m->mapping->flags & MESH_TEXCOORDS)) {
+			free(m->vertices.u);
+			free(m->vertices.v);
+		}
+		munmap(m->mapping, m->mappingSize);
+	}
+	else {
+		free(m->indices);
+		freeVertexStreams(&m->vertices);
+	}
+	freeVertexOutput(&m->output);
+	if(!m->mapping || m->sphereState) {
+		free(m->chunkSpheres);
+	}
+	free(m->sphereState);
 }
 
 int modelTriangleCount(model* m) {
 	return m->triangleCount;
 }
 
-void applyTransforms(model* m, matrix mvMatrixO, matrix pMatrixO) {
-	vec3 triVec;
-	vec3 transVec;
-	vec3 projVec;
+int modelVertexCount(model* m) {
+	return m->vertices.count;
+}
+
+void setClipNear(vertexOutput* out, matrix pMatrix) {
+	// Near plane of a matrixPerspective projection, n = 2fn/(n-f) / ((f+n)/(n-f) - 1).
+	// Anything else gets one that just keeps w away from zero.
+	out->clipNear = pMatrix.v[11] / (pMatrix.v[10] - 1);
+	if(!(out->clipNear > PERSPECTIVE_EPSILON)) {
+		out->clipNear = PERSPECTIVE_EPSILON;
+	}
+}
+
+#ifdef RASTER_SIMD
 
-	for(int i = 0; i < m->triangleCount; i++) {
-		for(int j = 0; j < 6; j++) {
-			triVec = makeVec3(
-				m->mesh[m->triangles[i].ID * 18 + j*3],
-				m->mesh[m->triangles[i].ID * 18 + j*3 + 1],
-				m->mesh[m->triangles[i].ID * 18 + j*3 + 2]
-			);
+// Four vertices per iteration, turned into records at the end, each lit
+// by the lights in use. Streams are aligned and padded, so running over
+// the tail is fine.
+static void vertexKernel(const vertexStreams* v, int start, int count, const matrix* mvp, const matrix* mv, const eyeLight* lights, const int16_t* use, int useCount, const scalar* tint, scalar clipNear, postVertex* out) {
+	__m128 m[16];
+	__m128 n[12];
+	for(int i = 0; i < 16; i++) {
+		m[i] = _mm_set1_ps(mvp->v[i]);
+	}
+	for(int i = 0; i < 12; i++) {
+		n[i] = _mm_set1_ps(mv->v[i]);
+	}
+	__m128 eps = _mm_set1_ps(PERSPECTIVE_EPSILON);
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 near = _mm_set1_ps(clipNear);
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 three = _mm_set1_ps(3.0f);
+	__m128 two = _mm_set1_ps(2.0f);
+	__m128 tr = _mm_set1_ps(tint[0]);
+	__m128 tg = _mm_set1_ps(tint[1]);
+	__m128 tb = _mm_set1_ps(tint[2]);
 
-			if (j % 2 == 0) {
-				matrixApply(&transVec, mvMatrixO, triVec);
-				matrixApplyPerspective(&projVec, pMatrixO, transVec);
+	for(int i = start; i < start + count; i += 4) {
+		__m128 vx = _mm_load_ps(&v->x[i]);
+		__m128 vy = _mm_load_ps(&v->y[i]);
+		__m128 vz = _mm_load_ps(&v->z[i]);
 
-				m->triangles[i].vertices[j/2][0] = projVec.x;
-				m->triangles[i].vertices[j/2][1] = projVec.y;
-				m->triangles[i].vertices[j/2][2] = projVec.z;
-			}
-			else {
-				matrixApplyNormal(&transVec, mvMatrixO, triVec);
-				m->triangles[i].normals[j/2][0] = transVec.x;
-				m->triangles[i].normals[j/2][1] = transVec.y;
-				m->triangles[i].normals[j/2][2] = transVec.z;
+		__m128 px = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], vx), _mm_mul_ps(m[1], vy)), _mm_add_ps(_mm_mul_ps(m[2], vz), m[3]));
+		__m128 py = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], vx), _mm_mul_ps(m[5], vy)), _mm_add_ps(_mm_mul_ps(m[6], vz), m[7]));
+		__m128 pz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], vx), _mm_mul_ps(m[9], vy)), _mm_add_ps(_mm_mul_ps(m[10], vz), m[11]));
+		__m128 pw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[12], vx), _mm_mul_ps(m[13], vy)), _mm_add_ps(_mm_mul_ps(m[14], vz), m[15]));
+
+		// Clip codes, from clip space.
+		__m128 npw = _mm_sub_ps(zero, pw);
+		__m128i codes = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(px, npw)), _mm_set1_epi32(CLIP_LEFT));
+		codes = _mm_or_si128(codes, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(px, pw)), _mm_set1_epi32(CLIP_RIGHT)));
+		codes = _mm_or_si128(codes, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(py, npw)), _mm_set1_epi32(CLIP_BOTTOM)));
+		codes = _mm_or_si128(codes, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(py, pw)), _mm_set1_epi32(CLIP_TOP)));
+		codes = _mm_or_si128(codes, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(pw, near)), _mm_set1_epi32(CLIP_NEAR)));
+
+		// Divide where w is not tiny, like matrixApplyPerspective.
+		__m128 divide = _mm_cmpgt_ps(_mm_and_ps(pw, absMask), eps);
+		__m128 dw = _mm_or_ps(_mm_and_ps(divide, pw), _mm_andnot_ps(divide, one));
+		px = _mm_div_ps(px, dw);
+		py = _mm_div_ps(py, dw);
+		pz = _mm_div_ps(pz, dw);
+
+		__m128 cr = zero;
+		__m128 cg = zero;
+		__m128 cb = zero;
+		if(useCount) {
+			// Eye space position and normal.
+			__m128 ex = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], vx), _mm_mul_ps(n[1], vy)), _mm_add_ps(_mm_mul_ps(n[2], vz), n[3]));
+			__m128 ey = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[4], vx), _mm_mul_ps(n[5], vy)), _mm_add_ps(_mm_mul_ps(n[6], vz), n[7]));
+			__m128 ez = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[8], vx), _mm_mul_ps(n[9], vy)), _mm_add_ps(_mm_mul_ps(n[10], vz), n[11]));
+			__m128 ox = _mm_load_ps(&v->nx[i]);
+			__m128 oy = _mm_load_ps(&v->ny[i]);
+			__m128 oz = _mm_load_ps(&v->nz[i]);
+			__m128 nx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], ox), _mm_mul_ps(n[1], oy)), _mm_mul_ps(n[2], oz));
+			__m128 ny = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[4], ox), _mm_mul_ps(n[5], oy)), _mm_mul_ps(n[6], oz));
+			__m128 nz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[8], ox), _mm_mul_ps(n[9], oy)), _mm_mul_ps(n[10], oz));
+			__m128 nl = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+			nx = _mm_div_ps(nx, nl);
+			ny = _mm_div_ps(ny, nl);
+			nz = _mm_div_ps(nz, nl);
+
+			// Diffuse, each light once for all three channels.
+			for(int k = 0; k < useCount; k++) {
+				const eyeLight* l = &lights[use[k]];
+				__m128 f;
+				if(l->type == LIGHT_DIRECTIONAL) {
+					__m128 ndotl = _mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(nx, _mm_set1_ps(-l->direction.x)),
+						_mm_mul_ps(ny, _mm_set1_ps(-l->direction.y))),
+						_mm_mul_ps(nz, _mm_set1_ps(-l->direction.z)));
+					f = _mm_max_ps(ndotl, zero);
+				}
+				else {
+					__m128 dx = _mm_sub_ps(_mm_set1_ps(l->position.x), ex);
+					__m128 dy = _mm_sub_ps(_mm_set1_ps(l->position.y), ey);
+					__m128 dz = _mm_sub_ps(_mm_set1_ps(l->position.z), ez);
+					__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+					__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(d2));
+					__m128 ndotl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz));
+					f = _mm_max_ps(_mm_mul_ps(ndotl, inv), zero);
+					if(l->range > 0.0f) {
+						__m128 a = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(d2, _mm_set1_ps(l->invRange2))), zero);
+						f = _mm_mul_ps(f, _mm_mul_ps(a, a));
+					}
+					if(l->type == LIGHT_SPOT) {
+						__m128 cd = _mm_add_ps(_mm_add_ps(
+							_mm_mul_ps(dx, _mm_set1_ps(l->direction.x)),
+							_mm_mul_ps(dy, _mm_set1_ps(l->direction.y))),
+							_mm_mul_ps(dz, _mm_set1_ps(l->direction.z)));
+						cd = _mm_sub_ps(zero, _mm_mul_ps(cd, inv));
+						__m128 c = _mm_mul_ps(_mm_sub_ps(cd, _mm_set1_ps(l->outerCos)), _mm_set1_ps(l->invCone));
+						c = _mm_min_ps(_mm_max_ps(c, zero), one);
+						f = _mm_mul_ps(f, _mm_mul_ps(_mm_mul_ps(c, c), _mm_sub_ps(three, _mm_mul_ps(two, c))));
+					}
+				}
+				cr = _mm_add_ps(cr, _mm_mul_ps(f, _mm_set1_ps(l->r)));
+				cg = _mm_add_ps(cg, _mm_mul_ps(f, _mm_set1_ps(l->g)));
+				cb = _mm_add_ps(cb, _mm_mul_ps(f, _mm_set1_ps(l->b)));
 			}
 		}
-	}
+		else if(!lights) {
+			cr = one;
+			cg = one;
+			cb = one;
+		}
 
-	m->curTriangle = 0;
+		cr = _mm_mul_ps(cr, tr);
+		cg = _mm_mul_ps(cg, tg);
+		cb = _mm_mul_ps(cb, tb);
+		__m128 cc = _mm_castsi128_ps(codes);
+		_MM_TRANSPOSE4_PS(px, py, pz, pw);
+		_MM_TRANSPOSE4_PS(cr, cg, cb, cc);
+		postVertex* o = &out[i];
+		_mm_store_ps(&o[0].x, px);
+		_mm_store_ps(&o[0].r, cr);
+		_mm_store_ps(&o[1].x, py);
+		_mm_store_ps(&o[1].r, cg);
+		_mm_store_ps(&o[2].x, pz);
+		_mm_store_ps(&o[2].r, cb);
+		_mm_store_ps(&o[3].x, pw);
+		_mm_store_ps(&o[3].r, cc);
+	}
 }
 
-void shade(model* m, float lx, float ly, float lz) {
-	for(int i = 0; i != m->triangleCount; i++) {
-		for(int j = 0; j < 3; j++) {
-			for(int c = 0; c < 3; c++) {
-				// Diffuse lighting, white.
-				float Lx = lx - m->mesh[m->triangles[i].ID * 18 + j*6];
-				float Ly = ly - m->mesh[m->triangles[i].ID * 18 + j*6 + 1];
-				float Lz = lz - m->mesh[m->triangles[i].ID * 18 + j*6 + 2];
+#else
 
-				float lenL = sqrt(Lx*Lx + Ly*Ly + Lz*Lz);
+// Spot lights are smoothstepped from their outer cone to their inner.
+static scalar spotFactor(scalar c) {
+	return c * c * (3.0f - 2.0f * c);
+}
+
+static void vertexKernel(const vertexStreams* v, int start, int count, const matrix* mvp, const matrix* mv, const eyeLight* lights, const int16_t* use, int useCount, const scalar* tint, scalar clipNear, postVertex* out) {
+	const scalar* a = mvp->v;
+	for(int i = start; i < start + count; i++) {
+		vec3 p;
+		matrixApplyPerspective(&p, *mvp, makeVec3(v->x[i], v->y[i], v->z[i]));
+		scalar w = a[12] * v->x[i] + a[13] * v->y[i] + a[14] * v->z[i] + a[15];
 
-				Lx /= lenL;
-				Ly /= lenL;
-				Lz /= lenL;
+		// Clip codes, from clip space.
+		scalar cx = a[0] * v->x[i] + a[1] * v->y[i] + a[2] * v->z[i] + a[3];
+		scalar cy = a[4] * v->x[i] + a[5] * v->y[i] + a[6] * v->z[i] + a[7];
+		uint32_t clip = 0;
+		clip |= cx < -w ? CLIP_LEFT : 0;
+		clip |= cx > w ? CLIP_RIGHT : 0;
+		clip |= cy < -w ? CLIP_BOTTOM : 0;
+		clip |= cy > w ? CLIP_TOP : 0;
+		clip |= w < clipNear ? CLIP_NEAR : 0;
 
-				float NdotL =
-					m->triangles[i].normals[j][0] * Lx +
-					m->triangles[i].normals[j][1] * Ly +
-					m->triangles[i].normals[j][2] * Lz;
+		scalar c[3] = { 0, 0, 0 };
+		if(useCount) {
+			vec3 e;
+			vec3 n;
+			matrixApply(&e, *mv, makeVec3(v->x[i], v->y[i], v->z[i]));
+			matrixApplyNormal(&n, *mv, makeVec3(v->nx[i], v->ny[i], v->nz[i]));
 
-				if (NdotL < 0.0f) {
-					NdotL = 0.0f;
+			// Diffuse, each light once for all three channels.
+			for(int k = 0; k < useCount; k++) {
+				const eyeLight* l = &lights[use[k]];
+				scalar f;
+				if(l->type == LIGHT_DIRECTIONAL) {
+					f = fmaxf(-dot3(n, l->direction), 0.0f);
+				}
+				else {
+					vec3 d;
+					sub3(&d, l->position, e);
+					scalar d2 = dot3(d, d);
+					scalar inv = 1.0f / scalarSqrt(d2);
+					f = fmaxf(dot3(n, d) * inv, 0.0f);
+					if(l->range > 0.0f) {
+						scalar fade = fmaxf(1.0f - d2 * l->invRange2, 0.0f);
+						f *= fade * fade;
+					}
+					if(l->type == LIGHT_SPOT) {
+						scalar cone = (-dot3(d, l->direction) * inv - l->outerCos) * l->invCone;
+						f *= spotFactor(fminf(fmaxf(cone, 0.0f), 1.0f));
+					}
 				}
-				m->triangles[i].colors[j][c] = NdotL;
+				c[0] += f * l->r;
+				c[1] += f * l->g;
+				c[2] += f * l->b;
 			}
 		}
+		else if(!lights) {
+			c[0] = c[1] = c[2] = 1.0f;
+		}
+
+		postVertex* o = &out[i];
+		o->x = p.x;
+		o->y = p.y;
+		o->z = p.z;
+		o->w = w;
+		o->r = c[0] * tint[0];
+		o->g = c[1] * tint[1];
+		o->b = c[2] * tint[2];
+		o->clip = clip;
 	}
 }
+
+#endif
+
+// Eye space bounding sphere of an object space one.
+static void eyeSphere(vec3* centre, scalar* radius, const matrix* mv, vec3 c, scalar r) {
+	const scalar* w = mv->v;
+	scalar stretch = 0.0f;
+	for(int k = 0; k < 3; k++) {
+		stretch = fmaxf(stretch, length3(makeVec3(w[k], w[4 + k], w[8 + k])));
+	}
+	matrixApply(centre, *mv, c);
+	*radius = r * stretch;
+}
+
+void processChunk(const model* m, int chunk, matrix mvMatrix, matrix pMatrix, const lightList* lights, colour tint, vertexOutput* out, int first, frameStats* counts) {
+	// Project in one go rather than eye space first.
+	matrix mvpMatrix;
+	matrixMult(&mvpMatrix, pMatrix, mvMatrix);
+	scalar tints[3] = { tint.r, tint.g, tint.b };
+	int start = chunk * VERTEX_CHUNK;
+	int count = m->vertices.count - start < VERTEX_CHUNK ? m->vertices.count - start : VERTEX_CHUNK;
+
+	// The lights that reach the object, and of those the ones that reach
+	// this chunk of it. Nothing else is evaluated per vertex.
+	int16_t use[MAX_LIGHTS];
+	int useCount = 0;
+	if(lights && lights->count) {
+		vec3 objectCentre;
+		vec3 chunkCentre;
+		scalar objectRadius;
+		scalar chunkRadius;
+		vec3 lo = m->boundsMin;
+		vec3 hi = m->boundsMax;
+		vec3 c = makeVec3((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+		eyeSphere(&objectCentre, &objectRadius, &mvMatrix, c, dist3(c, hi));
+		scalar scratch[4];
+		const scalar* s = chunkSphere(m, chunk, scratch);
+		eyeSphere(&chunkCentre, &chunkRadius, &mvMatrix, makeVec3(s[0], s[1], s[2]), s[3]);
+		for(int i = 0; i < lights->count; i++) {
+			const eyeLight* l = &lights->eye[i];
+			if(lightReaches(l, objectCentre, objectRadius) && lightReaches(l, chunkCentre, chunkRadius)) {
+				use[useCount++] = (int16_t)i;
+			}
+		}
+	}
+	vertexKernel(&m->vertices, start, count, &mvpMatrix, &mvMatrix, lights ? lights->eye : NULL, use, useCount, tints, out->clipNear, out->vertices + first);
+	STATS_ADD(counts, STAT_VERTICES, count);
+	STATS_ADD(counts, STAT_VERTEX_LIGHTS, (long)count * useCount);
+}
+
+int vertexChunks(int count) {
+	return (count + VERTEX_CHUNK - 1) / VERTEX_CHUNK;
+}
+
+typedef struct vertexJob {
+	model* m;
+	matrix mvMatrix;
+	matrix pMatrix;
+	const lightList* lights;
+	frameStats* stats;
+} vertexJob;
+
+static void vertexChunk(void* arg, int chunk) {
+	vertexJob* job = (vertexJob*)arg;
+	frameStats counts = { 0 };
+	processChunk(job->m, chunk, job->mvMatrix, job->pMatrix, job->lights, COLOUR_WHITE, &job->m->output, 0, &counts);
+	if(job->stats) {
+		mergeStats(job->stats, &counts);
+	}
+}
+
+void applyVertexStageOn(workerPool* pool, model* m, matrix mvMatrix, matrix pMatrix, const lightList* lights, frameStats* stats) {
+	vertexJob job;
+	job.m = m;
+	job.mvMatrix = mvMatrix;
+	job.pMatrix = pMatrix;
+	job.lights = lights;
+	job.stats = stats;
+	setClipNear(&m->output, pMatrix);
+	int chunks = vertexChunks(m->vertices.count);
+	if(pool) {
+		runJobs(pool, vertexChunk, &job, chunks);
+	}
+	else {
+		for(int i = 0; i < chunks; i++) {
+			vertexChunk(&job, i);
+		}
+	}
+}
+
+void applyVertexStage(model* m, matrix mvMatrix, matrix pMatrix, const lightList* lights) {
+	applyVertexStageOn(NULL, m, mvMatrix, pMatrix, lights, NULL);
+}
@@ -7,36 +7,150 @@
 #ifndef __MODELS_H__
 #define __MODELS_H__
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "colours.h"
+#include "lights.h"
 #include "matrices.h"
+#include "stats.h"
+#include "workers.h"
 
-typedef struct triangle {
-	float vertices[3][3];
-	float normals[3][3];
+// Vertex positions, normals and texture coordinates, one array per
+// component so they can be transformed several at a time. u and v are
+// NULL for meshes without texture coordinates.
+typedef struct vertexStreams {
+	int count;
+	scalar* x;
+	scalar* y;
+	scalar* z;
+	scalar* nx;
+	scalar* ny;
+	scalar* nz;
+	scalar* u;
+	scalar* v;
+} vertexStreams;
 
-	float colors[3][3];
+// Binary mesh files, as written by writeMeshFile: a header, then the
+// vertex streams and the optional index buffer, each starting on a 64 byte
+// boundary and zero padded to one. Native byte order. They are mapped and
+// used in place rather than read. Version 1 files, which have no texture
+// coordinates and a shorter header, and version 2 ones, which have no chunk
+// spheres, still load.
+#define MESH_MAGIC 0x4853454d
+#define MESH_VERSION 3
+#define MESH_ALIGN 64
+#define MESH_INDEXED 1
+#define MESH_TEXCOORDS 2
 
-	int ID;
-} triangle;
+typedef struct meshHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint32_t reserved;
+	float bounds[6];
 
-typedef struct model {
-	float* mesh;
+	// Byte offsets of x, y, z, nx, ny, nz, the indices, u, v and the chunk
+	// spheres (model.chunkSpheres).
+	uint64_t streams[10];
+} meshHeader;
+
+// Clip codes: the frustum planes a vertex is outside of. Triangles with
+// all their vertices outside the same one are rejected before setup.
+#define CLIP_LEFT 1
+#define CLIP_RIGHT 2
+#define CLIP_BOTTOM 4
+#define CLIP_TOP 8
+#define CLIP_NEAR 16
+
+// A vertex as the vertex stage leaves it for triangle setup, two to a
+// cache line: position in NDC, clip space w (the distance in front of the
+// camera, positions are divided by it where it is not tiny), colour and
+// clip codes.
+typedef struct postVertex {
+	float x;
+	float y;
+	float z;
+	float w;
+	float r;
+	float g;
+	float b;
+	uint32_t clip;
+} postVertex;
+
+// What the vertex stage makes of vertices, for the rasterizer, with room
+// for capacity of them. Triangles reaching closer than the near plane
+// distance of the projection, clipNear, are clipped.
+typedef struct vertexOutput {
+	int capacity;
+	postVertex* vertices;
+	scalar clipNear;
+} vertexOutput;
 
+// Triangle i uses the unique vertices indices[3i], indices[3i+1] and
+// indices[3i+2]. The output is where applyVertexStage puts the vertices
+// of the model's one draw per frame.
+typedef struct model {
 	int triangleCount;
-	int curTriangle;
+	uint32_t* indices;
+
+	vertexStreams vertices;
+	vertexOutput output;
+
+	// Object space bounding box.
+	vec3 boundsMin;
+	vec3 boundsMax;
 
-	triangle* triangles;
+	// Object space bounding sphere of each VERTEX_CHUNK vertices, as
+	// centre x, y, z and radius. Mapped files without them get each chunk
+	// bounded the first time it is drawn; sphereState then says which are
+	// (0 not yet, 1 being bounded, 2 done). NULL when all of them are.
+	scalar* chunkSpheres;
+	int* sphereState;
+
+	// The mapped mesh file vertices and indices live in, if any.
+	meshHeader* mapping;
+	size_t mappingSize;
 } model;
 
+vertexStreams makeVertexStreams(int count);
+void addTexCoords(vertexStreams* s);
+void freeVertexStreams(vertexStreams* s);
+
+vertexOutput makeVertexOutput(int count);
+void freeVertexOutput(vertexOutput* o);
+
 model makeModelFromMeshFile(const char* file);
 model makeModelFromMesh(float* renderMesh, int tris);
+model makeModelFromStreams(vertexStreams vertices, uint32_t* indices, int tris);
+void smoothNormals(vertexStreams* v, const uint32_t* indices, int tris);
+void writeMeshFile(model* m, const char* file);
 void freeModel(model* m);
-int modelTrianglesLeft(model* m);
-triangle* modelNextTriangle(model* m);
 int modelTriangleCount(model* m);
-void applyTransforms(model* m, matrix mvMatrixO, matrix pMatrixO);
-void shade(model* m, float lx, float ly, float lz);
+int modelVertexCount(model* m);
+
+// Transforms, lights and classifies the model's vertices in one pass,
+// into its output. Lights are in eye space, as left by viewLights();
+// without a list, vertices are unlit and plain white.
+void applyVertexStage(model* m, matrix mvMatrix, matrix pMatrix, const lightList* lights);
+
+// The same in chunks of VERTEX_CHUNK vertices, small enough for a chunk's
+// streams in and out to stay in cache, as jobs on a worker pool (or in
+// order on the calling thread if it is NULL). Every vertex comes out the
+// same whatever the number of threads. Counts go to stats, if given.
+#define VERTEX_CHUNK 2048
+int vertexChunks(int count);
+void applyVertexStageOn(workerPool* pool, model* m, matrix mvMatrix, matrix pMatrix, const lightList* lights, frameStats* stats);
+
+// The vertex stage for one chunk of a model, into any output, starting at
+// first + the chunk's first vertex. first has to be a multiple of
+// SCALAR_LANES. Lights that cannot reach the model, or this chunk of it,
+// are skipped. Colours are multiplied by tint. Clip codes need the near
+// plane: setClipNear first, once per projection.
+void setClipNear(vertexOutput* out, matrix pMatrix);
+void processChunk(const model* m, int chunk, matrix mvMatrix, matrix pMatrix, const lightList* lights, colour tint, vertexOutput* out, int first, frameStats* counts);
 
 #endif
@@ -5,134 +5,1712 @@
 
 #include "rasterizer.h"
 
-model globalModel;
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define SCREEN_X(p) (((p)+1)*((float)(width/2)))
-#define SCREEN_Y(p) (((p)+1)*((float)(height/2)))
+#ifdef RASTER_SIMD
+#include <emmintrin.h>
+#endif
 
-typedef struct tri {
+#define SCREEN_X(p) (((p)+1)*(width*0.5f))
+#define SCREEN_Y(p) (((p)+1)*(height*0.5f))
+
+// Bands are roughly this many lines high, chunks this many triangles long.
+#define BAND_LINES 32
+#define CHUNK_TRIS 4096
+
+// Guard band: triangles that stay within this many pixels of the screen
+// are drawn as they are, their bounding boxes clamped to it. Ones reaching
+// further out are clipped to the band, which keeps the fixed point edge
+// functions well inside 32 bits.
+#define GUARD_BAND 8192
+
+// Instances go through the vertex stage in batches of about this many
+// vertices, then are rasterized as one. Small enough for the batch's
+// output to still be in cache when it is set up.
+#define INSTANCE_VERTICES 8192
+
+// A vertex being clipped: clip space position, colour and texture
+// coordinates.
+typedef struct clipVertex {
+	float x;
+	float y;
+	float z;
+	float w;
+	float c[3];
+	float u;
+	float v;
+} clipVertex;
+
+// Triangles to draw: instances copies of a mesh's triangles, the vertices
+// of copy i at out from i * stride on. Textured draws have the mesh's
+// texture coordinates in u and v, by mesh vertex.
+typedef struct drawCall {
+	const uint32_t* indices;
+	int triangleCount;
+	int instances;
+	int stride;
+	const vertexOutput* out;
+	const scalar* u;
+	const scalar* v;
+	pipelineState state;
+} drawCall;
+
+// Clipping against the near plane and the four guard band planes adds at
+// most one vertex per plane, and a polygon fans out into two triangles
+// less than it has vertices.
+#define CLIP_VERTICES 8
+#define CLIP_TRIS (CLIP_VERTICES - 2)
+
+// Sets up one interpolation plane, value at (ox, oy) plus per pixel
+// gradients. Vertex k is weighted by the edge opposite of it.
+static void setupPlane(float* p, const float* v, const int64_t* e, const int64_t* a, const int64_t* b, double area) {
+	p[0] = (v[0] * e[1] + v[1] * e[2] + v[2] * e[0]) / area;
+	p[1] = (v[0] * a[1] + v[1] * a[2] + v[2] * a[0]) * SUBPIXEL / area;
+	p[2] = (v[0] * b[1] + v[1] * b[2] + v[2] * b[0]) * SUBPIXEL / area;
+}
+
+// Culls and bounds a projected triangle, inside the guard band. Returns
+// false if there is nothing to draw. Colours are flat if given. Textured
+// triangles come with 1/w, u/w and v/w of their vertices in tex.
+// Multisampled, the bounds take in every pixel with a sample inside.
+static bool setupProjected(tri* t, const float* px, const float* py, const float* pz, float c[3][3], const float* flat, float tex[3][3], int width, int height, bool multisampled, frameStats* counts) {
+	int i;
 	float sx[3];
 	float sy[3];
-	float nx[3];
-	float ny[3];
-	float b[3];
-	int xmin;
-	int xmax;
-	int ymin;
-	int ymax;
-} tri;
+	int64_t fx[3];
+	int64_t fy[3];
+	int64_t a[3];
+	int64_t b[3];
+	int64_t e[3];
+
+	// Backface cull
+	if(
+		(px[1] - px[0]) * (py[2] - py[0]) -
+		(px[2] - px[0]) * (py[1] - py[0])
+		< 0
+	) {
+		STATS_ADD( counts, STAT_BACKFACE, 1 );
+		return false;
+	}
+
+	// Snap to 28.4 fixed point.
+	for( i = 0; i < 3; i++ ) {
+		sx[i] = SCREEN_X( px[i] );
+		sy[i] = SCREEN_Y( py[i] );
+		fx[i] = lrintf( sx[i] * SUBPIXEL );
+		fy[i] = lrintf( sy[i] * SUBPIXEL );
+	}
+
+	int64_t area = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fx[2] - fx[0]) * (fy[1] - fy[0]);
+	if( area <= 0 ) {
+		STATS_ADD( counts, STAT_BACKFACE, 1 );
+		return false;
+	}
+
+	// Edge i runs from vertex i to i+1 and is
+	//   e = a * ( x - fx ) + b * ( y - fy ),
+	// non-negative inside, sampled at pixel centres. Pixels exactly on an
+	// edge belong to it only if it is a top or left edge, so shared edges
+	// are drawn exactly once.
+	for( i = 0; i < 3; i++ ) {
+		a[i] = -(fy[(i+1)%3] - fy[i]);
+		b[i] =  (fx[(i+1)%3] - fx[i]);
+		bool topLeft = a[i] > 0 || (a[i] == 0 && b[i] < 0);
+
+		t->stepX[i] = (int32_t)(a[i] * SUBPIXEL);
+		t->stepY[i] = (int32_t)(b[i] * SUBPIXEL);
+		t->e[i] = a[i] * (SUBPIXEL / 2 - fx[i]) + b[i] * (SUBPIXEL / 2 - fy[i]) - (topLeft ? 0 : 1);
+	}
+
+	// Bounding rectangle of the pixels that might be inside. Samples are
+	// less than half a pixel off the centre.
+	int64_t reach = multisampled ? SUBPIXEL / 2 : 0;
+	int64_t minX = fx[0] < fx[1] ? (fx[0] < fx[2] ? fx[0] : fx[2]) : (fx[1] < fx[2] ? fx[1] : fx[2]);
+	int64_t minY = fy[0] < fy[1] ? (fy[0] < fy[2] ? fy[0] : fy[2]) : (fy[1] < fy[2] ? fy[1] : fy[2]);
+	int64_t maxX = fx[0] > fx[1] ? (fx[0] > fx[2] ? fx[0] : fx[2]) : (fx[1] > fx[2] ? fx[1] : fx[2]);
+	int64_t maxY = fy[0] > fy[1] ? (fy[0] > fy[2] ? fy[0] : fy[2]) : (fy[1] > fy[2] ? fy[1] : fy[2]);
+	t->xmin = (int)((minX - SUBPIXEL / 2 - reach + SUBPIXEL - 1) >> SUBPIXEL_BITS);
+	t->ymin = (int)((minY - SUBPIXEL / 2 - reach + SUBPIXEL - 1) >> SUBPIXEL_BITS);
+	t->xmax = (int)((maxX - SUBPIXEL / 2 + reach) >> SUBPIXEL_BITS) + 1;
+	t->ymax = (int)((maxY - SUBPIXEL / 2 + reach) >> SUBPIXEL_BITS) + 1;
+
+	// Clip and possibly reject.
+	t->xmin = t->xmin > 0 ? t->xmin : 0;
+	t->ymin = t->ymin > 0 ? t->ymin : 0;
+	t->xmax = t->xmax < width ? t->xmax : width;
+	t->ymax = t->ymax < height ? t->ymax : height;
+	if( t->xmin >= t->xmax || t->ymin >= t->ymax ) {
+		STATS_ADD( counts, STAT_BOUNDS, 1 );
+		return false;
+	}
+
+	// Interpolation planes for depth and colour, anchored at the pixel
+	// of the first vertex so values stay small.
+	t->ox = (int)(fx[0] >> SUBPIXEL_BITS);
+	t->oy = (int)(fy[0] >> SUBPIXEL_BITS);
+	for( i = 0; i < 3; i++ ) {
+		e[i] = a[i] * (t->ox * SUBPIXEL + SUBPIXEL / 2 - fx[i]) + b[i] * (t->oy * SUBPIXEL + SUBPIXEL / 2 - fy[i]);
+	}
+
+	float iz[3];
+	for( i = 0; i < 3; i++ ) {
+		iz[i] = 1.0f / pz[i];
+	}
+	setupPlane( t->z, iz, e, a, b, (double)area );
+	if( tex ) {
+		setupPlane( t->q, tex[0], e, a, b, (double)area );
+		setupPlane( t->u, tex[1], e, a, b, (double)area );
+		setupPlane( t->v, tex[2], e, a, b, (double)area );
+	}
+	if( flat ) {
+		float* planes[3] = { t->r, t->g, t->b };
+		for( i = 0; i < 3; i++ ) {
+			planes[i][0] = flat[i];
+			planes[i][1] = 0.0f;
+			planes[i][2] = 0.0f;
+		}
+		return true;
+	}
+	setupPlane( t->r, c[0], e, a, b, (double)area );
+	setupPlane( t->g, c[1], e, a, b, (double)area );
+	setupPlane( t->b, c[2], e, a, b, (double)area );
+
+	return true;
+}
+
+static clipVertex clipVertexOf(const postVertex* v, float u, float tv) {
+	clipVertex cv;
+
+	// Undo the divide, if there was one.
+	float scale = fabsf( v->w ) > PERSPECTIVE_EPSILON ? v->w : 1.0f;
+	cv.x = v->x * scale;
+	cv.y = v->y * scale;
+	cv.z = v->z * scale;
+	cv.w = v->w;
+	cv.c[0] = v->r;
+	cv.c[1] = v->g;
+	cv.c[2] = v->b;
+	cv.u = u;
+	cv.v = tv;
+	return cv;
+}
+
+// Distance inside a plane a * x + b * y + c * w + d >= 0.
+static float planeDistance(const float* plane, const clipVertex* v) {
+	return plane[0] * v->x + plane[1] * v->y + plane[2] * v->w + plane[3];
+}
+
+// Sutherland-Hodgman: the part of a convex polygon inside one plane.
+static int clipPolygon(const clipVertex* in, int n, clipVertex* out, const float* plane) {
+	int k = 0;
+	for( int i = 0; i < n; i++ ) {
+		const clipVertex* a = &in[i];
+		const clipVertex* b = &in[(i + 1) % n];
+		float da = planeDistance( plane, a );
+		float db = planeDistance( plane, b );
+		if( da >= 0.0f ) {
+			out[k++] = *a;
+		}
+		if( (da >= 0.0f) != (db >= 0.0f) ) {
+			float s = da / (da - db);
+			clipVertex* r = &out[k++];
+			r->x = a->x + (b->x - a->x) * s;
+			r->y = a->y + (b->y - a->y) * s;
+			r->z = a->z + (b->z - a->z) * s;
+			r->w = a->w + (b->w - a->w) * s;
+			for( int c = 0; c < 3; c++ ) {
+				r->c[c] = a->c[c] + (b->c[c] - a->c[c]) * s;
+			}
+			r->u = a->u + (b->u - a->u) * s;
+			r->v = a->v + (b->v - a->v) * s;
+		}
+	}
+	return k;
+}
+
+// Sets up triangle index, into up to CLIP_TRIS pieces at out: just the one
+// unless part of it is behind the near plane or outside the guard band, in
+// which case it is clipped to both. Returns the number of pieces.
+static int setupTriangle(tri* out, const drawCall* d, int index, int width, int height, bool multisampled, frameStats* counts) {
+	const vertexOutput* o = d->out;
+	int instance = index / d->triangleCount;
+	const uint32_t* mi = &d->indices[(index - instance * d->triangleCount) * 3];
+	const postVertex* v[3];
+	for( int i = 0; i < 3; i++ ) {
+		v[i] = &o->vertices[mi[i] + (uint32_t)(instance * d->stride)];
+	}
+
+	// Wholly outside one of the frustum planes.
+	if( v[0]->clip & v[1]->clip & v[2]->clip ) {
+		STATS_ADD( counts, STAT_BOUNDS, 1 );
+		return 0;
+	}
+
+	float gx = 1.0f + 2.0f * GUARD_BAND / width;
+	float gy = 1.0f + 2.0f * GUARD_BAND / height;
+	float px[3];
+	float py[3];
+	float pz[3];
+	float c[3][3];
+	float tex[3][3];
+	float (*textured)[3] = d->u ? tex : NULL;
+
+	// Flat shading takes the first vertex's colour, clipped or not.
+	float first[3] = { v[0]->r, v[0]->g, v[0]->b };
+	const float* flat = d->state.shade == SHADE_FLAT ? first : NULL;
+
+	bool inside = !((v[0]->clip | v[1]->clip | v[2]->clip) & CLIP_NEAR);
+	for( int i = 0; i < 3; i++ ) {
+		px[i] = v[i]->x;
+		py[i] = v[i]->y;
+		pz[i] = v[i]->z;
+		inside = inside && fabsf( px[i] ) <= gx && fabsf( py[i] ) <= gy;
+	}
+	if( inside ) {
+		for( int i = 0; i < 3; i++ ) {
+			c[0][i] = v[i]->r;
+			c[1][i] = v[i]->g;
+			c[2][i] = v[i]->b;
+			if( textured ) {
+				tex[0][i] = 1.0f / v[i]->w;
+				tex[1][i] = d->u[mi[i]] * tex[0][i];
+				tex[2][i] = d->v[mi[i]] * tex[0][i];
+			}
+		}
+		return setupProjected( out, px, py, pz, c, flat, textured, width, height, multisampled, counts ) ? 1 : 0;
+	}
+
+	// Near plane first, so w is positive for the guard band planes.
+	const float planes[5][4] = {
+		{ 0, 0, 1, -o->clipNear },
+		{ -1, 0, gx, 0 },
+		{ 1, 0, gx, 0 },
+		{ 0, -1, gy, 0 },
+		{ 0, 1, gy, 0 }
+	};
+	clipVertex poly[2][CLIP_VERTICES];
+	int n = 3;
+	int cur = 0;
+	for( int i = 0; i < 3; i++ ) {
+		poly[0][i] = clipVertexOf( v[i], textured ? d->u[mi[i]] : 0.0f, textured ? d->v[mi[i]] : 0.0f );
+	}
+	for( int p = 0; p < 5 && n >= 3; p++ ) {
+		n = clipPolygon( poly[cur], n, poly[1 - cur], planes[p] );
+		cur = 1 - cur;
+	}
+	STATS_ADD( counts, STAT_CLIPPED, 1 );
+	if( n < 3 ) {
+		STATS_ADD( counts, STAT_BOUNDS, 1 );
+		return 0;
+	}
+
+	// Project and fan out the polygon.
+	const clipVertex* pv = poly[cur];
+	int pieces = 0;
+	for( int i = 1; i + 1 < n; i++ ) {
+		const clipVertex* tv[3] = { &pv[0], &pv[i], &pv[i + 1] };
+		for( int k = 0; k < 3; k++ ) {
+			px[k] = tv[k]->x / tv[k]->w;
+			py[k] = tv[k]->y / tv[k]->w;
+			pz[k] = tv[k]->z / tv[k]->w;
+			for( int j = 0; j < 3; j++ ) {
+				c[j][k] = tv[k]->c[j];
+			}
+			tex[0][k] = 1.0f / tv[k]->w;
+			tex[1][k] = tv[k]->u * tex[0][k];
+			tex[2][k] = tv[k]->v * tex[0][k];
+		}
+		if( setupProjected( &out[pieces], px, py, pz, c, flat, textured, width, height, multisampled, counts ) ) {
+			pieces++;
+		}
+	}
+	return pieces;
+}
+
+// Clips a triangle's rows to the lines of pbuf.
+static bool triangleLines(const tri* t, const buffer* pbuf, int* ymin, int* ymax) {
+	*ymin = t->ymin > pbuf->firstLine ? t->ymin : pbuf->firstLine;
+	*ymax = t->ymax < pbuf->size ? t->ymax : pbuf->size;
+	return *ymin < *ymax;
+}
+
+// Edge values at the corner of one block, for the edges that actually cross
+// it. Edges that contain the whole block get zero values and steps.
+// Multisampled, it also has how far the samples are off the pixel
+// centres in the triangle's edge values and depth, and per edge the least
+// and most of that, which are the same for every block.
+typedef struct blockEdges {
+	int32_t e[3];
+	int32_t stepX[3];
+	int32_t stepY[3];
+	bool full;
+	int32_t sampleE[MAX_SAMPLES][3];
+	float sampleZ[MAX_SAMPLES];
+	int32_t low[3];
+	int32_t high[3];
+} blockEdges;
+
+// Classifies a block against the triangle's edges. Returns false if no
+// pixel of it can be inside. Multisampled, that goes for every sample,
+// up to half a pixel off the centres.
+static bool classifyBlock(const tri* t, int bx, int by, bool multisampled, blockEdges* be) {
+	be->full = true;
+	for( int i = 0; i < 3; i++ ) {
+		int64_t e = t->e[i] + (int64_t)t->stepX[i] * bx + (int64_t)t->stepY[i] * by;
+		int64_t dx = (int64_t)t->stepX[i] * (BLOCK_SIZE - 1);
+		int64_t dy = (int64_t)t->stepY[i] * (BLOCK_SIZE - 1);
+		int64_t reach = multisampled ? (llabs( t->stepX[i] ) + llabs( t->stepY[i] )) / 2 : 0;
+		int64_t emax = e + (dx > 0 ? dx : 0) + (dy > 0 ? dy : 0) + reach;
+		int64_t emin = e + (dx < 0 ? dx : 0) + (dy < 0 ? dy : 0) - reach;
+		if( emax < 0 ) {
+			return false;
+		}
+		if( emin >= 0 ) {
+			be->e[i] = 0;
+			be->stepX[i] = 0;
+			be->stepY[i] = 0;
+		}
+		else {
+			be->e[i] = (int32_t)e;
+			be->stepX[i] = t->stepX[i];
+			be->stepY[i] = t->stepY[i];
+			be->full = false;
+		}
+	}
+	return true;
+}
+
+// Sets up the sample offsets of a triangle's blocks. Steps are per pixel,
+// sample positions in sixteenths: the products divide exactly.
+static void sampleOffsets(const tri* t, const renderTarget* rt, blockEdges* be) {
+	for( int i = 0; i < 3; i++ ) {
+		be->low[i] = INT32_MAX;
+		be->high[i] = INT32_MIN;
+	}
+	for( int s = 0; s < rt->samples; s++ ) {
+		for( int i = 0; i < 3; i++ ) {
+			int32_t offset = (t->stepX[i] * rt->sampleX[s] + t->stepY[i] * rt->sampleY[s]) / SUBPIXEL;
+			be->sampleE[s][i] = offset;
+			be->low[i] = offset < be->low[i] ? offset : be->low[i];
+			be->high[i] = offset > be->high[i] ? offset : be->high[i];
+		}
+		be->sampleZ[s] = (t->z[1] * rt->sampleX[s] + t->z[2] * rt->sampleY[s]) * (1.0f / SUBPIXEL);
+	}
+}
+
+#ifdef RASTER_SIMD
+
+// Float to half conversion of four lanes, same as floatToHalf.
+static inline __m128i halfLanes(__m128 v) {
+	__m128i bits = _mm_castps_si128( v );
+	__m128i sign = _mm_and_si128( _mm_srli_epi32( bits, 16 ), _mm_set1_epi32( 0x8000 ) );
+	bits = _mm_and_si128( bits, _mm_set1_epi32( 0x7fffffff ) );
+	__m128i tiny = _mm_cmplt_epi32( bits, _mm_set1_epi32( 0x38800000 ) );
+	__m128i big = _mm_cmpgt_epi32( bits, _mm_set1_epi32( 0x477fe000 ) );
+	bits = _mm_or_si128( _mm_andnot_si128( big, bits ), _mm_and_si128( big, _mm_set1_epi32( 0x477fe000 ) ) );
+	bits = _mm_add_epi32( bits, _mm_add_epi32( _mm_set1_epi32( 0xfff ), _mm_and_si128( _mm_srli_epi32( bits, 13 ), _mm_set1_epi32( 1 ) ) ) );
+	__m128i h = _mm_sub_epi32( _mm_srli_epi32( bits, 13 ), _mm_set1_epi32( (127 - 15) << 10 ) );
+	return _mm_or_si128( _mm_andnot_si128( tiny, h ), sign );
+}
+
+// Clamps to [0, 1] and scales to [0, max], rounded like unitToInt.
+static inline __m128i unitLanes(__m128 v, float max) {
+	v = _mm_min_ps( _mm_max_ps( v, _mm_setzero_ps() ), _mm_set1_ps( 1.0f ) );
+	return _mm_cvtps_epi32( _mm_mul_ps( v, _mm_set1_ps( max ) ) );
+}
+
+// Writes the passing ones of four pixels, converted to the format.
+static inline void storePixels(void* data, int i, pixelFormat format, __m128 r, __m128 g, __m128 b, int passBits) {
+	switch( format ) {
+		case PIXEL_RGBA8: {
+			__m128i v = _mm_or_si128(
+				_mm_or_si128( unitLanes( r, 255.0f ), _mm_slli_epi32( unitLanes( g, 255.0f ), 8 ) ),
+				_mm_or_si128( _mm_slli_epi32( unitLanes( b, 255.0f ), 16 ), _mm_set1_epi32( 0xff000000 ) )
+			);
+			uint32_t* dst = (uint32_t*)data + i;
+			if( passBits == 15 ) {
+				_mm_storeu_si128( (__m128i*)dst, v );
+			}
+			else {
+				uint32_t tmp[4];
+				_mm_storeu_si128( (__m128i*)tmp, v );
+				for( int k = 0; k < 4; k++ ) {
+					if( (passBits >> k) & 1 ) {
+						dst[k] = tmp[k];
+					}
+				}
+			}
+		}
+		break;
+
+		case PIXEL_RGB565: {
+			__m128i v = _mm_or_si128(
+				_mm_or_si128( _mm_slli_epi32( unitLanes( r, 31.0f ), 11 ), _mm_slli_epi32( unitLanes( g, 63.0f ), 5 ) ),
+				unitLanes( b, 31.0f )
+			);
+			uint32_t tmp[4];
+			uint16_t* dst = (uint16_t*)data + i;
+			_mm_storeu_si128( (__m128i*)tmp, v );
+			for( int k = 0; k < 4; k++ ) {
+				if( (passBits >> k) & 1 ) {
+					dst[k] = (uint16_t)tmp[k];
+				}
+			}
+		}
+		break;
+
+		case PIXEL_HALF: {
+			// Pixels are r, g, b, a halves: pair up r with g and b with a.
+			__m128i rg = _mm_or_si128( halfLanes( r ), _mm_slli_epi32( halfLanes( g ), 16 ) );
+			__m128i ba = _mm_or_si128( halfLanes( b ), _mm_set1_epi32( 0x3c000000 ) );
+			__m128i p01 = _mm_unpacklo_epi32( rg, ba );
+			__m128i p23 = _mm_unpackhi_epi32( rg, ba );
+			uint64_t* dst = (uint64_t*)data + i;
+			if( passBits == 15 ) {
+				_mm_storeu_si128( (__m128i*)dst, p01 );
+				_mm_storeu_si128( (__m128i*)(dst + 2), p23 );
+			}
+			else {
+				if( passBits & 1 ) _mm_storel_epi64( (__m128i*)dst, p01 );
+				if( passBits & 2 ) _mm_storel_epi64( (__m128i*)(dst + 1), _mm_unpackhi_epi64( p01, p01 ) );
+				if( passBits & 4 ) _mm_storel_epi64( (__m128i*)(dst + 2), p23 );
+				if( passBits & 8 ) _mm_storel_epi64( (__m128i*)(dst + 3), _mm_unpackhi_epi64( p23, p23 ) );
+			}
+		}
+		break;
+
+		default: {
+			// Transposed into the colour struct's r, b, g, a layout.
+			__m128 a = _mm_set1_ps( 1.0f );
+			_MM_TRANSPOSE4_PS( r, b, g, a );
+			colour* dst = (colour*)data + i;
+			if( passBits & 1 ) _mm_storeu_ps( (float*)&dst[0], r );
+			if( passBits & 2 ) _mm_storeu_ps( (float*)&dst[1], b );
+			if( passBits & 4 ) _mm_storeu_ps( (float*)&dst[2], g );
+			if( passBits & 8 ) _mm_storeu_ps( (float*)&dst[3], a );
+		}
+		break;
+	}
+}
+
+// Adds what the passing ones of four pixels already hold to r, g and b.
+static inline void addPixels(const void* data, int i, pixelFormat format, __m128* r, __m128* g, __m128* b, int passBits) {
+	switch( format ) {
+		case PIXEL_RGBA8: {
+			const uint32_t* src = (const uint32_t*)data + i;
+			__m128i v;
+			if( passBits == 15 ) {
+				v = _mm_loadu_si128( (const __m128i*)src );
+			}
+			else {
+				uint32_t tmp[4];
+				for( int k = 0; k < 4; k++ ) {
+					tmp[k] = (passBits >> k) & 1 ? src[k] : 0;
+				}
+				v = _mm_loadu_si128( (const __m128i*)tmp );
+			}
+			__m128i byte = _mm_set1_epi32( 0xff );
+			__m128 unit = _mm_set1_ps( 1.0f / 255.0f );
+			*r = _mm_add_ps( *r, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( v, byte ) ), unit ) );
+			*g = _mm_add_ps( *g, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( v, 8 ), byte ) ), unit ) );
+			*b = _mm_add_ps( *b, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( v, 16 ), byte ) ), unit ) );
+		}
+		break;
+
+		case PIXEL_FLOAT: {
+			// Back out of the colour struct's r, b, g, a layout.
+			const colour* src = (const colour*)data + i;
+			__m128 p[4];
+			for( int k = 0; k < 4; k++ ) {
+				p[k] = (passBits >> k) & 1 ? _mm_loadu_ps( (const float*)&src[k] ) : _mm_setzero_ps();
+			}
+			_MM_TRANSPOSE4_PS( p[0], p[1], p[2], p[3] );
+			*r = _mm_add_ps( *r, p[0] );
+			*g = _mm_add_ps( *g, p[2] );
+			*b = _mm_add_ps( *b, p[1] );
+		}
+		break;
+
+		default: {
+			float dr[4] = { 0 };
+			float dg[4] = { 0 };
+			float db[4] = { 0 };
+			size_t stride = pixelSize( format );
+			for( int k = 0; k < 4; k++ ) {
+				if( (passBits >> k) & 1 ) {
+					colour c = unpackPixel( (const uint8_t*)data + (size_t)(i + k) * stride, format );
+					dr[k] = c.r;
+					dg[k] = c.g;
+					db[k] = c.b;
+				}
+			}
+			*r = _mm_add_ps( *r, _mm_loadu_ps( dr ) );
+			*g = _mm_add_ps( *g, _mm_loadu_ps( dg ) );
+			*b = _mm_add_ps( *b, _mm_loadu_ps( db ) );
+		}
+		break;
+	}
+}
+
+// texturePixel() for four pixels of a row, with the same operations in
+// the same order, given the row's values of the 1/w, u/w and v/w planes.
+static inline void textureLanes(const tri* t, const texture* tex, __m128 qr, __m128 ur, __m128 vr, __m128 fx, float* u, float* v, float* lod) {
+	__m128 dqx = _mm_set1_ps( t->q[1] );
+	__m128 dqy = _mm_set1_ps( t->q[2] );
+	__m128 q = _mm_add_ps( qr, _mm_mul_ps( dqx, fx ) );
+	__m128 su = _mm_add_ps( ur, _mm_mul_ps( _mm_set1_ps( t->u[1] ), fx ) );
+	__m128 sv = _mm_add_ps( vr, _mm_mul_ps( _mm_set1_ps( t->v[1] ), fx ) );
+	__m128 w = _mm_div_ps( _mm_set1_ps( 1.0f ), q );
+	__m128 pu = _mm_mul_ps( su, w );
+	__m128 pv = _mm_mul_ps( sv, w );
+	__m128 dudx = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( t->u[1] ), _mm_mul_ps( pu, dqx ) ), w );
+	__m128 dvdx = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( t->v[1] ), _mm_mul_ps( pv, dqx ) ), w );
+	__m128 dudy = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( t->u[2] ), _mm_mul_ps( pu, dqy ) ), w );
+	__m128 dvdy = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( t->v[2] ), _mm_mul_ps( pv, dqy ) ), w );
+
+	__m128 tw = _mm_set1_ps( (float)tex->width );
+	__m128 th = _mm_set1_ps( (float)tex->height );
+	__m128 ax = _mm_mul_ps( dudx, tw );
+	__m128 ay = _mm_mul_ps( dvdx, th );
+	__m128 bx = _mm_mul_ps( dudy, tw );
+	__m128 by = _mm_mul_ps( dvdy, th );
+	__m128 rx = _mm_add_ps( _mm_mul_ps( ax, ax ), _mm_mul_ps( ay, ay ) );
+	__m128 ry = _mm_add_ps( _mm_mul_ps( bx, bx ), _mm_mul_ps( by, by ) );
+	__m128 bits = _mm_cvtepi32_ps( _mm_castps_si128( _mm_max_ps( rx, ry ) ) );
+	__m128 log = _mm_sub_ps( _mm_mul_ps( bits, _mm_set1_ps( 1.0f / 8388608.0f ) ), _mm_set1_ps( 127.0f ) );
+	_mm_storeu_ps( u, pu );
+	_mm_storeu_ps( v, pv );
+	_mm_storeu_ps( lod, _mm_mul_ps( _mm_set1_ps( 0.5f ), log ) );
+}
+
+// Colours of four pixels of a row at fx, from the row's values of the
+// colour planes and, textured, of the 1/w, u/w and v/w planes. Only the
+// lanes in passBits are sampled.
+static inline __attribute__((always_inline)) void shadeLanes(const tri* t, shadeMode shade, bool textured, const texture* tex, textureFilter filter, __m128 rr, __m128 gr, __m128 br, __m128 qr, __m128 ur, __m128 vr, __m128 fx, int passBits, __m128* r, __m128* g, __m128* b) {
+	*r = _mm_set1_ps( t->r[0] );
+	*g = _mm_set1_ps( t->g[0] );
+	*b = _mm_set1_ps( t->b[0] );
+	if( shade == SHADE_GOURAUD ) {
+		*r = _mm_add_ps( rr, _mm_mul_ps( _mm_set1_ps( t->r[1] ), fx ) );
+		*g = _mm_add_ps( gr, _mm_mul_ps( _mm_set1_ps( t->g[1] ), fx ) );
+		*b = _mm_add_ps( br, _mm_mul_ps( _mm_set1_ps( t->b[1] ), fx ) );
+	}
+	if( textured ) {
+		float u[4];
+		float v[4];
+		float lod[4];
+		float tr[4];
+		float tg[4];
+		float tb[4];
+		textureLanes( t, tex, qr, ur, vr, fx, u, v, lod );
+		sampleTexture4( tex, filter, u, v, lod, passBits, tr, tg, tb );
+		*r = _mm_mul_ps( *r, _mm_loadu_ps( tr ) );
+		*g = _mm_mul_ps( *g, _mm_loadu_ps( tg ) );
+		*b = _mm_mul_ps( *b, _mm_loadu_ps( tb ) );
+	}
+}
+
+// One block, drawn as rows of two four pixel lanes. Edge tests are integer
+// adds, depth and colours come from the planes at absolute coordinates.
+// Everything after the coverage test depends on the pipeline state, which
+// is a constant in each copy. Returns the smallest depth left in the
+// pixels it looked at, which is the new block bound if it looked at all
+// of them; without a depth test, the smallest depth it wrote.
+static inline __attribute__((always_inline)) float drawBlockAs(const tri* t, buffer* pbuf, float* zbuf, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, pixelFormat format, shadeMode shade, depthMode depth, colourMode colours, bool textured, const texture* tex, textureFilter filter, uint32_t* ids, uint32_t id, frameStats* counts, uint16_t* overdraw) {
+	int width = pbuf->width;
+	bool test = depth == DEPTH_TEST_WRITE || depth == DEPTH_TEST;
+	bool write = depth == DEPTH_TEST_WRITE || depth == DEPTH_WRITE;
+
+	__m128i lane = _mm_set_epi32( 3, 2, 1, 0 );
+	__m128i first = _mm_set1_epi32( x0 - 1 );
+	__m128i last = _mm_set1_epi32( x1 );
+	__m128i laneE[3];
+	for( int i = 0; i < 3; i++ ) {
+		int32_t s = be->stepX[i];
+		laneE[i] = _mm_set_epi32( 3 * s, 2 * s, s, 0 );
+	}
+
+	__m128 dz = _mm_set1_ps( t->z[1] );
+	__m128 zfar = _mm_set1_ps( FLT_MAX );
+	__m128 zmin = zfar;
+
+	for( int y = y0; y < y1; y++ ) {
+		int32_t ey[3];
+		for( int i = 0; i < 3; i++ ) {
+			ey[i] = be->e[i] + be->stepY[i] * (y - by);
+		}
+		float fy = (float)(y - t->oy);
+		__m128 zr = _mm_set1_ps( t->z[0] + t->z[2] * fy );
+		__m128 rr = _mm_set1_ps( t->r[0] + t->r[2] * fy );
+		__m128 gr = _mm_set1_ps( t->g[0] + t->g[2] * fy );
+		__m128 br = _mm_set1_ps( t->b[0] + t->b[2] * fy );
+		__m128 qr = _mm_setzero_ps();
+		__m128 ur = _mm_setzero_ps();
+		__m128 vr = _mm_setzero_ps();
+		if( textured ) {
+			qr = _mm_set1_ps( t->q[0] + t->q[2] * fy );
+			ur = _mm_set1_ps( t->u[0] + t->u[2] * fy );
+			vr = _mm_set1_ps( t->v[0] + t->v[2] * fy );
+		}
+
+		for( int h = 0; h < BLOCK_SIZE; h += 4 ) {
+			int x = bx + h;
+			if( x >= x1 || x + 4 <= x0 ) {
+				continue;
+			}
+
+			__m128i px = _mm_add_epi32( _mm_set1_epi32( x ), lane );
+			__m128i inside = _mm_and_si128( _mm_cmpgt_epi32( px, first ), _mm_cmplt_epi32( px, last ) );
+			int lanes = _mm_movemask_ps( _mm_castsi128_ps( inside ) );
+			if( !be->full ) {
+				__m128i e0 = _mm_add_epi32( _mm_set1_epi32( ey[0] + be->stepX[0] * h ), laneE[0] );
+				__m128i e1 = _mm_add_epi32( _mm_set1_epi32( ey[1] + be->stepX[1] * h ), laneE[1] );
+				__m128i e2 = _mm_add_epi32( _mm_set1_epi32( ey[2] + be->stepX[2] * h ), laneE[2] );
+				__m128i sign = _mm_srai_epi32( _mm_or_si128( _mm_or_si128( e0, e1 ), e2 ), 31 );
+				inside = _mm_andnot_si128( sign, inside );
+			}
+			__m128 mask = _mm_castsi128_ps( inside );
+			int covered = _mm_movemask_ps( mask );
+			if( !covered ) {
+				continue;
+			}
+
+			__m128 fx = _mm_cvtepi32_ps( _mm_sub_epi32( px, _mm_set1_epi32( t->ox ) ) );
+			__m128 z = _mm_add_ps( zr, _mm_mul_ps( dz, fx ) );
+			float* zrow = &zbuf[y * width + x];
+			__m128 pass = mask;
+			__m128 znew = z;
+			if( test ) {
+				// Z test, masked. Lanes outside the rectangle go through a
+				// scratch copy so nothing outside it is touched.
+				float ztmp[4];
+				__m128 zold;
+				if( lanes == 15 ) {
+					zold = _mm_loadu_ps( zrow );
+				}
+				else {
+					for( int k = 0; k < 4; k++ ) {
+						ztmp[k] = (lanes >> k) & 1 ? zrow[k] : 0.0f;
+					}
+					zold = _mm_loadu_ps( ztmp );
+				}
+				pass = _mm_and_ps( mask, _mm_cmpgt_ps( z, zold ) );
+				znew = _mm_or_ps( _mm_and_ps( pass, z ), _mm_andnot_ps( pass, zold ) );
+				zmin = _mm_min_ps( zmin, znew );
+			}
+			else if( write ) {
+				zmin = _mm_min_ps( zmin, _mm_or_ps( _mm_and_ps( pass, z ), _mm_andnot_ps( pass, zfar ) ) );
+			}
+			int passBits = _mm_movemask_ps( pass );
+#ifdef RASTER_STATS
+			STATS_ADD( counts, STAT_PIXELS_COVERED, __builtin_popcount( covered ) );
+			STATS_ADD( counts, STAT_DEPTH_PASSED, __builtin_popcount( passBits ) );
+			STATS_ADD( counts, STAT_DEPTH_FAILED, __builtin_popcount( covered & ~passBits ) );
+			for( int k = 0; k < 4; k++ ) {
+				if( (lanes >> k) & 1 ) {
+					overdraw[y * width + x + k] += (passBits >> k) & 1;
+				}
+			}
+#endif
+			if( !passBits ) {
+				continue;
+			}
+
+			// Tested lanes in the rectangle keep their old depth where they
+			// failed, untested ones are only written where covered.
+			int writeBits = test ? lanes : passBits;
+			if( write && writeBits == 15 ) {
+				_mm_storeu_ps( zrow, znew );
+			}
+			else if( write ) {
+				float ztmp[4];
+				_mm_storeu_ps( ztmp, znew );
+				for( int k = 0; k < 4; k++ ) {
+					if( (writeBits >> k) & 1 ) {
+						zrow[k] = ztmp[k];
+					}
+				}
+			}
+
+			if( colours == COLOUR_OFF ) {
+				continue;
+			}
+			if( ids ) {
+				uint32_t* dst = &ids[y * width + x];
+				if( passBits == 15 ) {
+					_mm_storeu_si128( (__m128i*)dst, _mm_set1_epi32( (int)id ) );
+				}
+				else {
+					for( int k = 0; k < 4; k++ ) {
+						if( (passBits >> k) & 1 ) {
+							dst[k] = id;
+						}
+					}
+				}
+				continue;
+			}
+			STATS_ADD( counts, STAT_PIXELS_SHADED, __builtin_popcount( passBits ) );
+			__m128 r;
+			__m128 g;
+			__m128 b;
+			shadeLanes( t, shade, textured, tex, filter, rr, gr, br, qr, ur, vr, fx, passBits, &r, &g, &b );
+			if( colours == COLOUR_ADD ) {
+				addPixels( pbuf->data, y * width + x, format, &r, &g, &b, passBits );
+			}
+			storePixels( pbuf->data, y * width + x, format, r, g, b, passBits );
+		}
+	}
+
+	zmin = _mm_min_ps( zmin, _mm_shuffle_ps( zmin, zmin, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	zmin = _mm_min_ps( zmin, _mm_shuffle_ps( zmin, zmin, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	return _mm_cvtss_f32( zmin );
+}
+
+// One block, multisampled: edges and depth are tested per sample, at the
+// target's sample positions, and colours worked out once per pixel, at
+// its centre, for the pixels with any sample passing. Pixels that are
+// one colour and have all samples passing are written as they would be
+// without multisampling, the rest through writeSamples; in visibility
+// mode, passing samples get the id. Returns what drawBlockAs does, over
+// all samples.
+static inline __attribute__((always_inline)) float drawSamplesAs(const tri* t, renderTarget* rt, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, pixelFormat format, shadeMode shade, depthMode depth, colourMode colours, bool textured, const texture* tex, textureFilter filter, bool visibility, uint32_t id, frameStats* counts) {
+	int width = rt->colour.width;
+	int samples = rt->samples;
+	int all = (1 << samples) - 1;
+	float* zbuf = rt->depth.data;
+	bool test = depth == DEPTH_TEST_WRITE || depth == DEPTH_TEST;
+	bool write = depth == DEPTH_TEST_WRITE || depth == DEPTH_WRITE;
+
+	// Edge and depth offsets of the samples from the pixel centres, zero
+	// for edges that contain the block. A pixel with its centre at least
+	// -low inside an edge has all samples inside it, one at least high
+	// outside has none.
+	__m128i sampleE[MAX_SAMPLES][3];
+	__m128 sampleZ[MAX_SAMPLES];
+	__m128i sampleBit[MAX_SAMPLES];
+	__m128i lowE[3];
+	__m128i highE[3];
+	for( int i = 0; i < 3 && !be->full; i++ ) {
+		int32_t crosses = be->stepX[i] | be->stepY[i] ? -1 : 0;
+		for( int s = 0; s < samples; s++ ) {
+			sampleE[s][i] = _mm_set1_epi32( be->sampleE[s][i] & crosses );
+		}
+		lowE[i] = _mm_set1_epi32( be->low[i] & crosses );
+		highE[i] = _mm_set1_epi32( be->high[i] & crosses );
+	}
+	for( int s = 0; s < samples; s++ ) {
+		sampleZ[s] = _mm_set1_ps( be->sampleZ[s] );
+		sampleBit[s] = _mm_set1_epi32( 1 << s );
+	}
+
+	__m128i lane = _mm_set_epi32( 3, 2, 1, 0 );
+	__m128i first = _mm_set1_epi32( x0 - 1 );
+	__m128i last = _mm_set1_epi32( x1 );
+	__m128i laneE[3];
+	for( int i = 0; i < 3; i++ ) {
+		int32_t s = be->stepX[i];
+		laneE[i] = _mm_set_epi32( 3 * s, 2 * s, s, 0 );
+	}
+
+	__m128 dz = _mm_set1_ps( t->z[1] );
+	__m128 zfar = _mm_set1_ps( FLT_MAX );
+	__m128 zmin = zfar;
+	const uint64_t* mixed = mixedWord( rt, bx, by );
+
+	for( int y = y0; y < y1; y++ ) {
+		int32_t ey[3];
+		for( int i = 0; i < 3; i++ ) {
+			ey[i] = be->e[i] + be->stepY[i] * (y - by);
+		}
+		float fy = (float)(y - t->oy);
+		__m128 zr = _mm_set1_ps( t->z[0] + t->z[2] * fy );
+		__m128 rr = _mm_set1_ps( t->r[0] + t->r[2] * fy );
+		__m128 gr = _mm_set1_ps( t->g[0] + t->g[2] * fy );
+		__m128 br = _mm_set1_ps( t->b[0] + t->b[2] * fy );
+		__m128 qr = _mm_setzero_ps();
+		__m128 ur = _mm_setzero_ps();
+		__m128 vr = _mm_setzero_ps();
+		if( textured ) {
+			qr = _mm_set1_ps( t->q[0] + t->q[2] * fy );
+			ur = _mm_set1_ps( t->u[0] + t->u[2] * fy );
+			vr = _mm_set1_ps( t->v[0] + t->v[2] * fy );
+		}
+
+		for( int h = 0; h < BLOCK_SIZE; h += 4 ) {
+			int x = bx + h;
+			if( x >= x1 || x + 4 <= x0 ) {
+				continue;
+			}
+
+			__m128i px = _mm_add_epi32( _mm_set1_epi32( x ), lane );
+			__m128i inside = _mm_and_si128( _mm_cmpgt_epi32( px, first ), _mm_cmplt_epi32( px, last ) );
+			__m128i e[3] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+			if( !be->full ) {
+				for( int i = 0; i < 3; i++ ) {
+					e[i] = _mm_add_epi32( _mm_set1_epi32( ey[i] + be->stepX[i] * h ), laneE[i] );
+				}
+			}
+
+			// Only lanes the edges go through need testing per sample.
+			__m128i cover = inside;
+			bool edges = false;
+			if( !be->full ) {
+				__m128i some = inside;
+				for( int i = 0; i < 3; i++ ) {
+					cover = _mm_andnot_si128( _mm_srai_epi32( _mm_add_epi32( e[i], lowE[i] ), 31 ), cover );
+					some = _mm_andnot_si128( _mm_srai_epi32( _mm_add_epi32( e[i], highE[i] ), 31 ), some );
+				}
+				int someBits = _mm_movemask_ps( _mm_castsi128_ps( some ) );
+				if( !someBits ) {
+					continue;
+				}
+				edges = _mm_movemask_ps( _mm_castsi128_ps( cover ) ) != someBits;
+			}
+			__m128 fx = _mm_cvtepi32_ps( _mm_sub_epi32( px, _mm_set1_epi32( t->ox ) ) );
+			__m128 z = _mm_add_ps( zr, _mm_mul_ps( dz, fx ) );
+
+			// Per lane, the mask of its samples that pass.
+			size_t group = sampleIndex( &rt->depth, x, y, 0 );
+			__m128i samplePass[MAX_SAMPLES];
+			__m128i masks = _mm_setzero_si128();
+			int covered = 0;
+			int passBits = 0;
+			// Lines are padded to whole blocks, so all four lanes of a
+			// sample's depths are there to load and store back, whatever
+			// the rectangle: lanes outside it never pass and keep theirs.
+			for( int s = 0; s < samples; s++ ) {
+				__m128i in = cover;
+				if( edges ) {
+					__m128i e0 = _mm_add_epi32( e[0], sampleE[s][0] );
+					__m128i e1 = _mm_add_epi32( e[1], sampleE[s][1] );
+					__m128i e2 = _mm_add_epi32( e[2], sampleE[s][2] );
+					in = _mm_andnot_si128( _mm_srai_epi32( _mm_or_si128( _mm_or_si128( e0, e1 ), e2 ), 31 ), inside );
+				}
+				covered |= _mm_movemask_ps( _mm_castsi128_ps( in ) );
+
+				__m128 zs = _mm_add_ps( z, sampleZ[s] );
+				float* zrow = &zbuf[group + s * BLOCK_SIZE];
+				__m128 zold = _mm_load_ps( zrow );
+				__m128 pass = _mm_castsi128_ps( in );
+				if( test ) {
+					pass = _mm_and_ps( pass, _mm_cmpgt_ps( zs, zold ) );
+				}
+				__m128 znew = _mm_or_ps( _mm_and_ps( pass, zs ), _mm_andnot_ps( pass, zold ) );
+				zmin = _mm_min_ps( zmin, test ? znew : _mm_or_ps( _mm_and_ps( pass, zs ), _mm_andnot_ps( pass, zfar ) ) );
+				samplePass[s] = _mm_castps_si128( pass );
+				passBits |= _mm_movemask_ps( pass );
+				masks = _mm_or_si128( masks, _mm_and_si128( _mm_castps_si128( pass ), sampleBit[s] ) );
+				if( write ) {
+					_mm_store_ps( zrow, znew );
+				}
+			}
+#ifdef RASTER_STATS
+			STATS_ADD( counts, STAT_PIXELS_COVERED, __builtin_popcount( covered ) );
+			STATS_ADD( counts, STAT_DEPTH_PASSED, __builtin_popcount( passBits ) );
+			STATS_ADD( counts, STAT_DEPTH_FAILED, __builtin_popcount( covered & ~passBits ) );
+			int lanes = _mm_movemask_ps( _mm_castsi128_ps( inside ) );
+			for( int k = 0; k < 4; k++ ) {
+				if( (lanes >> k) & 1 ) {
+					rt->overdraw[y * width + x + k] += (passBits >> k) & 1;
+				}
+			}
+#endif
+			if( !passBits || colours == COLOUR_OFF ) {
+				continue;
+			}
+			if( visibility ) {
+				__m128i ids = _mm_set1_epi32( (int)id );
+				for( int s = 0; s < samples; s++ ) {
+					__m128i* dst = (__m128i*)&rt->ids[group + s * BLOCK_SIZE];
+					*dst = _mm_or_si128( _mm_and_si128( samplePass[s], ids ), _mm_andnot_si128( samplePass[s], *dst ) );
+				}
+				continue;
+			}
+
+			STATS_ADD( counts, STAT_PIXELS_SHADED, __builtin_popcount( passBits ) );
+			__m128 r;
+			__m128 g;
+			__m128 b;
+			shadeLanes( t, shade, textured, tex, filter, rr, gr, br, qr, ur, vr, fx, passBits, &r, &g, &b );
+
+			// Lanes with every sample passing that are one colour so far.
+			int whole = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( masks, _mm_set1_epi32( all ) ) ) );
+			whole &= ~(int)(*mixed >> ((y - by) * DEPTH_BLOCK + h)) & 15;
+			int split = passBits & ~whole;
+			if( split && colours == COLOUR_ADD ) {
+				int32_t mask[4];
+				float cr[4];
+				float cg[4];
+				float cb[4];
+				_mm_storeu_si128( (__m128i*)mask, masks );
+				_mm_storeu_ps( cr, r );
+				_mm_storeu_ps( cg, g );
+				_mm_storeu_ps( cb, b );
+				for( int k = 0; k < 4; k++ ) {
+					if( (split >> k) & 1 ) {
+						addSamples( rt, x + k, y, format, makeColour( cr[k], cg[k], cb[k] ), mask[k] );
+					}
+				}
+			}
+			else if( split ) {
+				int32_t mask[4];
+				colour packed[4];
+				size_t stride = pixelSize( format );
+				_mm_storeu_si128( (__m128i*)mask, masks );
+				storePixels( packed, 0, format, r, g, b, 15 );
+				for( int bits = split; bits; bits &= bits - 1 ) {
+					int k = __builtin_ctz( bits );
+					writeSamples( rt, x + k, y, format, (const uint8_t*)packed + k * stride, mask[k] );
+				}
+			}
+			if( whole ) {
+				if( colours == COLOUR_ADD ) {
+					addPixels( rt->colour.data, y * width + x, format, &r, &g, &b, whole );
+				}
+				storePixels( rt->colour.data, y * width + x, format, r, g, b, whole );
+			}
+		}
+	}
+
+	zmin = _mm_min_ps( zmin, _mm_shuffle_ps( zmin, zmin, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	zmin = _mm_min_ps( zmin, _mm_shuffle_ps( zmin, zmin, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	return _mm_cvtss_f32( zmin );
+}
+
+#else
+
+// Colour of the pixel at fx, fy, from the row's values of the colour
+// planes.
+static inline __attribute__((always_inline)) colour shadePixel(const tri* t, shadeMode shade, bool textured, const texture* tex, textureFilter filter, float rr, float gr, float br, float fx, float fy) {
+	colour c = makeColour( t->r[0], t->g[0], t->b[0] );
+	if( shade == SHADE_GOURAUD ) {
+		c = makeColour( rr + t->r[1] * fx, gr + t->g[1] * fx, br + t->b[1] * fx );
+	}
+	if( textured ) {
+		float u;
+		float v;
+		float lod;
+		texturePixel( tex, t->q, t->u, t->v, fx, fy, &u, &v, &lod );
+		colour texel = sampleTexture( tex, filter, u, v, lod );
+		c = makeColour( c.r * texel.r, c.g * texel.g, c.b * texel.b );
+	}
+	return c;
+}
 
-void rasterize(model* m, buffer* pbuf, float* zbuf) {
+// One block, pixel by pixel. Edge values are stepped with one add per
+// pixel and row, depth and colours come from the planes. Everything after
+// the coverage test depends on the pipeline state, which is a constant in
+// each copy. Returns the smallest depth left in the block; without a
+// depth test, the smallest depth it wrote.
+static inline __attribute__((always_inline)) float drawBlockAs(const tri* t, buffer* pbuf, float* zbuf, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, pixelFormat format, shadeMode shade, depthMode depth, colourMode colours, bool textured, const texture* tex, textureFilter filter, uint32_t* ids, uint32_t id, frameStats* counts, uint16_t* overdraw) {
 	int width = pbuf->width;
-	int height = pbuf->size;
-	
-	// Status variables.
-	tri t;
-	triangle* modelTri;
-	float d1;
-	float d2;
-	float d3;
-	float r;
-	float g;
-	float b;
-	int x;
-	int y;
+	bool test = depth == DEPTH_TEST_WRITE || depth == DEPTH_TEST;
+	bool write = depth == DEPTH_TEST_WRITE || depth == DEPTH_WRITE;
+	int32_t e1;
+	int32_t e2;
+	int32_t e3;
+	float fx;
+	float fy;
 	float z;
-	int i;
-	float l;
+	float zr;
+	float rr;
+	float gr;
+	float br;
+	float zmin = FLT_MAX;
 
-	// The actual rasterizer.
-	while(modelTrianglesLeft(m)) {
-		modelTri = modelNextTriangle(m);
-		
-		// Backface cull
-		if(
-			(modelTri->vertices[1][0] - modelTri->vertices[0][0]) *
-			(modelTri->vertices[2][1] - modelTri->vertices[0][1]) -
-			(modelTri->vertices[2][0] - modelTri->vertices[0][0]) *
-			(modelTri->vertices[1][1] - modelTri->vertices[0][1])
-			< 0
-		) {
-			continue;
-		}
-
-		// Lines of the form: d = nx * ( x - sx ) + ny * ( y - sy )
-		for( i = 0; i < 3; i++ ) {
-			t.sx[i] = SCREEN_X( modelTri->vertices[i][0] );
-			t.sy[i] = SCREEN_Y( modelTri->vertices[i][1] );
+	size_t stride = pixelSize( format );
+
+	int32_t row1 = be->e[0] + be->stepY[0] * (y0 - by) + be->stepX[0] * (x0 - bx);
+	int32_t row2 = be->e[1] + be->stepY[1] * (y0 - by) + be->stepX[1] * (x0 - bx);
+	int32_t row3 = be->e[2] + be->stepY[2] * (y0 - by) + be->stepX[2] * (x0 - bx);
+
+	for( int y = y0; y < y1; y++ ) {
+		fy = (float)(y - t->oy);
+		zr = t->z[0] + t->z[2] * fy;
+		rr = t->r[0] + t->r[2] * fy;
+		gr = t->g[0] + t->g[2] * fy;
+		br = t->b[0] + t->b[2] * fy;
+
+		e1 = row1;
+		e2 = row2;
+		e3 = row3;
+		for( int x = x0; x < x1; x++ ) {
+			if( (e1 | e2 | e3) >= 0 ) {
+				fx = (float)(x - t->ox);
+				STATS_ADD( counts, STAT_PIXELS_COVERED, 1 );
+
+				// Z test
+				z = zr + t->z[1] * fx;
+				if( !test || z > zbuf[y*width+x] ) {
+					STATS_ADD( counts, STAT_DEPTH_PASSED, 1 );
+#ifdef RASTER_STATS
+					overdraw[y*width+x]++;
+#endif
+					if( write ) {
+						zbuf[y*width+x] = z;
+						zmin = !test && z < zmin ? z : zmin;
+					}
+					if( colours == COLOUR_OFF ) {
+						// Depth only.
+					}
+					else if( ids ) {
+						ids[y*width+x] = id;
+					}
+					else {
+						STATS_ADD( counts, STAT_PIXELS_SHADED, 1 );
+						uint8_t* dst = (uint8_t*)pbuf->data + (size_t)(y*width+x) * stride;
+						colour c = shadePixel( t, shade, textured, tex, filter, rr, gr, br, fx, fy );
+						if( colours == COLOUR_ADD ) {
+							colour old = unpackPixel( dst, format );
+							c = makeColour( c.r + old.r, c.g + old.g, c.b + old.b );
+						}
+						packPixel( dst, format, c );
+					}
+				}
+				else {
+					STATS_ADD( counts, STAT_DEPTH_FAILED, 1 );
+				}
+			}
+			if( test ) {
+				zmin = zbuf[y*width+x] < zmin ? zbuf[y*width+x] : zmin;
+			}
+			e1 += be->stepX[0];
+			e2 += be->stepX[1];
+			e3 += be->stepX[2];
 		}
+		row1 += be->stepY[0];
+		row2 += be->stepY[1];
+		row3 += be->stepY[2];
+	}
+	return zmin;
+}
 
-		// Normals
-		for( i = 0; i < 3; i++ ) {
-			t.nx[i] = -(t.sy[(i+1)%3] - t.sy[i]);
-			t.ny[i] =  (t.sx[(i+1)%3] - t.sx[i]);
-			l = sqrt( t.nx[i] * t.nx[i] + t.ny[i] * t.ny[i] );
-			t.nx[i] /= l;
-			t.ny[i] /= l;
+// One block, multisampled, pixel by pixel: edges and depth are tested per
+// sample, at the target's sample positions, and colours worked out once
+// per pixel, at its centre, for the pixels with any sample passing.
+// Pixels that are one colour and have all samples passing are written as
+// they would be without multisampling, the rest through writeSamples; in
+// visibility mode, passing samples get the id. Returns what drawBlockAs
+// does, over all samples.
+static inline __attribute__((always_inline)) float drawSamplesAs(const tri* t, renderTarget* rt, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, pixelFormat format, shadeMode shade, depthMode depth, colourMode colours, bool textured, const texture* tex, textureFilter filter, bool visibility, uint32_t id, frameStats* counts) {
+	int width = rt->colour.width;
+	int samples = rt->samples;
+	int all = (1 << samples) - 1;
+	float* zbuf = rt->depth.data;
+	bool test = depth == DEPTH_TEST_WRITE || depth == DEPTH_TEST;
+	bool write = depth == DEPTH_TEST_WRITE || depth == DEPTH_WRITE;
+	float zmin = FLT_MAX;
+	size_t stride = pixelSize( format );
+
+	// Edge offsets of the samples from the pixel centres, zero for edges
+	// that contain the block.
+	int32_t sampleE[MAX_SAMPLES][3];
+	for( int i = 0; i < 3; i++ ) {
+		int32_t crosses = be->stepX[i] | be->stepY[i] ? -1 : 0;
+		for( int s = 0; s < samples; s++ ) {
+			sampleE[s][i] = be->sampleE[s][i] & crosses;
 		}
+	}
 
-		// For barycentric coordinates
-		for( i = 0; i < 3; i++ ) {
-			t.b[i] = t.nx[i] * ( t.sx[(i+2)%3] - t.sx[i] ) + t.ny[i] * ( t.sy[(i+2)%3] - t.sy[i] );
-		}
-
-		// Bounding rectangles.
-		t.xmin = floor( fmin( fmin( t.sx[0], t.sx[1] ), t.sx[2] ) );
-		t.ymin = floor( fmin( fmin( t.sy[0], t.sy[1] ), t.sy[2] ) );
-		t.xmax = ceil( fmax( fmax( t.sx[0], t.sx[1] ), t.sx[2] ) );
-		t.ymax = ceil( fmax( fmax( t.sy[0], t.sy[1] ), t.sy[2] ) );
-
-		// Clip and possibly reject.
-		t.xmin = fmax(0, t.xmin);
-		t.xmax = fmin(width, t.xmax);
-		t.ymin = fmax(0, t.ymin);
-		t.ymax = fmin(height, t.ymax);
-
-		if(t.ymin > t.ymax || t.xmin > t.xmax) {
-			continue;
-		}
-		// Draw pixels inside, if need be
-		for( y = t.ymin; y < t.ymax; y++ ) {
-			for( x = t.xmin; x < t.xmax; x++ ) {
-				d1 = t.nx[0] * ( x - t.sx[0] ) + t.ny[0] * ( y - t.sy[0] );
-				if( d1 >= 0 ) {
-					d2 = t.nx[1] * ( x - t.sx[1] ) + t.ny[1] * ( y - t.sy[1] );
-					if( d2 >= 0 ) {
-						d3 = t.nx[2] * ( x - t.sx[2] ) + t.ny[2] * ( y - t.sy[2] );
-						if( d3 >= 0 ) {
-							d1 /= t.b[0];
-							d2 /= t.b[1];
-							d3 /= t.b[2];
-
-							// Z test
-							z =
-								1.0f / modelTri->vertices[0][2] * d2 +
-								1.0f / modelTri->vertices[1][2] * d3 +
-								1.0f / modelTri->vertices[2][2] * d1;
-
-							if( z > zbuf[y*width+x] ) {
-								zbuf[y*width+x] = z;
-
-								r =
-									modelTri->colors[0][0] * d2 +
-									modelTri->colors[1][0] * d3 +
-									modelTri->colors[2][0] * d1;
-								g =
-									modelTri->colors[0][1] * d2  +
-									modelTri->colors[1][1] * d3  +
-									modelTri->colors[2][1] * d1;
-								b =
-									modelTri->colors[0][2] * d2 +
-									modelTri->colors[1][2] * d3 +
-									modelTri->colors[2][2] * d1;
-
-								
-								setPixel(*pbuf, x, y, makeColour(r,g,b));
-							}
+	int32_t row[3];
+	for( int i = 0; i < 3; i++ ) {
+		row[i] = be->e[i] + be->stepY[i] * (y0 - by) + be->stepX[i] * (x0 - bx);
+	}
+
+	for( int y = y0; y < y1; y++ ) {
+		float fy = (float)(y - t->oy);
+		float zr = t->z[0] + t->z[2] * fy;
+		float rr = t->r[0] + t->r[2] * fy;
+		float gr = t->g[0] + t->g[2] * fy;
+		float br = t->b[0] + t->b[2] * fy;
+
+		int32_t e[3] = { row[0], row[1], row[2] };
+		for( int x = x0; x < x1; x++ ) {
+			float fx = (float)(x - t->ox);
+			float z = zr + t->z[1] * fx;
+			bool covered = false;
+			int mask = 0;
+			for( int s = 0; s < samples; s++ ) {
+				float* zp = &zbuf[sampleIndex( &rt->depth, x, y, s )];
+				if( ((e[0] + sampleE[s][0]) | (e[1] + sampleE[s][1]) | (e[2] + sampleE[s][2])) >= 0 ) {
+					covered = true;
+					float zs = z + be->sampleZ[s];
+					if( !test || zs > *zp ) {
+						mask |= 1 << s;
+						if( write ) {
+							*zp = zs;
+							zmin = !test && zs < zmin ? zs : zmin;
 						}
 					}
 				}
+				if( test ) {
+					zmin = *zp < zmin ? *zp : zmin;
+				}
+			}
+			if( covered ) {
+				STATS_ADD( counts, STAT_PIXELS_COVERED, 1 );
+				STATS_ADD( counts, mask ? STAT_DEPTH_PASSED : STAT_DEPTH_FAILED, 1 );
+			}
+#ifdef RASTER_STATS
+			rt->overdraw[y*width+x] += mask ? 1 : 0;
+#endif
+
+			if( mask && colours != COLOUR_OFF && visibility ) {
+				for( int s = 0; s < samples; s++ ) {
+					if( (mask >> s) & 1 ) {
+						rt->ids[sampleIndex( &rt->depth, x, y, s )] = id;
+					}
+				}
+			}
+			else if( mask && colours != COLOUR_OFF ) {
+				STATS_ADD( counts, STAT_PIXELS_SHADED, 1 );
+				colour c = shadePixel( t, shade, textured, tex, filter, rr, gr, br, fx, fy );
+				if( colours == COLOUR_ADD ) {
+					addSamples( rt, x, y, format, c, mask );
+				}
+				else if( mask == all && !(*mixedWord( rt, x, y ) & mixedBit( x, y )) ) {
+					packPixel( (uint8_t*)rt->colour.data + (size_t)(y*width+x) * stride, format, c );
+				}
+				else {
+					uint8_t packed[sizeof(colour)];
+					packPixel( packed, format, c );
+					writeSamples( rt, x, y, format, packed, mask );
+				}
+			}
+
+			for( int i = 0; i < 3; i++ ) {
+				e[i] += be->stepX[i];
+			}
+		}
+		for( int i = 0; i < 3; i++ ) {
+			row[i] += be->stepY[i];
+		}
+	}
+	return zmin;
+}
+
+#endif
+
+// A copy of the block loop for every pipeline state and pixel format,
+// textured or not, with one sample per pixel or several, and for every
+// depth mode in visibility mode, where the rest does not matter. Which
+// texture and filter is up to the state, how many samples up to the
+// target.
+typedef float (*blockDrawer)(const tri* t, renderTarget* rt, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, uint32_t id, const pipelineState* state, frameStats* counts);
+
+enum { PLAIN, TEXTURED };
+enum { ONE_SAMPLE, MULTISAMPLED };
+
+#define BLOCK_DRAWER(fmt, col, shd, dep, tx, ms) drawBlock_##fmt##_##col##_##shd##_##dep##_##tx##_##ms
+
+#define DEFINE_BLOCK_DRAWER(fmt, col, shd, dep, tx, ms) \
+	static float BLOCK_DRAWER(fmt, col, shd, dep, tx, ms)(const tri* t, renderTarget* rt, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, uint32_t id, const pipelineState* state, frameStats* counts) { \
+		if( ms == MULTISAMPLED ) { \
+			return drawSamplesAs( t, rt, be, bx, by, x0, x1, y0, y1, fmt, shd, dep, col, tx == TEXTURED, state->texture, state->filter, false, 0, counts ); \
+		} \
+		return drawBlockAs( t, &rt->colour, rt->depth.data, be, bx, by, x0, x1, y0, y1, fmt, shd, dep, col, tx == TEXTURED, state->texture, state->filter, NULL, 0, counts, rt->overdraw ); \
+	}
+
+#define DEFINE_ID_DRAWER(dep, ms) \
+	static float drawIds_##dep##_##ms(const tri* t, renderTarget* rt, const blockEdges* be, int bx, int by, int x0, int x1, int y0, int y1, uint32_t id, const pipelineState* state, frameStats* counts) { \
+		if( ms == MULTISAMPLED ) { \
+			return drawSamplesAs( t, rt, be, bx, by, x0, x1, y0, y1, PIXEL_FLOAT, SHADE_GOURAUD, dep, COLOUR_WRITE, false, NULL, FILTER_NEAREST, true, id, counts ); \
+		} \
+		return drawBlockAs( t, &rt->colour, rt->depth.data, be, bx, by, x0, x1, y0, y1, PIXEL_FLOAT, SHADE_GOURAUD, dep, COLOUR_WRITE, false, NULL, FILTER_NEAREST, rt->ids, id, counts, rt->overdraw ); \
+	}
+
+#define BLOCK_DRAWER_ENTRY(fmt, col, shd, dep, tx, ms) BLOCK_DRAWER(fmt, col, shd, dep, tx, ms),
+
+// Every combination, in enum order: format, colour, shade, depth, then
+// untextured and textured, each with one sample and multisampled.
+#define BLOCK_SAMPLES(F, fmt, col, shd, dep, tx) \
+	F(fmt, col, shd, dep, tx, ONE_SAMPLE) \
+	F(fmt, col, shd, dep, tx, MULTISAMPLED)
+#define BLOCK_TEXTURES(F, fmt, col, shd, dep) \
+	BLOCK_SAMPLES(F, fmt, col, shd, dep, PLAIN) \
+	BLOCK_SAMPLES(F, fmt, col, shd, dep, TEXTURED)
+#define BLOCK_DEPTHS(F, fmt, col, shd) \
+	BLOCK_TEXTURES(F, fmt, col, shd, DEPTH_TEST_WRITE) \
+	BLOCK_TEXTURES(F, fmt, col, shd, DEPTH_TEST) \
+	BLOCK_TEXTURES(F, fmt, col, shd, DEPTH_WRITE) \
+	BLOCK_TEXTURES(F, fmt, col, shd, DEPTH_OFF)
+#define BLOCK_SHADES(F, fmt, col) \
+	BLOCK_DEPTHS(F, fmt, col, SHADE_GOURAUD) \
+	BLOCK_DEPTHS(F, fmt, col, SHADE_FLAT)
+#define BLOCK_COLOURS(F, fmt) \
+	BLOCK_SHADES(F, fmt, COLOUR_WRITE) \
+	BLOCK_SHADES(F, fmt, COLOUR_ADD) \
+	BLOCK_SHADES(F, fmt, COLOUR_OFF)
+#define BLOCK_VARIANTS(F) \
+	BLOCK_COLOURS(F, PIXEL_FLOAT) \
+	BLOCK_COLOURS(F, PIXEL_RGBA8) \
+	BLOCK_COLOURS(F, PIXEL_RGB565) \
+	BLOCK_COLOURS(F, PIXEL_HALF)
+
+BLOCK_VARIANTS(DEFINE_BLOCK_DRAWER)
+DEFINE_ID_DRAWER(DEPTH_TEST_WRITE, ONE_SAMPLE)
+DEFINE_ID_DRAWER(DEPTH_TEST_WRITE, MULTISAMPLED)
+DEFINE_ID_DRAWER(DEPTH_TEST, ONE_SAMPLE)
+DEFINE_ID_DRAWER(DEPTH_TEST, MULTISAMPLED)
+DEFINE_ID_DRAWER(DEPTH_WRITE, ONE_SAMPLE)
+DEFINE_ID_DRAWER(DEPTH_WRITE, MULTISAMPLED)
+DEFINE_ID_DRAWER(DEPTH_OFF, ONE_SAMPLE)
+DEFINE_ID_DRAWER(DEPTH_OFF, MULTISAMPLED)
+
+static const blockDrawer blockDrawers[] = {
+	BLOCK_VARIANTS(BLOCK_DRAWER_ENTRY)
+};
+
+static const blockDrawer idDrawers[DEPTH_MODES][2] = {
+	{ drawIds_DEPTH_TEST_WRITE_ONE_SAMPLE, drawIds_DEPTH_TEST_WRITE_MULTISAMPLED },
+	{ drawIds_DEPTH_TEST_ONE_SAMPLE, drawIds_DEPTH_TEST_MULTISAMPLED },
+	{ drawIds_DEPTH_WRITE_ONE_SAMPLE, drawIds_DEPTH_WRITE_MULTISAMPLED },
+	{ drawIds_DEPTH_OFF_ONE_SAMPLE, drawIds_DEPTH_OFF_MULTISAMPLED }
+};
+
+// The block loop for drawing into a target with a state, once per draw.
+static blockDrawer pickBlockDrawer(const renderTarget* rt, pipelineState state) {
+	int samples = rt->samples > 1 ? MULTISAMPLED : ONE_SAMPLE;
+	if( rt->ids && state.colour != COLOUR_OFF ) {
+		return idDrawers[state.depth][samples];
+	}
+	int index = ((rt->colour.format * COLOUR_MODES + state.colour) * SHADE_MODES + state.shade) * DEPTH_MODES + state.depth;
+	return blockDrawers[(index * 2 + (state.texture ? TEXTURED : PLAIN)) * 2 + samples];
+}
+
+// Largest depth of a triangle over a rectangle of pixel centres, which is
+// at one of its corners.
+static float planeMax(const float* p, int ox, int oy, int x0, int x1, int y0, int y1) {
+	float fx = (float)((p[1] > 0 ? x1 : x0) - ox);
+	float fy = (float)((p[2] > 0 ? y1 : y0) - oy);
+	return (p[0] + p[2] * fy) + p[1] * fx;
+}
+
+// Draws the part of a triangle that falls into the given lines, block
+// by block, with the block loop picked for the draw's state. Blocks
+// outside an edge or, when depth is tested, behind their depth bound are
+// skipped, edges that contain a whole block are not tested inside it.
+// id is its number in visibility mode. Multisampled, depth can be up to
+// half a pixel's worth of slope nearer at the samples than at the centres.
+static void rasterTriangle(const tri* t, renderTarget* rt, const buffer* lines, uint32_t id, blockDrawer draw, const pipelineState* state, frameStats* counts) {
+	depthBuffer* zbuf = &rt->depth;
+	int ymin;
+	int ymax;
+	blockEdges be;
+
+	if( !triangleLines( t, lines, &ymin, &ymax ) ) {
+		return;
+	}
+
+	int bx0 = t->xmin / BLOCK_SIZE;
+	int bx1 = (t->xmax - 1) / BLOCK_SIZE;
+	int by0 = ymin / BLOCK_SIZE;
+	int by1 = (ymax - 1) / BLOCK_SIZE;
+
+	// Nearest point of the triangle against all bounds it could touch.
+	depthMode depth = state->depth;
+	bool test = depth == DEPTH_TEST_WRITE || depth == DEPTH_TEST;
+	bool multisampled = rt->samples > 1;
+	float zreach = multisampled ? 0.5f * (fabsf( t->z[1] ) + fabsf( t->z[2] )) : 0.0f;
+	float zmax = planeMax( t->z, t->ox, t->oy, t->xmin, t->xmax - 1, ymin, ymax - 1 ) + zreach;
+	bool visible = !test;
+	for( int by = by0; by <= by1 && !visible; by++ ) {
+		const float* bound = &zbuf->blockMin[by * zbuf->blocksX];
+		for( int bx = bx0; bx <= bx1; bx++ ) {
+			if( zmax > bound[bx] ) {
+				visible = true;
+				break;
+			}
+		}
+	}
+	if( !visible ) {
+		STATS_ADD( counts, STAT_HIZ_TRIANGLES, 1 );
+		return;
+	}
+	if( multisampled ) {
+		sampleOffsets( t, rt, &be );
+	}
+
+	for( int by = by0; by <= by1; by++ ) {
+		int y0 = by * BLOCK_SIZE > ymin ? by * BLOCK_SIZE : ymin;
+		int y1 = (by + 1) * BLOCK_SIZE < ymax ? (by + 1) * BLOCK_SIZE : ymax;
+		float* bound = &zbuf->blockMin[by * zbuf->blocksX];
+		for( int bx = bx0; bx <= bx1; bx++ ) {
+			if( !classifyBlock( t, bx * BLOCK_SIZE, by * BLOCK_SIZE, multisampled, &be ) ) {
+				continue;
+			}
+			int x0 = bx * BLOCK_SIZE > t->xmin ? bx * BLOCK_SIZE : t->xmin;
+			int x1 = (bx + 1) * BLOCK_SIZE < t->xmax ? (bx + 1) * BLOCK_SIZE : t->xmax;
+
+			if( test && planeMax( t->z, t->ox, t->oy, x0, x1 - 1, y0, y1 - 1 ) + zreach <= bound[bx] ) {
+				STATS_ADD( counts, STAT_HIZ_BLOCKS, 1 );
+				STATS_ADD( counts, STAT_HIZ_PIXELS, (x1 - x0) * (y1 - y0) );
+				continue;
 			}
+
+			if( rt->blockFrame[by * zbuf->blocksX + bx] != rt->frame ) {
+				prepareBlock( rt, bx, by );
+			}
+			STATS_ADD( counts, STAT_PIXELS_TESTED, (x1 - x0) * (y1 - y0) );
+			float zmin = draw( t, rt, &be, bx * BLOCK_SIZE, by * BLOCK_SIZE, x0, x1, y0, y1, id, state, counts );
+
+			// Raise the bound if every pixel of the block was looked at. Only
+			// ever true for blocks that lie entirely in this band. Depth
+			// written untested can be further away, the bound has to drop.
+			if( depth == DEPTH_WRITE ) {
+				bound[bx] = zmin < bound[bx] ? zmin : bound[bx];
+			}
+			else if( depth == DEPTH_TEST_WRITE && be.full && x1 - x0 == BLOCK_SIZE && y1 - y0 == BLOCK_SIZE ) {
+				bound[bx] = zmin;
+			}
+		}
+	}
+}
+
+// What visibility mode needs to shade a triangle later.
+static void keepShading(triShading* s, const tri* t, const pipelineState* state) {
+	memcpy( s->r, t->r, sizeof(s->r) );
+	memcpy( s->g, t->g, sizeof(s->g) );
+	memcpy( s->b, t->b, sizeof(s->b) );
+	s->texture = state->texture;
+	if( state->texture ) {
+		memcpy( s->q, t->q, sizeof(s->q) );
+		memcpy( s->u, t->u, sizeof(s->u) );
+		memcpy( s->v, t->v, sizeof(s->v) );
+		s->filter = state->filter;
+	}
+	s->ox = t->ox;
+	s->oy = t->oy;
+}
+
+// Draws a model's mesh with a state. Textures need texture coordinates,
+// without them the draw is untextured.
+static void drawWith(drawCall* d, const model* m, pipelineState state) {
+	d->state = state;
+	d->u = NULL;
+	d->v = NULL;
+	if( state.texture && m->vertices.u ) {
+		d->u = m->vertices.u;
+		d->v = m->vertices.v;
+	}
+	else {
+		d->state.texture = NULL;
+	}
+}
+
+// A model's one draw of the frame.
+static drawCall modelDraw(const model* m, pipelineState state) {
+	drawCall d;
+	d.indices = m->indices;
+	d.triangleCount = m->triangleCount;
+	d.instances = 1;
+	d.stride = 0;
+	d.out = &m->output;
+	drawWith( &d, m, state );
+	return d;
+}
+
+static void rasterizeAll(model* m, renderTarget* rt) {
+	tri pieces[CLIP_TRIS];
+	frameStats counts = { 0 };
+	drawCall d = modelDraw( m, makePipelineState() );
+	blockDrawer draw = pickBlockDrawer( rt, d.state );
+
+	// The actual rasterizer.
+	for( int i = 0; i < modelTriangleCount( m ); i++ ) {
+		int n = setupTriangle( pieces, &d, i, rt->colour.width, rt->colour.size, rt->samples > 1, &counts );
+		for( int k = 0; k < n; k++ ) {
+			uint32_t id = 0;
+			if( rt->ids ) {
+				id = reserveShading( rt, 1 );
+				keepShading( &rt->shading[id], &pieces[k], &d.state );
+			}
+			rasterTriangle( &pieces[k], rt, &rt->colour, id, draw, &d.state, &counts );
+		}
+	}
+	STATS_ADD( &counts, STAT_TRIANGLES, modelTriangleCount( m ) );
+	mergeStats( &rt->stats, &counts );
+}
+
+void rasterize(model* m, renderTarget* rt) {
+	STATS_STAGE( &rt->stats, STAGE_RASTER, rasterizeAll( m, rt ) );
+}
+
+pipelineState makePipelineState() {
+	pipelineState state;
+	state.shade = SHADE_GOURAUD;
+	state.depth = DEPTH_TEST_WRITE;
+	state.colour = COLOUR_WRITE;
+	state.texture = NULL;
+	state.filter = FILTER_TRILINEAR;
+	return state;
+}
+
+tiler makeTiler(int threads) {
+	tiler t;
+	t.pool = makeWorkerPool( threads );
+	t.lists = NULL;
+	t.listCapacity = 0;
+	t.bins = NULL;
+	t.binCapacity = 0;
+	t.chunks = 0;
+	t.bands = 0;
+	t.scratch = makeVertexOutput( 0 );
+	t.state = makePipelineState();
+	return t;
+}
+
+void freeTiler(tiler* t) {
+	for( int i = 0; i < t->binCapacity; i++ ) {
+		free( t->bins[i].tris );
+	}
+	free( t->bins );
+	for( int i = 0; i < t->listCapacity; i++ ) {
+		free( t->lists[i].tris );
+	}
+	free( t->lists );
+	freeVertexOutput( &t->scratch );
+	freeWorkerPool( t->pool );
+}
+
+typedef struct tileJob {
+	tiler* t;
+	const drawCall* d;
+	renderTarget* rt;
+	blockDrawer draw;
+} tileJob;
+
+// Bands split on block boundaries, so no two bands share a depth bound.
+static buffer band(buffer* pbuf, int index, int bands) {
+	return alignedPartialBuffer( *pbuf, index, bands, BLOCK_SIZE );
+}
+
+static int bandOf(buffer* pbuf, int y, int bands) {
+	int i = (y * bands) / pbuf->size;
+	while( i + 1 < bands && band( pbuf, i + 1, bands ).firstLine <= y ) {
+		i++;
+	}
+	while( i > 0 && band( pbuf, i, bands ).firstLine > y ) {
+		i--;
+	}
+	return i;
+}
+
+static void binPush(triBin* bin, int i) {
+	if( bin->count == bin->capacity ) {
+		bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+		bin->tris = (int*)realloc( bin->tris, sizeof(int) * bin->capacity );
+	}
+	bin->tris[bin->count++] = i;
+}
+
+static int bandCount(const renderTarget* rt) {
+	int bands = (rt->colour.size + BAND_LINES - 1) / BAND_LINES;
+	return bands < 1 ? 1 : bands;
+}
+
+// Set up one chunk of triangles and sort them into this chunk's bins.
+static void binChunk(void* arg, int chunk) {
+	tileJob* job = (tileJob*)arg;
+	tiler* t = job->t;
+	int first = chunk * CHUNK_TRIS;
+	int last = first + CHUNK_TRIS;
+	int total = job->d->triangleCount * job->d->instances;
+	if( last > total ) {
+		last = total;
+	}
+
+	triBin* bins = &t->bins[chunk * t->bands];
+	for( int band = 0; band < t->bands; band++ ) {
+		bins[band].count = 0;
+	}
+
+	frameStats counts = { 0 };
+	STATS_ADD( &counts, STAT_TRIANGLES, last - first );
+
+	triList* list = &t->lists[chunk];
+	list->count = 0;
+	for( int i = first; i < last; i++ ) {
+		if( list->count + CLIP_TRIS > list->capacity ) {
+			list->capacity = list->capacity ? list->capacity * 2 : 1024;
+			list->tris = (tri*)realloc( list->tris, sizeof(tri) * list->capacity );
+		}
+		buffer* pbuf = &job->rt->colour;
+		int n = setupTriangle( &list->tris[list->count], job->d, i, pbuf->width, pbuf->size, job->rt->samples > 1, &counts );
+		for( int k = 0; k < n; k++, list->count++ ) {
+			tri* st = &list->tris[list->count];
+			int lastBand = bandOf( pbuf, st->ymax - 1, t->bands );
+			for( int b = bandOf( pbuf, st->ymin, t->bands ); b <= lastBand; b++ ) {
+				binPush( &bins[b], list->count );
+			}
+		}
+	}
+	mergeStats( &job->rt->stats, &counts );
+}
+
+// Keeps the shading of one chunk's triangles, in visibility mode.
+static void keepChunk(void* arg, int chunk) {
+	tileJob* job = (tileJob*)arg;
+	const triList* list = &job->t->lists[chunk];
+	triShading* shading = &job->rt->shading[list->firstId];
+	for( int i = 0; i < list->count; i++ ) {
+		keepShading( &shading[i], &list->tris[i], &job->d->state );
+	}
+}
+
+// Draw everything binned into one band, in submission order.
+static void drawBand(void* arg, int index) {
+	tileJob* job = (tileJob*)arg;
+	tiler* t = job->t;
+	buffer part = band( &job->rt->colour, index, t->bands );
+	frameStats counts = { 0 };
+
+	for( int chunk = 0; chunk < t->chunks; chunk++ ) {
+		triBin* bin = &t->bins[chunk * t->bands + index];
+		const triList* list = &t->lists[chunk];
+		for( int i = 0; i < bin->count; i++ ) {
+			rasterTriangle( &list->tris[bin->tris[i]], job->rt, &part, list->firstId + bin->tris[i], job->draw, &job->d->state, &counts );
 		}
 	}
+	mergeStats( &job->rt->stats, &counts );
+}
+
+// Sets up and bins all chunks. In visibility mode, triangles are then
+// numbered in submission order and their shading kept.
+static void setupChunks(tileJob* job) {
+	tiler* t = job->t;
+	runJobs( t->pool, binChunk, job, t->chunks );
+	if( !job->rt->ids ) {
+		return;
+	}
+	for( int chunk = 0; chunk < t->chunks; chunk++ ) {
+		t->lists[chunk].firstId = reserveShading( job->rt, t->lists[chunk].count );
+	}
+	runJobs( t->pool, keepChunk, job, t->chunks );
+}
+
+static void rasterizeDraw(tiler* t, const drawCall* d, renderTarget* rt) {
+	int triCount = d->triangleCount * d->instances;
+
+	t->chunks = (triCount + CHUNK_TRIS - 1) / CHUNK_TRIS;
+	if( t->chunks > t->listCapacity ) {
+		t->lists = (triList*)realloc( t->lists, sizeof(triList) * t->chunks );
+		memset( &t->lists[t->listCapacity], 0, sizeof(triList) * (t->chunks - t->listCapacity) );
+		t->listCapacity = t->chunks;
+	}
+
+	t->bands = bandCount( rt );
+
+	int binsNeeded = t->chunks * t->bands;
+	if( binsNeeded > t->binCapacity ) {
+		t->bins = (triBin*)realloc( t->bins, sizeof(triBin) * binsNeeded );
+		memset( &t->bins[t->binCapacity], 0, sizeof(triBin) * (binsNeeded - t->binCapacity) );
+		t->binCapacity = binsNeeded;
+	}
+
+	tileJob job;
+	job.t = t;
+	job.d = d;
+	job.rt = rt;
+	job.draw = pickBlockDrawer( rt, d->state );
+
+	STATS_STAGE( &rt->stats, STAGE_SETUP, setupChunks( &job ) );
+	STATS_STAGE( &rt->stats, STAGE_RASTER, runJobs( t->pool, drawBand, &job, t->bands ) );
+}
+
+void rasterizeTiled(tiler* t, model* m, renderTarget* rt) {
+	drawCall d = modelDraw( m, t->state );
+	rasterizeDraw( t, &d, rt );
+}
+
+typedef struct instanceJob {
+	const model* m;
+	const matrix* modelView;
+	const colour* tints;
+	matrix projection;
+	const lightList* lights;
+	vertexOutput* out;
+	frameStats* stats;
+	int stride;
+	int chunks;
+} instanceJob;
+
+// Jobs are chunks of copies: copy index / chunks, its chunk index %
+// chunks.
+static void vertexInstance(void* arg, int index) {
+	instanceJob* job = (instanceJob*)arg;
+	int copy = index / job->chunks;
+	colour tint = job->tints ? job->tints[copy] : COLOUR_WHITE;
+	frameStats counts = { 0 };
+	processChunk( job->m, index % job->chunks, job->modelView[copy], job->projection, job->lights, tint, job->out, copy * job->stride, &counts );
+	mergeStats( job->stats, &counts );
+}
+
+void rasterizeInstanced(tiler* t, renderTarget* rt, const model* m, const matrix* modelView, const colour* tints, int count, matrix projection, const lightList* lights) {
+	int vertices = m->vertices.count;
+	if( !count || !vertices ) {
+		return;
+	}
+
+	// Every copy starts on a whole number of lanes, for the batched
+	// transforms.
+	int stride = ((vertices + SCALAR_LANES - 1) / SCALAR_LANES) * SCALAR_LANES;
+	int batch = INSTANCE_VERTICES / stride;
+	if( batch < 1 ) {
+		batch = 1;
+	}
+	if( batch > count ) {
+		batch = count;
+	}
+	if( t->scratch.capacity < batch * stride ) {
+		freeVertexOutput( &t->scratch );
+		t->scratch = makeVertexOutput( batch * stride );
+	}
+
+	setClipNear( &t->scratch, projection );
+
+	instanceJob job;
+	job.m = m;
+	job.projection = projection;
+	job.lights = lights;
+	job.out = &t->scratch;
+	job.stats = &rt->stats;
+	job.stride = stride;
+	job.chunks = vertexChunks( vertices );
+
+	drawCall d;
+	d.indices = m->indices;
+	d.triangleCount = m->triangleCount;
+	d.stride = stride;
+	d.out = &t->scratch;
+	drawWith( &d, m, t->state );
+
+	for( int first = 0; first < count; first += batch ) {
+		int n = count - first < batch ? count - first : batch;
+		job.modelView = &modelView[first];
+		job.tints = tints ? &tints[first] : NULL;
+		STATS_STAGE( &rt->stats, STAGE_VERTEX, runJobs( t->pool, vertexInstance, &job, n * job.chunks ) );
+		d.instances = n;
+		rasterizeDraw( t, &d, rt );
+	}
+}
+
+static void resolveBand(void* arg, int index) {
+	tileJob* job = (tileJob*)arg;
+	buffer part = band( &job->rt->colour, index, job->t->bands );
+	frameStats counts = { 0 };
+	resolveBlocks( job->rt, part.firstLine / BLOCK_SIZE, (part.size + BLOCK_SIZE - 1) / BLOCK_SIZE, &counts );
+	mergeStats( &job->rt->stats, &counts );
+}
+
+void resolveTiled(tiler* t, renderTarget* rt) {
+	t->bands = bandCount( rt );
+	tileJob job;
+	job.t = t;
+	job.d = NULL;
+	job.rt = rt;
+	job.draw = NULL;
+	runJobs( t->pool, resolveBand, &job, t->bands );
 }
@@ -7,10 +7,141 @@
 #define __RASTERIZER_H__
 
 #include <float.h>
+#include <stdint.h>
 
 #include "buffers.h"
 #include "models.h"
+#include "textures.h"
+#include "workers.h"
 
-void rasterize(model* m, buffer* pbuf, float* zbuf);
+// Sub-pixel precision of the fixed point vertex positions (28.4), and the
+// size of the blocks triangles are walked in.
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL (1 << SUBPIXEL_BITS)
+#define BLOCK_SIZE DEPTH_BLOCK
 
-#endif
\ No newline at end of file
+// How triangles are drawn, per draw. Colours are interpolated from the
+// vertices (SHADE_GOURAUD) or taken from the first one (SHADE_FLAT).
+// Depth is tested (nearer passes) and/or written, or neither. Colours are
+// written, added to what is there, or left alone: DEPTH_TEST_WRITE with
+// COLOUR_OFF fills depth only. In visibility mode colours are only worked
+// out when resolving, so COLOUR_ADD writes like COLOUR_WRITE there. With a
+// texture, colours are multiplied by it, sampled at the model's texture
+// coordinates, perspective correct; models without any are drawn as if
+// there was no texture.
+typedef enum shadeMode {
+	SHADE_GOURAUD,
+	SHADE_FLAT,
+	SHADE_MODES
+} shadeMode;
+
+typedef enum depthMode {
+	DEPTH_TEST_WRITE,
+	DEPTH_TEST,
+	DEPTH_WRITE,
+	DEPTH_OFF,
+	DEPTH_MODES
+} depthMode;
+
+typedef enum colourMode {
+	COLOUR_WRITE,
+	COLOUR_ADD,
+	COLOUR_OFF,
+	COLOUR_MODES
+} colourMode;
+
+typedef struct pipelineState {
+	shadeMode shade;
+	depthMode depth;
+	colourMode colour;
+	const texture* texture;
+	textureFilter filter;
+} pipelineState;
+
+// Gouraud shaded, depth tested and written, colours written, untextured
+// (trilinear once there is a texture).
+pipelineState makePipelineState();
+
+// Screen space triangle, ready to be drawn. Edge functions are integers,
+// e = e + stepX * x + stepY * y at the centre of pixel (x, y), inside where
+// e >= 0.
+// Depth and colours are planes: value at (ox, oy), d/dx, d/dy. So are
+// 1/w, u/w and v/w, in textured draws only.
+typedef struct tri {
+	int64_t e[3];
+	int32_t stepX[3];
+	int32_t stepY[3];
+	float z[3];
+	float r[3];
+	float g[3];
+	float b[3];
+	float q[3];
+	float u[3];
+	float v[3];
+	int ox;
+	int oy;
+	int xmin;
+	int xmax;
+	int ymin;
+	int ymax;
+} tri;
+
+// Per chunk of input triangles, the ones set up: clipping can leave none,
+// one or a few for each. In visibility mode they are numbered from
+// firstId on.
+typedef struct triList {
+	tri* tris;
+	int count;
+	int capacity;
+	uint32_t firstId;
+} triList;
+
+// Per chunk of triangles, per band list of the set up triangles (indices
+// into the chunk's list) touching it.
+typedef struct triBin {
+	int* tris;
+	int count;
+	int capacity;
+} triBin;
+
+// Bins triangles into horizontal bands of the frame buffer and draws
+// the bands in parallel.
+typedef struct tiler {
+	workerPool* pool;
+
+	triList* lists;
+	int listCapacity;
+
+	triBin* bins;
+	int binCapacity;
+	int chunks;
+	int bands;
+
+	// Vertex stage output of instanced draws.
+	vertexOutput scratch;
+
+	// How the next draws are drawn. Each combination of state and pixel
+	// format has its own copy of the block loop, picked once per draw.
+	pipelineState state;
+} tiler;
+
+tiler makeTiler(int threads);
+void freeTiler(tiler* t);
+
+// Draws with makePipelineState().
+void rasterize(model* m, renderTarget* rt);
+void rasterizeTiled(tiler* t, model* m, renderTarget* rt);
+
+// Draws count copies of a model, the i-th with model view matrix
+// modelView[i] and its colours multiplied by tints[i] (white if tints is
+// NULL), in that order. The model is only read: the vertex stage works on
+// a batch of copies at a time, in parallel, into the tiler's scratch, and
+// the batch is then rasterized as one. Lights are in eye space, as for
+// applyVertexStage().
+void rasterizeInstanced(tiler* t, renderTarget* rt, const model* m, const matrix* modelView, const colour* tints, int count, matrix projection, const lightList* lights);
+
+// resolveTarget, band by band on the tiler's threads: what shades the
+// pixels in visibility mode.
+void resolveTiled(tiler* t, renderTarget* rt);
+
+#endif
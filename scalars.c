@@ -3,8 +3,26 @@
  * (c) 2010 L. Diener
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "scalars.h"
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+scalar* makeScalarArray(int count) {
+	void* p = NULL;
+	size_t padded = ((count + SCALAR_LANES - 1) / SCALAR_LANES) * SCALAR_LANES;
+	if( padded == 0 ) {
+		padded = SCALAR_LANES;
+	}
+	if( posix_memalign( &p, 64, padded * sizeof(scalar) ) != 0 ) {
+		fprintf(stderr, "Error: Out of memory allocating %d scalars.\n", count);
+		exit(1);
+	}
+	memset( (scalar*)p + count, 0, (padded - count) * sizeof(scalar) );
+	return (scalar*)p;
+}
 
 // Scalar value functions
 // Assume we're using IEEE floats or doubles.
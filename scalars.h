@@ -28,6 +28,17 @@
 #define scalarLog2(x) (log2((x)))
 #define scalarMod(x,y) (fmod((x),(y)))
 
+// SSE code paths unless told otherwise (make SIMD=0).
+#if defined(__SSE2__) && !defined(RASTER_NO_SIMD)
+#define RASTER_SIMD
+#endif
+
+// Arrays of scalars for SIMD loops: cache line aligned and padded with
+// zeroes to a multiple of SCALAR_LANES.
+#define SCALAR_LANES 8
+
+scalar* makeScalarArray(int count);
+
 scalar nextScalar(scalar s);
 scalar prevScalar(scalar s);
 scalar scalarRand();
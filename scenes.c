@@ -0,0 +1,453 @@
+/**
+ * Scenes: many models, each drawn where a world transform puts it.
+ * Objects outside the view frustum are culled on their bounds, through a
+ * bounding volume hierarchy, before any of their vertices are touched.
+ * Models can have coarser versions of themselves, drawn instead where
+ * the difference would not show.
+ * (c) L. Diener 2011
+ */
+
+#include "scenes.h"
+#include "simplify.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Objects per leaf of the hierarchy, at most.
+#define LEAF_OBJECTS 4
+
+// Deep enough for any hierarchy of median splits.
+#define BVH_STACK 64
+
+#define ALL_PLANES 0x3f
+
+// Levels of detail stop once they are this small, or once simplification
+// no longer gets rid of at least a quarter of the triangles.
+#define LOD_MIN_TRIANGLES 64
+#define LOD_MIN_GAIN 0.75f
+
+// Frustum plane, inside where nx * x + ny * y + nz * z + d >= 0.
+typedef struct plane {
+	vec3 n;
+	scalar d;
+} plane;
+
+scene makeScene() {
+	scene s;
+	memset( &s, 0, sizeof(s) );
+	s.lodPixels = 1.0f;
+	s.lights = makeLightList();
+	return s;
+}
+
+void freeScene(scene* s) {
+	for( int i = 0; i < s->modelCount; i++ ) {
+		freeModel( &s->models[i] );
+	}
+	free( s->models );
+	free( s->coarser );
+	free( s->lodError );
+	free( s->objects );
+	free( s->nodes );
+	free( s->order );
+	free( s->visible );
+	free( s->drawMatrices );
+	freeLightList( &s->lights );
+}
+
+int addSceneModel(scene* s, model m) {
+	if( s->modelCount == s->modelCapacity ) {
+		s->modelCapacity = s->modelCapacity ? s->modelCapacity * 2 : 4;
+		s->models = (model*)realloc( s->models, sizeof(model) * s->modelCapacity );
+		s->coarser = (int*)realloc( s->coarser, sizeof(int) * s->modelCapacity );
+		s->lodError = (scalar*)realloc( s->lodError, sizeof(scalar) * s->modelCapacity );
+	}
+	s->models[s->modelCount] = m;
+	s->coarser[s->modelCount] = -1;
+	s->lodError[s->modelCount] = 0.0f;
+	return s->modelCount++;
+}
+
+int buildSceneLods(scene* s, int model, int levels) {
+	if( model < 0 || model >= s->modelCount ) {
+		fprintf(stderr, "Error: Scene has no model %d.\n", model);
+		exit(1);
+	}
+
+	// Onto the end of any chain already there.
+	while( s->coarser[model] != -1 ) {
+		model = s->coarser[model];
+	}
+	int made = 0;
+	while( made < levels && s->models[model].triangleCount > LOD_MIN_TRIANGLES ) {
+		int tris = s->models[model].triangleCount;
+		scalar error;
+		struct model coarse = simplifyModel( &s->models[model], tris / 2, &error );
+		if( coarse.triangleCount > tris * LOD_MIN_GAIN ) {
+			freeModel( &coarse );
+			break;
+		}
+
+		// Errors of successive levels add up, at worst.
+		int level = addSceneModel( s, coarse );
+		s->lodError[level] = s->lodError[model] + error;
+		s->coarser[model] = level;
+		model = level;
+		made++;
+	}
+	return made;
+}
+
+// World bounds of the model's box under the object's transform: the
+// centre moves, the half extents get the absolute values of the matrix
+// applied.
+static void placeObject(scene* s, sceneObject* o) {
+	const model* m = &s->models[o->model];
+	vec3 c = makeVec3(
+		(m->boundsMin.x + m->boundsMax.x) * 0.5f,
+		(m->boundsMin.y + m->boundsMax.y) * 0.5f,
+		(m->boundsMin.z + m->boundsMax.z) * 0.5f
+	);
+	vec3 e = makeVec3(
+		(m->boundsMax.x - m->boundsMin.x) * 0.5f,
+		(m->boundsMax.y - m->boundsMin.y) * 0.5f,
+		(m->boundsMax.z - m->boundsMin.z) * 0.5f
+	);
+	const scalar* w = o->world.v;
+	vec3 centre;
+	matrixApply( &centre, o->world, c );
+	vec3 extent = makeVec3(
+		scalarAbs( w[0] ) * e.x + scalarAbs( w[1] ) * e.y + scalarAbs( w[2] ) * e.z,
+		scalarAbs( w[4] ) * e.x + scalarAbs( w[5] ) * e.y + scalarAbs( w[6] ) * e.z,
+		scalarAbs( w[8] ) * e.x + scalarAbs( w[9] ) * e.y + scalarAbs( w[10] ) * e.z
+	);
+	sub3( &o->boundsMin, centre, extent );
+	add3( &o->boundsMax, centre, extent );
+	o->centre = centre;
+	o->radius = length3( extent );
+}
+
+int addSceneObject(scene* s, int model, matrix world) {
+	if( model < 0 || model >= s->modelCount ) {
+		fprintf(stderr, "Error: Scene has no model %d.\n", model);
+		exit(1);
+	}
+	if( s->objectCount == s->objectCapacity ) {
+		s->objectCapacity = s->objectCapacity ? s->objectCapacity * 2 : 16;
+		s->objects = (sceneObject*)realloc( s->objects, sizeof(sceneObject) * s->objectCapacity );
+		s->order = (int*)realloc( s->order, sizeof(int) * s->objectCapacity );
+		s->visible = (int*)realloc( s->visible, sizeof(int) * s->objectCapacity );
+		s->drawMatrices = (matrix*)realloc( s->drawMatrices, sizeof(matrix) * s->objectCapacity );
+		s->nodes = (bvhNode*)realloc( s->nodes, sizeof(bvhNode) * 2 * s->objectCapacity );
+	}
+	sceneObject* o = &s->objects[s->objectCount];
+	o->model = model;
+	o->world = world;
+	placeObject( s, o );
+	s->rebuild = true;
+	return s->objectCount++;
+}
+
+void moveSceneObject(scene* s, int object, matrix world) {
+	sceneObject* o = &s->objects[object];
+	o->world = world;
+	placeObject( s, o );
+	s->refit = true;
+}
+
+int sceneTriangleCount(const scene* s) {
+	int count = 0;
+	for( int i = 0; i < s->objectCount; i++ ) {
+		count += s->models[s->objects[i].model].triangleCount;
+	}
+	return count;
+}
+
+static scalar axisOf(vec3 v, int axis) {
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static void growBox(vec3* lo, vec3* hi, vec3 a, vec3 b) {
+	*lo = makeVec3( fminf( lo->x, a.x ), fminf( lo->y, a.y ), fminf( lo->z, a.z ) );
+	*hi = makeVec3( fmaxf( hi->x, b.x ), fmaxf( hi->y, b.y ), fmaxf( hi->z, b.z ) );
+}
+
+// Bounds of a node from what is under it.
+static void fitNode(scene* s, bvhNode* node) {
+	node->boundsMin = makeVec3( FLT_MAX, FLT_MAX, FLT_MAX );
+	node->boundsMax = makeVec3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	if( node->count ) {
+		for( int i = 0; i < node->count; i++ ) {
+			const sceneObject* o = &s->objects[s->order[node->first + i]];
+			growBox( &node->boundsMin, &node->boundsMax, o->boundsMin, o->boundsMax );
+		}
+	}
+	else {
+		for( int i = 0; i < 2; i++ ) {
+			const bvhNode* child = &s->nodes[node->first + i];
+			growBox( &node->boundsMin, &node->boundsMax, child->boundsMin, child->boundsMax );
+		}
+	}
+}
+
+// Reorders order[first, first + count) so that the object at mid has
+// the centre it would have if they were sorted along the axis, with
+// none of those before it further along and none after it less far.
+static void selectMedian(scene* s, int first, int count, int mid, int axis) {
+	int* order = s->order;
+	int lo = first;
+	int hi = first + count - 1;
+	while( lo < hi ) {
+		scalar pivot = axisOf( s->objects[order[(lo + hi) / 2]].centre, axis );
+		int i = lo;
+		int j = hi;
+		while( i <= j ) {
+			while( axisOf( s->objects[order[i]].centre, axis ) < pivot ) {
+				i++;
+			}
+			while( axisOf( s->objects[order[j]].centre, axis ) > pivot ) {
+				j--;
+			}
+			if( i <= j ) {
+				int swap = order[i];
+				order[i] = order[j];
+				order[j] = swap;
+				i++;
+				j--;
+			}
+		}
+		if( mid <= j ) {
+			hi = j;
+		}
+		else if( mid >= i ) {
+			lo = i;
+		}
+		else {
+			break;
+		}
+	}
+}
+
+// Splits the objects in half along the longest axis of their centres,
+// until there are few enough for a leaf.
+static void buildNode(scene* s, int index, int first, int count) {
+	bvhNode* node = &s->nodes[index];
+	if( count <= LEAF_OBJECTS ) {
+		node->first = first;
+		node->count = count;
+		fitNode( s, node );
+		return;
+	}
+
+	vec3 lo = makeVec3( FLT_MAX, FLT_MAX, FLT_MAX );
+	vec3 hi = makeVec3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for( int i = 0; i < count; i++ ) {
+		vec3 c = s->objects[s->order[first + i]].centre;
+		growBox( &lo, &hi, c, c );
+	}
+	int axis = 0;
+	if( hi.y - lo.y > hi.x - lo.x ) {
+		axis = 1;
+	}
+	if( hi.z - lo.z > axisOf( hi, axis ) - axisOf( lo, axis ) ) {
+		axis = 2;
+	}
+	int half = count / 2;
+	selectMedian( s, first, count, first + half, axis );
+
+	int children = s->nodeCount;
+	s->nodeCount += 2;
+	buildNode( s, children, first, half );
+	buildNode( s, children + 1, first + half, count - half );
+
+	node = &s->nodes[index];
+	node->first = children;
+	node->count = 0;
+	fitNode( s, node );
+}
+
+// Brings the hierarchy up to date: built anew when objects were added,
+// only its bounds redone when they merely moved. Children come after
+// their parents, so going backwards does them first.
+static void updateHierarchy(scene* s) {
+	if( s->rebuild ) {
+		for( int i = 0; i < s->objectCount; i++ ) {
+			s->order[i] = i;
+		}
+		s->nodeCount = 1;
+		buildNode( s, 0, 0, s->objectCount );
+	}
+	else if( s->refit ) {
+		for( int i = s->nodeCount - 1; i >= 0; i-- ) {
+			fitNode( s, &s->nodes[i] );
+		}
+	}
+	s->rebuild = false;
+	s->refit = false;
+}
+
+// Planes of the frustum of a view and projection, in world space, from
+// the rows of the combined matrix: -w <= x, y, z <= w in clip space.
+static void frustumPlanes(plane* planes, matrix view, matrix projection) {
+	matrix m;
+	matrixMult( &m, projection, view );
+	const scalar* r = m.v;
+	for( int i = 0; i < 6; i++ ) {
+		const scalar* row = &r[(i / 2) * 4];
+		scalar sign = (i & 1) ? -1.0f : 1.0f;
+		plane p;
+		p.n = makeVec3( r[12] + sign * row[0], r[13] + sign * row[1], r[14] + sign * row[2] );
+		p.d = r[15] + sign * row[3];
+		scalar len = length3( p.n );
+		if( len > 0.0f ) {
+			scale3( &p.n, 1.0f / len );
+			p.d /= len;
+		}
+		planes[i] = p;
+	}
+}
+
+// Tests a box against the planes still in mask. Returns false if it is
+// wholly outside one of them, otherwise clears the ones it is wholly
+// inside of from the mask.
+static bool boxInside(const plane* planes, vec3 lo, vec3 hi, int* mask) {
+	for( int i = 0; i < 6; i++ ) {
+		if( !(*mask & (1 << i)) ) {
+			continue;
+		}
+		const plane* p = &planes[i];
+
+		// The corners furthest along and furthest against the normal.
+		vec3 furthest = makeVec3( p->n.x >= 0.0f ? hi.x : lo.x, p->n.y >= 0.0f ? hi.y : lo.y, p->n.z >= 0.0f ? hi.z : lo.z );
+		vec3 nearest = makeVec3( p->n.x >= 0.0f ? lo.x : hi.x, p->n.y >= 0.0f ? lo.y : hi.y, p->n.z >= 0.0f ? lo.z : hi.z );
+		if( dot3( p->n, furthest ) + p->d < 0.0f ) {
+			return false;
+		}
+		if( dot3( p->n, nearest ) + p->d >= 0.0f ) {
+			*mask &= ~(1 << i);
+		}
+	}
+	return true;
+}
+
+// The sphere decides most objects with one dot product per plane, the
+// box the ones that straddle a plane.
+static bool objectInside(const plane* planes, const sceneObject* o, int mask) {
+	int straddled = 0;
+	for( int i = 0; i < 6; i++ ) {
+		if( !(mask & (1 << i)) ) {
+			continue;
+		}
+		scalar d = dot3( planes[i].n, o->centre ) + planes[i].d;
+		if( d < -o->radius ) {
+			return false;
+		}
+		if( d < o->radius ) {
+			straddled |= 1 << i;
+		}
+	}
+	return !straddled || boxInside( planes, o->boundsMin, o->boundsMax, &straddled );
+}
+
+static int compareIndices(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+int cullScene(scene* s, matrix view, matrix projection, frameStats* stats) {
+	s->visibleCount = 0;
+	if( !s->objectCount ) {
+		return 0;
+	}
+	updateHierarchy( s );
+
+	plane planes[6];
+	frustumPlanes( planes, view, projection );
+
+	// Nodes wholly inside planes pass that on to everything under them.
+	int stack[BVH_STACK];
+	int masks[BVH_STACK];
+	int top = 0;
+	stack[top] = 0;
+	masks[top++] = ALL_PLANES;
+	while( top ) {
+		top--;
+		const bvhNode* node = &s->nodes[stack[top]];
+		int mask = masks[top];
+		if( mask && !boxInside( planes, node->boundsMin, node->boundsMax, &mask ) ) {
+			continue;
+		}
+		if( node->count ) {
+			for( int i = 0; i < node->count; i++ ) {
+				int object = s->order[node->first + i];
+				if( !mask || objectInside( planes, &s->objects[object], mask ) ) {
+					s->visible[s->visibleCount++] = object;
+				}
+			}
+		}
+		else {
+			for( int i = 0; i < 2; i++ ) {
+				stack[top] = node->first + i;
+				masks[top++] = mask;
+			}
+		}
+	}
+
+	// Draw in the order objects were added, whatever the hierarchy did.
+	qsort( s->visible, s->visibleCount, sizeof(int), compareIndices );
+
+	STATS_ADD( stats, STAT_OBJECTS, s->objectCount );
+	STATS_ADD( stats, STAT_OBJECTS_CULLED, s->objectCount - s->visibleCount );
+	return s->visibleCount;
+}
+
+int sceneObjectLod(const scene* s, int object, matrix view, matrix projection, int height) {
+	const sceneObject* o = &s->objects[object];
+	int model = o->model;
+	if( s->coarser[model] == -1 ) {
+		return model;
+	}
+
+	// Nearest the object's sphere comes to the camera. Inside it, nothing
+	// coarse will do.
+	vec3 eye;
+	matrixApply( &eye, view, o->centre );
+	scalar distance = -eye.z - o->radius;
+	if( distance <= 0.0f ) {
+		return model;
+	}
+
+	// Largest stretch of the world transform, then model units to pixels
+	// at that distance.
+	const scalar* w = o->world.v;
+	scalar stretch = 0.0f;
+	for( int c = 0; c < 3; c++ ) {
+		stretch = fmaxf( stretch, length3( makeVec3( w[c], w[4 + c], w[8 + c] ) ) );
+	}
+	scalar pixels = stretch * projection.v[5] * height * 0.5f / distance;
+
+	while( s->coarser[model] != -1 && s->lodError[s->coarser[model]] * pixels <= s->lodPixels ) {
+		model = s->coarser[model];
+	}
+	return model;
+}
+
+void drawVisible(scene* s, tiler* t, renderTarget* rt, matrix view, matrix projection) {
+	int height = rt->colour.size;
+	viewLights( &s->lights, view );
+	int i = 0;
+	int next = s->visibleCount ? sceneObjectLod( s, s->visible[0], view, projection, height ) : -1;
+	while( i < s->visibleCount ) {
+		int model = next;
+		int count = 0;
+		while( i < s->visibleCount && next == model ) {
+			matrixMult( &s->drawMatrices[count++], view, s->objects[s->visible[i++]].world );
+			next = i < s->visibleCount ? sceneObjectLod( s, s->visible[i], view, projection, height ) : -1;
+		}
+		rasterizeInstanced( t, rt, &s->models[model], s->drawMatrices, NULL, count, projection, &s->lights );
+	}
+}
+
+void drawScene(scene* s, tiler* t, renderTarget* rt, matrix view, matrix projection) {
+	STATS_STAGE( &rt->stats, STAGE_CULL, cullScene( s, view, projection, &rt->stats ) );
+	drawVisible( s, t, rt, view, projection );
+}
@@ -0,0 +1,111 @@
+/**
+ * Scenes: many models, each drawn where a world transform puts it.
+ * Objects outside the view frustum are culled on their bounds, through a
+ * bounding volume hierarchy, before any of their vertices are touched.
+ * Models can have coarser versions of themselves, drawn instead where
+ * the difference would not show.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __SCENES_H__
+#define __SCENES_H__
+
+#include <stdbool.h>
+
+#include "rasterizer.h"
+
+// A model placed in the world. Bounds are world space: the model's box
+// transformed, and the sphere around that, which is quicker to test.
+typedef struct sceneObject {
+	int model;
+	matrix world;
+	vec3 boundsMin;
+	vec3 boundsMax;
+	vec3 centre;
+	scalar radius;
+} sceneObject;
+
+// Node of the hierarchy over the objects. Leaves have the count objects
+// from order[first] on, inner nodes have count 0 and their two children
+// at nodes[first] and nodes[first + 1], always after the node itself.
+typedef struct bvhNode {
+	vec3 boundsMin;
+	vec3 boundsMax;
+	int first;
+	int count;
+} bvhNode;
+
+typedef struct scene {
+	model* models;
+	int modelCount;
+	int modelCapacity;
+
+	// Per model, the next coarser level of detail (-1 if none) and the
+	// errors simplifyModel gave on the way to it from the original, added
+	// up, in model units.
+	int* coarser;
+	scalar* lodError;
+
+	// Largest error, in pixels, that levels of detail may show on screen.
+	scalar lodPixels;
+
+	sceneObject* objects;
+	int objectCount;
+	int objectCapacity;
+
+	bvhNode* nodes;
+	int nodeCount;
+	int* order;
+
+	// Objects added since the hierarchy was built, or moved since its
+	// bounds were last updated.
+	bool rebuild;
+	bool refit;
+
+	// Objects found in view by the last cullScene, in the order they
+	// were added.
+	int* visible;
+	int visibleCount;
+
+	// Model view matrices of the objects being drawn together.
+	matrix* drawMatrices;
+
+	// World space lights. Without any, everything is black.
+	lightList lights;
+} scene;
+
+scene makeScene();
+void freeScene(scene* s);
+
+// The scene takes the model over, and frees it with itself. Returns its
+// number, for addSceneObject; any number of objects can share it.
+int addSceneModel(scene* s, model m);
+int addSceneObject(scene* s, int model, matrix world);
+void moveSceneObject(scene* s, int object, matrix world);
+
+// Adds up to levels coarser versions of a model, each with about half
+// the triangles of the one before, as far as simplifyModel gets. Objects
+// using the model then get whichever is coarsest without being off by
+// more than s->lodPixels on screen. Returns how many were made.
+int buildSceneLods(scene* s, int model, int levels);
+
+// The model an object is drawn with, for a camera and a target of the
+// given height in pixels.
+int sceneObjectLod(const scene* s, int object, matrix view, matrix projection, int height);
+
+int sceneTriangleCount(const scene* s);
+
+// Finds the objects in view of a camera, into s->visible. Returns how
+// many there are.
+int cullScene(scene* s, matrix view, matrix projection, frameStats* stats);
+
+// Transforms, shades and rasterizes the objects the last cullScene found
+// into rt, in order. Objects one after the other with the same model (or
+// level of detail) are drawn as instances of it, together, lit by the
+// scene's lights.
+void drawVisible(scene* s, tiler* t, renderTarget* rt, matrix view, matrix projection);
+
+// Culls, then draws what is left.
+void drawScene(scene* s, tiler* t, renderTarget* rt, matrix view, matrix projection);
+
+#endif
@@ -0,0 +1,549 @@
+/**
+ * Mesh simplification: quadric error edge collapse, for levels of detail.
+ * (c) L. Diener 2011
+ */
+
+#include "simplify.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How much more a border edge resists moving than an inner one.
+#define BORDER_WEIGHT 10.0
+
+// Collapses that would turn a triangle further than this (cosine of the
+// angle between its normals before and after) are not made.
+#define FOLD_COSINE 0.2
+
+// Symmetric 4x4 matrix: a a, a b, a c, a d, b b, b c, b d, c c, c d, d d.
+typedef struct quadric {
+	double q[10];
+} quadric;
+
+// Candidate collapse of position from onto position to, as it was when
+// both had the versions given.
+typedef struct collapse {
+	double cost;
+	int from;
+	int to;
+	unsigned int fromVersion;
+	unsigned int toVersion;
+} collapse;
+
+typedef struct collapseHeap {
+	collapse* items;
+	int count;
+	int capacity;
+} collapseHeap;
+
+// Triangles around one position.
+typedef struct triangleList {
+	int* tris;
+	int count;
+	int capacity;
+} triangleList;
+
+typedef struct simplifier {
+	const model* m;
+	int positions;
+	int* positionOf;
+	double* p;
+	int* vertexStart;
+	int* vertexList;
+	quadric* quadrics;
+	unsigned int* version;
+	bool* removed;
+	triangleList* around;
+	uint32_t* corners;
+	bool* dead;
+	int live;
+	collapseHeap heap;
+} simplifier;
+
+static void addPlane(quadric* q, double a, double b, double c, double d, double w) {
+	q->q[0] += w * a * a;
+	q->q[1] += w * a * b;
+	q->q[2] += w * a * c;
+	q->q[3] += w * a * d;
+	q->q[4] += w * b * b;
+	q->q[5] += w * b * c;
+	q->q[6] += w * b * d;
+	q->q[7] += w * c * c;
+	q->q[8] += w * c * d;
+	q->q[9] += w * d * d;
+}
+
+// Sum of the squared distances of (x, y, z) from the planes in q.
+static double quadricError(const quadric* a, const quadric* b, const double* p) {
+	double q[10];
+	for( int i = 0; i < 10; i++ ) {
+		q[i] = a->q[i] + b->q[i];
+	}
+	double x = p[0];
+	double y = p[1];
+	double z = p[2];
+	double e =
+		q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+		q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+		q[7] * z * z + 2 * q[8] * z +
+		q[9];
+	return e > 0.0 ? e : 0.0;
+}
+
+static void heapPush(collapseHeap* h, collapse c) {
+	if( h->count == h->capacity ) {
+		h->capacity = h->capacity ? h->capacity * 2 : 1024;
+		h->items = (collapse*)realloc( h->items, sizeof(collapse) * h->capacity );
+	}
+	int i = h->count++;
+	while( i > 0 && h->items[(i - 1) / 2].cost > c.cost ) {
+		h->items[i] = h->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->items[i] = c;
+}
+
+static collapse heapPop(collapseHeap* h) {
+	collapse top = h->items[0];
+	collapse last = h->items[--h->count];
+	int i = 0;
+	for( ;; ) {
+		int child = 2 * i + 1;
+		if( child >= h->count ) {
+			break;
+		}
+		if( child + 1 < h->count && h->items[child + 1].cost < h->items[child].cost ) {
+			child++;
+		}
+		if( h->items[child].cost >= last.cost ) {
+			break;
+		}
+		h->items[i] = h->items[child];
+		i = child;
+	}
+	if( h->count ) {
+		h->items[i] = last;
+	}
+	return top;
+}
+
+static void listPush(triangleList* l, int t) {
+	if( l->count == l->capacity ) {
+		l->capacity = l->capacity ? l->capacity * 2 : 8;
+		l->tris = (int*)realloc( l->tris, sizeof(int) * l->capacity );
+	}
+	l->tris[l->count++] = t;
+}
+
+// Hash of a position, by bit pattern.
+static uint32_t hashPosition(float x, float y, float z) {
+	float v[3] = { x, y, z };
+	uint32_t h = 2166136261u;
+	for( int i = 0; i < 3; i++ ) {
+		uint32_t bits;
+		memcpy( &bits, &v[i], sizeof(bits) );
+		h = (h ^ bits) * 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+// Vertices at the same position are one as far as the surface goes.
+static void weldPositions(simplifier* s) {
+	const vertexStreams* v = &s->m->vertices;
+	int tableSize = 1;
+	while( tableSize < v->count * 2 ) {
+		tableSize *= 2;
+	}
+	int* table = (int*)malloc( sizeof(int) * tableSize );
+	for( int i = 0; i < tableSize; i++ ) {
+		table[i] = -1;
+	}
+	int* first = (int*)malloc( sizeof(int) * v->count );
+	s->positionOf = (int*)malloc( sizeof(int) * v->count );
+	s->positions = 0;
+	for( int i = 0; i < v->count; i++ ) {
+		uint32_t slot = hashPosition( v->x[i], v->y[i], v->z[i] ) & (tableSize - 1);
+		while( table[slot] != -1 ) {
+			int j = first[table[slot]];
+			if( v->x[j] == v->x[i] && v->y[j] == v->y[i] && v->z[j] == v->z[i] ) {
+				break;
+			}
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if( table[slot] == -1 ) {
+			table[slot] = s->positions;
+			first[s->positions++] = i;
+		}
+		s->positionOf[i] = table[slot];
+	}
+	free( table );
+
+	s->p = (double*)malloc( sizeof(double) * 3 * s->positions );
+	for( int i = 0; i < s->positions; i++ ) {
+		s->p[i * 3] = v->x[first[i]];
+		s->p[i * 3 + 1] = v->y[first[i]];
+		s->p[i * 3 + 2] = v->z[first[i]];
+	}
+	free( first );
+
+	// Vertices by position.
+	s->vertexStart = (int*)calloc( s->positions + 1, sizeof(int) );
+	s->vertexList = (int*)malloc( sizeof(int) * v->count );
+	for( int i = 0; i < v->count; i++ ) {
+		s->vertexStart[s->positionOf[i] + 1]++;
+	}
+	for( int i = 0; i < s->positions; i++ ) {
+		s->vertexStart[i + 1] += s->vertexStart[i];
+	}
+	int* fill = (int*)malloc( sizeof(int) * s->positions );
+	memcpy( fill, s->vertexStart, sizeof(int) * s->positions );
+	for( int i = 0; i < v->count; i++ ) {
+		s->vertexList[fill[s->positionOf[i]]++] = i;
+	}
+	free( fill );
+}
+
+static int cornerPosition(const simplifier* s, int t, int k) {
+	return s->positionOf[s->corners[t * 3 + k]];
+}
+
+// Unnormalized normal of triangle t, with position from moved to to.
+static void triangleNormal(const simplifier* s, int t, int from, int to, double* n) {
+	const double* p[3];
+	for( int k = 0; k < 3; k++ ) {
+		int pos = cornerPosition( s, t, k );
+		p[k] = &s->p[(pos == from ? to : pos) * 3];
+	}
+	double a[3];
+	double b[3];
+	for( int i = 0; i < 3; i++ ) {
+		a[i] = p[1][i] - p[0][i];
+		b[i] = p[2][i] - p[0][i];
+	}
+	n[0] = a[1] * b[2] - a[2] * b[1];
+	n[1] = a[2] * b[0] - a[0] * b[2];
+	n[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+typedef struct edgeKey {
+	uint64_t key;
+	int tri;
+} edgeKey;
+
+static int compareEdges(const void* a, const void* b) {
+	uint64_t x = ((const edgeKey*)a)->key;
+	uint64_t y = ((const edgeKey*)b)->key;
+	return (x > y) - (x < y);
+}
+
+static void pushEdge(simplifier* s, int a, int b) {
+	collapse c;
+	double ab = quadricError( &s->quadrics[a], &s->quadrics[b], &s->p[b * 3] );
+	double ba = quadricError( &s->quadrics[a], &s->quadrics[b], &s->p[a * 3] );
+	c.from = ab <= ba ? a : b;
+	c.to = ab <= ba ? b : a;
+	c.cost = ab <= ba ? ab : ba;
+	c.fromVersion = s->version[c.from];
+	c.toVersion = s->version[c.to];
+	heapPush( &s->heap, c );
+}
+
+// Plane quadrics per position, extra planes along border edges to keep
+// them in place, and every edge once as a candidate.
+static void setupQuadrics(simplifier* s) {
+	int tris = s->m->triangleCount;
+	s->quadrics = (quadric*)calloc( s->positions, sizeof(quadric) );
+	for( int t = 0; t < tris; t++ ) {
+		if( s->dead[t] ) {
+			continue;
+		}
+		double n[3];
+		triangleNormal( s, t, -1, -1, n );
+		double len = sqrt( n[0] * n[0] + n[1] * n[1] + n[2] * n[2] );
+		if( len <= 0.0 ) {
+			continue;
+		}
+		for( int i = 0; i < 3; i++ ) {
+			n[i] /= len;
+		}
+		const double* p0 = &s->p[cornerPosition( s, t, 0 ) * 3];
+		double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+		for( int k = 0; k < 3; k++ ) {
+			addPlane( &s->quadrics[cornerPosition( s, t, k )], n[0], n[1], n[2], d, 1.0 );
+		}
+	}
+
+	edgeKey* edges = (edgeKey*)malloc( sizeof(edgeKey) * 3 * tris );
+	int count = 0;
+	for( int t = 0; t < tris; t++ ) {
+		if( s->dead[t] ) {
+			continue;
+		}
+		for( int k = 0; k < 3; k++ ) {
+			uint64_t a = (uint64_t)cornerPosition( s, t, k );
+			uint64_t b = (uint64_t)cornerPosition( s, t, (k + 1) % 3 );
+			edges[count].key = a < b ? (a << 32) | b : (b << 32) | a;
+			edges[count++].tri = t;
+		}
+	}
+	qsort( edges, count, sizeof(edgeKey), compareEdges );
+
+	for( int i = 0; i < count; ) {
+		int j = i + 1;
+		while( j < count && edges[j].key == edges[i].key ) {
+			j++;
+		}
+		int a = (int)(edges[i].key >> 32);
+		int b = (int)(edges[i].key & 0xffffffffu);
+		if( j - i == 1 ) {
+			// Border: the plane through the edge, upright on the triangle.
+			double n[3];
+			triangleNormal( s, edges[i].tri, -1, -1, n );
+			const double* pa = &s->p[a * 3];
+			const double* pb = &s->p[b * 3];
+			double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+			double u[3] = {
+				e[1] * n[2] - e[2] * n[1],
+				e[2] * n[0] - e[0] * n[2],
+				e[0] * n[1] - e[1] * n[0]
+			};
+			double len = sqrt( u[0] * u[0] + u[1] * u[1] + u[2] * u[2] );
+			if( len > 0.0 ) {
+				for( int k = 0; k < 3; k++ ) {
+					u[k] /= len;
+				}
+				double d = -(u[0] * pa[0] + u[1] * pa[1] + u[2] * pa[2]);
+				addPlane( &s->quadrics[a], u[0], u[1], u[2], d, BORDER_WEIGHT );
+				addPlane( &s->quadrics[b], u[0], u[1], u[2], d, BORDER_WEIGHT );
+			}
+		}
+		i = j;
+	}
+
+	// Costs only once all the border planes are in.
+	for( int i = 0; i < count; ) {
+		int j = i + 1;
+		while( j < count && edges[j].key == edges[i].key ) {
+			j++;
+		}
+		pushEdge( s, (int)(edges[i].key >> 32), (int)(edges[i].key & 0xffffffffu) );
+		i = j;
+	}
+	free( edges );
+}
+
+// Whether a collapse keeps every triangle that stays facing the way it
+// did.
+static bool collapseKeepsShape(const simplifier* s, int from, int to) {
+	const triangleList* l = &s->around[from];
+	for( int i = 0; i < l->count; i++ ) {
+		int t = l->tris[i];
+		if( s->dead[t] ) {
+			continue;
+		}
+		bool shared = false;
+		for( int k = 0; k < 3; k++ ) {
+			shared = shared || cornerPosition( s, t, k ) == to;
+		}
+		if( shared ) {
+			continue;
+		}
+		double before[3];
+		double after[3];
+		triangleNormal( s, t, -1, -1, before );
+		triangleNormal( s, t, from, to, after );
+		double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+		double lb = sqrt( before[0] * before[0] + before[1] * before[1] + before[2] * before[2] );
+		double la = sqrt( after[0] * after[0] + after[1] * after[1] + after[2] * after[2] );
+		if( la <= 0.0 || dot < FOLD_COSINE * lb * la ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The vertex at a position whose normal is closest to vertex v's.
+static uint32_t matchingVertex(const simplifier* s, int position, uint32_t v) {
+	const vertexStreams* vs = &s->m->vertices;
+	uint32_t best = (uint32_t)s->vertexList[s->vertexStart[position]];
+	float bestDot = -2.0f;
+	for( int i = s->vertexStart[position]; i < s->vertexStart[position + 1]; i++ ) {
+		uint32_t u = (uint32_t)s->vertexList[i];
+		float dot = vs->nx[u] * vs->nx[v] + vs->ny[u] * vs->ny[v] + vs->nz[u] * vs->nz[v];
+		if( dot > bestDot ) {
+			bestDot = dot;
+			best = u;
+		}
+	}
+	return best;
+}
+
+static void collapseEdge(simplifier* s, int from, int to) {
+	triangleList* l = &s->around[from];
+	triangleList* target = &s->around[to];
+	for( int i = 0; i < l->count; i++ ) {
+		int t = l->tris[i];
+		if( s->dead[t] ) {
+			continue;
+		}
+		bool shared = false;
+		for( int k = 0; k < 3; k++ ) {
+			shared = shared || cornerPosition( s, t, k ) == to;
+		}
+		if( shared ) {
+			s->dead[t] = true;
+			s->live--;
+			continue;
+		}
+		for( int k = 0; k < 3; k++ ) {
+			uint32_t* c = &s->corners[t * 3 + k];
+			if( s->positionOf[*c] == from ) {
+				*c = matchingVertex( s, to, *c );
+			}
+		}
+		listPush( target, t );
+	}
+	free( l->tris );
+	l->tris = NULL;
+	l->count = 0;
+	s->removed[from] = true;
+	for( int i = 0; i < 10; i++ ) {
+		s->quadrics[to].q[i] += s->quadrics[from].q[i];
+	}
+	s->version[to]++;
+
+	// Drop the dead, then offer every edge of to again at its new cost.
+	int kept = 0;
+	for( int i = 0; i < target->count; i++ ) {
+		if( !s->dead[target->tris[i]] ) {
+			target->tris[kept++] = target->tris[i];
+		}
+	}
+	target->count = kept;
+	for( int i = 0; i < target->count; i++ ) {
+		int t = target->tris[i];
+		for( int k = 0; k < 3; k++ ) {
+			int other = cornerPosition( s, t, k );
+			if( other != to ) {
+				pushEdge( s, to, other );
+			}
+		}
+	}
+}
+
+model simplifyModel(const model* m, int targetTris, scalar* error) {
+	simplifier s;
+	memset( &s, 0, sizeof(s) );
+	s.m = m;
+	int tris = m->triangleCount;
+	weldPositions( &s );
+
+	s.corners = (uint32_t*)malloc( sizeof(uint32_t) * 3 * tris );
+	memcpy( s.corners, m->indices, sizeof(uint32_t) * 3 * tris );
+	s.dead = (bool*)calloc( tris, sizeof(bool) );
+	s.live = tris;
+	s.around = (triangleList*)calloc( s.positions, sizeof(triangleList) );
+	for( int t = 0; t < tris; t++ ) {
+		int a = cornerPosition( &s, t, 0 );
+		int b = cornerPosition( &s, t, 1 );
+		int c = cornerPosition( &s, t, 2 );
+		if( a == b || b == c || c == a ) {
+			s.dead[t] = true;
+			s.live--;
+			continue;
+		}
+		listPush( &s.around[a], t );
+		listPush( &s.around[b], t );
+		listPush( &s.around[c], t );
+	}
+	s.version = (unsigned int*)calloc( s.positions, sizeof(unsigned int) );
+	s.removed = (bool*)calloc( s.positions, sizeof(bool) );
+	setupQuadrics( &s );
+
+	double worst = 0.0;
+	while( s.live > targetTris && s.heap.count ) {
+		collapse c = heapPop( &s.heap );
+		if(
+			s.removed[c.from] || s.removed[c.to] ||
+			s.version[c.from] != c.fromVersion || s.version[c.to] != c.toVersion ||
+			!collapseKeepsShape( &s, c.from, c.to )
+		) {
+			continue;
+		}
+		collapseEdge( &s, c.from, c.to );
+		worst = c.cost > worst ? c.cost : worst;
+	}
+
+	// Keep the vertices still used, in their old order.
+	const vertexStreams* v = &m->vertices;
+	int* newIndex = (int*)malloc( sizeof(int) * v->count );
+	for( int i = 0; i < v->count; i++ ) {
+		newIndex[i] = -1;
+	}
+	uint32_t* indices = (uint32_t*)malloc( sizeof(uint32_t) * 3 * (s.live > 0 ? s.live : 1) );
+	int count = 0;
+	for( int t = 0; t < tris; t++ ) {
+		if( s.dead[t] ) {
+			continue;
+		}
+		for( int k = 0; k < 3; k++ ) {
+			newIndex[s.corners[t * 3 + k]] = 0;
+		}
+	}
+	for( int i = 0; i < v->count; i++ ) {
+		if( newIndex[i] == 0 ) {
+			newIndex[i] = count++;
+		}
+	}
+	vertexStreams out = makeVertexStreams( count > 0 ? count : 1 );
+	if( v->u ) {
+		addTexCoords( &out );
+	}
+	out.count = count;
+	for( int i = 0; i < v->count; i++ ) {
+		if( newIndex[i] >= 0 ) {
+			int j = newIndex[i];
+			out.x[j] = v->x[i];
+			out.y[j] = v->y[i];
+			out.z[j] = v->z[i];
+			out.nx[j] = v->nx[i];
+			out.ny[j] = v->ny[i];
+			out.nz[j] = v->nz[i];
+			if( v->u ) {
+				out.u[j] = v->u[i];
+				out.v[j] = v->v[i];
+			}
+		}
+	}
+	int kept = 0;
+	for( int t = 0; t < tris; t++ ) {
+		if( !s.dead[t] ) {
+			for( int k = 0; k < 3; k++ ) {
+				indices[kept * 3 + k] = newIndex[s.corners[t * 3 + k]];
+			}
+			kept++;
+		}
+	}
+
+	for( int i = 0; i < s.positions; i++ ) {
+		free( s.around[i].tris );
+	}
+	free( s.around );
+	free( s.heap.items );
+	free( s.version );
+	free( s.removed );
+	free( s.quadrics );
+	free( s.dead );
+	free( s.corners );
+	free( s.vertexList );
+	free( s.vertexStart );
+	free( s.p );
+	free( s.positionOf );
+	free( newIndex );
+
+	if( error ) {
+		*error = (scalar)sqrt( worst );
+	}
+	return makeModelFromStreams( out, indices, kept );
+}
@@ -0,0 +1,25 @@
+/**
+ * Mesh simplification: quadric error edge collapse, for levels of detail.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include "models.h"
+
+// A copy of the model with at most targetTris triangles, if it can get
+// there without folding the surface over. Edges are collapsed onto one
+// of their vertices, cheapest first, where the cost is the squared
+// distance from the planes of the triangles merged into that vertex so
+// far. Vertices keep their normals and texture coordinates; where several
+// share a position (hard edges, seams), corners go to the one with the
+// closest normal.
+// Sets error, in model units, to the square root of the largest cost of
+// any collapse made. That is no less than the distance of any kept vertex
+// from the planes of the triangles merged into it, so a conservative
+// estimate of how far the surface moved rather than a measured one. Planes
+// along borders count several times over, which inflates it near them.
+model simplifyModel(const model* m, int targetTris, scalar* error);
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * Frame statistics: what each stage of the pipeline took and threw away.
+ * Only there when built with RASTER_STATS (make STATS=1); otherwise the
+ * counters stay zero and counting compiles to nothing.
+ * (c) L. Diener 2011
+ */
+
+#include "stats.h"
+#include "images.h"
+
+static const char* counterNames[STAT_COUNTERS] = {
+	"objects",
+	"objects culled",
+	"vertices",
+	"vertex lights",
+	"triangles",
+	"backface culled",
+	"off screen",
+	"clipped",
+	"hiz triangles",
+	"hiz blocks",
+	"hiz pixels",
+	"pixels tested",
+	"pixels covered",
+	"depth passed",
+	"depth failed",
+	"pixels shaded"
+};
+
+static const char* stageNames[STAGE_COUNT] = {
+	"clear", "cull", "vertex", "setup", "raster", "resolve"
+};
+
+const char* statCounterName(statCounter c) {
+	return counterNames[c];
+}
+
+const char* frameStageName(frameStage s) {
+	return stageNames[s];
+}
+
+#ifdef RASTER_STATS
+
+// What each counter is a share of, for printing.
+static const int counterBase[STAT_COUNTERS] = {
+	-1,
+	STAT_OBJECTS,
+	-1,
+	-1,
+	-1,
+	STAT_TRIANGLES,
+	STAT_TRIANGLES,
+	STAT_TRIANGLES,
+	STAT_TRIANGLES,
+	-1,
+	-1,
+	-1,
+	STAT_PIXELS_TESTED,
+	STAT_PIXELS_COVERED,
+	STAT_PIXELS_COVERED,
+	STAT_PIXELS_COVERED
+};
+
+void printFrameStats(FILE* out, const frameStats* s) {
+	fprintf( out, "frame %u\n", s->frame );
+	for( int i = 0; i < STAT_COUNTERS; i++ ) {
+		fprintf( out, "  %-16s %12ld", counterNames[i], s->counters[i] );
+		int base = counterBase[i];
+		if( base >= 0 && s->counters[base] ) {
+			fprintf( out, "  %5.1f%% of %s", 100.0 * s->counters[i] / s->counters[base], counterNames[base] );
+		}
+		fprintf( out, "\n" );
+	}
+	fprintf( out, "  ms:" );
+	for( int i = 0; i < STAGE_COUNT; i++ ) {
+		fprintf( out, " %s %.3f", stageNames[i], s->seconds[i] * 1e3 );
+	}
+	fprintf( out, "\n" );
+}
+
+#else
+
+void printFrameStats(FILE* out, const frameStats* s) {
+	fprintf( out, "frame %u: no statistics, build with make STATS=1\n", s->frame );
+}
+
+#endif
+
+void writeHeatMap(const uint16_t* counts, int width, int height, const char* filename) {
+	static const uint8_t ramp[9][3] = {
+		{ 0, 0, 0 },
+		{ 0, 0, 160 },
+		{ 0, 128, 255 },
+		{ 0, 200, 200 },
+		{ 0, 200, 0 },
+		{ 220, 220, 0 },
+		{ 255, 128, 0 },
+		{ 255, 0, 0 },
+		{ 255, 255, 255 }
+	};
+
+	// Bottom line first in memory, like the buffers.
+	imageWriter w = makeImageWriter( filename, imageFormatFor( filename ), width, height );
+	for( int y = height - 1; y >= 0; y-- ) {
+		uint8_t* p = imageRow( &w );
+		const uint16_t* row = counts + (size_t)y * width;
+		for( int x = 0; x < width; x++, p += 3 ) {
+			const uint8_t* c = ramp[row[x] < 8 ? row[x] : 8];
+			p[0] = c[0];
+			p[1] = c[1];
+			p[2] = c[2];
+		}
+		writeImageRow( &w );
+	}
+	freeImageWriter( &w );
+}
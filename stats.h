@@ -0,0 +1,91 @@
+/**
+ * Frame statistics: what each stage of the pipeline took and threw away.
+ * Only there when built with RASTER_STATS (make STATS=1); otherwise the
+ * counters stay zero and counting compiles to nothing.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "timing.h"
+
+typedef enum statCounter {
+	STAT_OBJECTS,         // in the scene
+	STAT_OBJECTS_CULLED,  // outside the view frustum
+	STAT_VERTICES,        // through the vertex stage
+	STAT_VERTEX_LIGHTS,   // lights evaluated, summed over those vertices
+	STAT_TRIANGLES,       // submitted
+	STAT_BACKFACE,        // facing away, or no area once snapped
+	STAT_BOUNDS,          // off screen, or behind the near plane
+	STAT_CLIPPED,         // clipped to the near plane or the guard band
+	STAT_HIZ_TRIANGLES,   // behind the block depth bounds as a whole
+	STAT_HIZ_BLOCKS,      // blocks skipped on their depth bound
+	STAT_HIZ_PIXELS,      // pixels in those blocks
+	STAT_PIXELS_TESTED,   // looked at by the block walker
+	STAT_PIXELS_COVERED,  // inside all three edges
+	STAT_DEPTH_PASSED,
+	STAT_DEPTH_FAILED,
+	STAT_PIXELS_SHADED,   // colours worked out: as drawn, or once resolved
+	STAT_COUNTERS
+} statCounter;
+
+typedef enum frameStage {
+	STAGE_CLEAR,
+	STAGE_CULL,           // finding the scene objects in view
+	STAGE_VERTEX,         // transform, lighting and clip codes
+	STAGE_SETUP,          // triangle setup and binning
+	STAGE_RASTER,
+	STAGE_RESOLVE,
+	STAGE_COUNT
+} frameStage;
+
+typedef struct frameStats {
+	unsigned int frame;
+	long counters[STAT_COUNTERS];
+	double seconds[STAGE_COUNT];
+} frameStats;
+
+const char* statCounterName(statCounter c);
+const char* frameStageName(frameStage s);
+
+#ifdef RASTER_STATS
+
+#define STATS_ADD(stats, counter, n) ((stats)->counters[counter] += (n))
+
+// Runs one pipeline stage, adding the time it took to stats.
+#define STATS_STAGE(stats, stage, call) do { \
+	double stageStart_ = timeNow(); \
+	call; \
+	(stats)->seconds[stage] += timeNow() - stageStart_; \
+} while( 0 )
+
+#else
+
+#define STATS_ADD(stats, counter, n) ((void)0)
+#define STATS_STAGE(stats, stage, call) do { call; } while( 0 )
+
+#endif
+
+// Adds counters gathered on one thread to the shared ones.
+static inline void mergeStats(frameStats* into, const frameStats* from) {
+#ifdef RASTER_STATS
+	for( int i = 0; i < STAT_COUNTERS; i++ ) {
+		if( from->counters[i] ) {
+			__sync_fetch_and_add( &into->counters[i], from->counters[i] );
+		}
+	}
+#endif
+}
+
+void printFrameStats(FILE* out, const frameStats* s);
+
+// Writes per pixel counts, bottom line first like buffers, as a heat map:
+// black for none, then from blue through green and yellow to red, and
+// white for 8 or more.
+void writeHeatMap(const uint16_t* counts, int width, int height, const char* filename);
+
+#endif
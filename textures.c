@@ -0,0 +1,447 @@
+/**
+ * Textures: RGBA8 mip chains in Morton (Z) order, sampled nearest,
+ * bilinear or trilinear with the level picked from screen space
+ * derivatives of the texture coordinates.
+ * (c) L. Diener 2011
+ */
+
+#include "textures.h"
+#include "scalars.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#ifdef RASTER_SIMD
+#include <emmintrin.h>
+#endif
+
+static const char* filterNames[] = { "nearest", "bilinear", "trilinear" };
+
+const char* textureFilterName(textureFilter filter) {
+	return filterNames[filter];
+}
+
+bool textureFilterNamed(const char* name, textureFilter* filter) {
+	for( int i = FILTER_NEAREST; i <= FILTER_TRILINEAR; i++ ) {
+		if( strcasecmp( name, filterNames[i] ) == 0 ) {
+			*filter = (textureFilter)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The low 16 bits of v, spread out to the even bits.
+static uint32_t spreadBits(uint32_t v) {
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+static int log2Of(int v) {
+	int n = 0;
+	while( (1 << n) < v ) {
+		n++;
+	}
+	return n;
+}
+
+// Allocates a level and its Morton tables, and swizzles the row major
+// texels into it.
+static textureLevel makeLevel(int width, int height, const uint32_t* rows) {
+	textureLevel l;
+	l.width = width;
+	l.height = height;
+	l.texels = (uint32_t*)malloc( sizeof(uint32_t) * width * height );
+	l.mortonX = (uint32_t*)malloc( sizeof(uint32_t) * width );
+	l.mortonY = (uint32_t*)malloc( sizeof(uint32_t) * height );
+
+	int shared = log2Of( width ) < log2Of( height ) ? log2Of( width ) : log2Of( height );
+	uint32_t mask = (1u << shared) - 1;
+	for( int x = 0; x < width; x++ ) {
+		l.mortonX[x] = spreadBits( x & mask ) | (((uint32_t)x >> shared) << (2 * shared));
+	}
+	for( int y = 0; y < height; y++ ) {
+		l.mortonY[y] = (spreadBits( y & mask ) << 1) | (((uint32_t)y >> shared) << (2 * shared));
+	}
+	for( int y = 0; y < height; y++ ) {
+		for( int x = 0; x < width; x++ ) {
+			l.texels[l.mortonX[x] | l.mortonY[y]] = rows[y * width + x];
+		}
+	}
+	return l;
+}
+
+// Box filters row major texels down to half the size. Sides of 1 stay 1,
+// their texels count twice.
+static void halve(const uint32_t* src, int width, int height, uint32_t* dst) {
+	int w = width > 1 ? width / 2 : 1;
+	int h = height > 1 ? height / 2 : 1;
+	for( int y = 0; y < h; y++ ) {
+		const uint32_t* row0 = &src[(height > 1 ? y * 2 : 0) * width];
+		const uint32_t* row1 = &src[(height > 1 ? y * 2 + 1 : 0) * width];
+		for( int x = 0; x < w; x++ ) {
+			int x0 = width > 1 ? x * 2 : 0;
+			int x1 = width > 1 ? x * 2 + 1 : 0;
+			uint32_t out = 0;
+			for( int c = 0; c < 32; c += 8 ) {
+				uint32_t sum =
+					((row0[x0] >> c) & 0xff) + ((row0[x1] >> c) & 0xff) +
+					((row1[x0] >> c) & 0xff) + ((row1[x1] >> c) & 0xff);
+				out |= ((sum + 2) >> 2) << c;
+			}
+			dst[y * w + x] = out;
+		}
+	}
+}
+
+texture makeTexture(int width, int height, const uint8_t* rgba) {
+	int limit = 1 << (MAX_TEXTURE_LEVELS - 1);
+	if( width < 1 || height < 1 || width > limit || height > limit || (width & (width - 1)) || (height & (height - 1)) ) {
+		fprintf(stderr, "Error: Textures have to be powers of two up to %d on a side, not %dx%d.\n", limit, width, height);
+		exit(1);
+	}
+
+	texture t;
+	memset( &t, 0, sizeof(t) );
+	t.width = width;
+	t.height = height;
+
+	uint32_t* rows = (uint32_t*)malloc( sizeof(uint32_t) * width * height );
+	uint32_t* next = (uint32_t*)malloc( sizeof(uint32_t) * width * height );
+	for( int i = 0; i < width * height; i++ ) {
+		const uint8_t* p = &rgba[i * 4];
+		rows[i] = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+	}
+
+	int w = width;
+	int h = height;
+	while( true ) {
+		t.level[t.levels++] = makeLevel( w, h, rows );
+		if( w == 1 && h == 1 ) {
+			break;
+		}
+		halve( rows, w, h, next );
+		uint32_t* swap = rows;
+		rows = next;
+		next = swap;
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	free( rows );
+	free( next );
+	return t;
+}
+
+// Next header number of a PPM file, skipping space and comments.
+static bool ppmNumber(FILE* file, int* out) {
+	int c = fgetc( file );
+	while( c == '#' || (c != EOF && strchr( " \t\r\n", c )) ) {
+		if( c == '#' ) {
+			while( c != '\n' && c != EOF ) {
+				c = fgetc( file );
+			}
+		}
+		c = fgetc( file );
+	}
+	if( c < '0' || c > '9' ) {
+		return false;
+	}
+	*out = 0;
+	while( c >= '0' && c <= '9' ) {
+		if( *out > 100000 ) {
+			return false;
+		}
+		*out = *out * 10 + (c - '0');
+		c = fgetc( file );
+	}
+	return c != EOF;
+}
+
+texture makeTextureFromFile(const char* file) {
+	FILE* f = fopen( file, "rb" );
+	if( !f ) {
+		fprintf(stderr, "Error: Couldn't open \"%s\".\n", file);
+		exit(1);
+	}
+
+	// One whitespace character after the largest value, then the pixels.
+	int width;
+	int height;
+	int max;
+	if( fgetc( f ) != 'P' || fgetc( f ) != '6' || !ppmNumber( f, &width ) || !ppmNumber( f, &height ) || !ppmNumber( f, &max ) || max < 1 || max > 255 ) {
+		fprintf(stderr, "Error: \"%s\" is not a binary PPM file with 8 bit samples.\n", file);
+		exit(1);
+	}
+	if( width < 1 || height < 1 ) {
+		fprintf(stderr, "Error: \"%s\" has no pixels.\n", file);
+		exit(1);
+	}
+
+	size_t rowSize = (size_t)width * 3;
+	uint8_t* row = (uint8_t*)malloc( rowSize );
+	uint8_t* rgba = (uint8_t*)malloc( (size_t)width * height * 4 );
+	for( int y = height - 1; y >= 0; y-- ) {
+		if( fread( row, 1, rowSize, f ) != rowSize ) {
+			fprintf(stderr, "Error: \"%s\" is truncated.\n", file);
+			exit(1);
+		}
+		uint8_t* dst = &rgba[(size_t)y * width * 4];
+		for( int x = 0; x < width; x++ ) {
+			for( int c = 0; c < 3; c++ ) {
+				dst[x * 4 + c] = (uint8_t)((row[x * 3 + c] * 255 + max / 2) / max);
+			}
+			dst[x * 4 + 3] = 255;
+		}
+	}
+	fclose( f );
+	free( row );
+
+	texture t = makeTexture( width, height, rgba );
+	free( rgba );
+	return t;
+}
+
+texture makeCheckerTexture(int size, int checks, colour a, colour b) {
+	uint8_t* rgba = (uint8_t*)malloc( (size_t)size * size * 4 );
+	int square = size / checks > 0 ? size / checks : 1;
+	for( int y = 0; y < size; y++ ) {
+		for( int x = 0; x < size; x++ ) {
+			colour c = ((x / square) + (y / square)) % 2 ? b : a;
+			uint8_t* p = &rgba[((size_t)y * size + x) * 4];
+			p[0] = (uint8_t)lrintf( fminf( fmaxf( c.r, 0.0f ), 1.0f ) * 255.0f );
+			p[1] = (uint8_t)lrintf( fminf( fmaxf( c.g, 0.0f ), 1.0f ) * 255.0f );
+			p[2] = (uint8_t)lrintf( fminf( fmaxf( c.b, 0.0f ), 1.0f ) * 255.0f );
+			p[3] = 255;
+		}
+	}
+	texture t = makeTexture( size, size, rgba );
+	free( rgba );
+	return t;
+}
+
+void freeTexture(texture* t) {
+	for( int i = 0; i < t->levels; i++ ) {
+		free( t->level[i].texels );
+		free( t->level[i].mortonX );
+		free( t->level[i].mortonY );
+	}
+	t->levels = 0;
+}
+
+// Sampling works out texel positions in fixed point, with 8 bit fractions
+// between texel centres, and weights r, g, b by integers. Nearest and
+// bilinear sums stay under 2^24 and are exact in floats, whichever order
+// they are added in. A trilinear blend goes up to 2^32 and rounds, but both
+// samplers do the same two products and one sum in the same order, so the
+// four lane and the one lane samplers still agree to the bit. Colours come
+// out scaled by SAMPLE_ONE, and a trilinear blend by 256 more.
+#define SAMPLE_ONE 65536.0f
+#define SAMPLE_SCALE (1.0f / (255.0f * SAMPLE_ONE))
+#define TRILINEAR_SCALE (1.0f / (255.0f * SAMPLE_ONE * 256.0f))
+
+// Levels a level of detail picks: the nearest one, or for trilinear the
+// one below, the one above and 256ths of the way from one to the other.
+// NaN picks level 0.
+static inline void pickLevels(const texture* t, textureFilter filter, float lod, int* l0, int* l1, int* f) {
+	float last = (float)(t->levels - 1);
+	float c = lod > 0.0f ? lod : 0.0f;
+	c = c < last ? c : last;
+	if( filter != FILTER_TRILINEAR ) {
+		*l0 = *l1 = (int)(c + 0.5f);
+		*f = 0;
+		return;
+	}
+	*l0 = (int)c;
+	*l1 = *l0 < t->levels - 1 ? *l0 + 1 : *l0;
+	*f = (int)((c - (float)*l0) * 256.0f);
+}
+
+static inline uint32_t texelAt(const textureLevel* l, int x, int y) {
+	return l->texels[l->mortonX[x & (l->width - 1)] | l->mortonY[y & (l->height - 1)]];
+}
+
+// One level into c. Coordinates are wrapped into [0, 1) first, which
+// keeps the texel numbers small however far out they are.
+static inline void sampleLevel(const textureLevel* l, bool bilinear, float u, float v, float* c) {
+	u -= floorf( u );
+	v -= floorf( v );
+	if( !bilinear ) {
+		uint32_t texel = texelAt( l, (int)(u * (float)l->width), (int)(v * (float)l->height) );
+		for( int k = 0; k < 3; k++ ) {
+			c[k] = (float)((texel >> (8 * k)) & 0xff) * SAMPLE_ONE;
+		}
+		return;
+	}
+
+	// Texel centres are at half texels, 128 in fixed point.
+	int s = (int)(u * (float)(l->width * 256)) - 128;
+	int t = (int)(v * (float)(l->height * 256)) - 128;
+	int x = s >> 8;
+	int y = t >> 8;
+	float fx = (float)(s & 255);
+	float fy = (float)(t & 255);
+	uint32_t t00 = texelAt( l, x, y );
+	uint32_t t10 = texelAt( l, x + 1, y );
+	uint32_t t01 = texelAt( l, x, y + 1 );
+	uint32_t t11 = texelAt( l, x + 1, y + 1 );
+	float w00 = (256.0f - fx) * (256.0f - fy);
+	float w10 = fx * (256.0f - fy);
+	float w01 = (256.0f - fx) * fy;
+	float w11 = fx * fy;
+	for( int k = 0; k < 3; k++ ) {
+		int shift = 8 * k;
+		c[k] =
+			(float)((t00 >> shift) & 0xff) * w00 + (float)((t10 >> shift) & 0xff) * w10 +
+			(float)((t01 >> shift) & 0xff) * w01 + (float)((t11 >> shift) & 0xff) * w11;
+	}
+}
+
+// Into c, in 0 to 1.
+static inline void sampleInto(const texture* t, textureFilter filter, float u, float v, float lod, float* c) {
+	int l0, l1, f;
+	pickLevels( t, filter, lod, &l0, &l1, &f );
+	sampleLevel( &t->level[l0], filter != FILTER_NEAREST, u, v, c );
+	if( filter != FILTER_TRILINEAR ) {
+		for( int k = 0; k < 3; k++ ) {
+			c[k] *= SAMPLE_SCALE;
+		}
+		return;
+	}
+	float above[3];
+	sampleLevel( &t->level[l1], true, u, v, above );
+	float a = (float)(256 - f);
+	float b = (float)f;
+	for( int k = 0; k < 3; k++ ) {
+		c[k] = (c[k] * a + above[k] * b) * TRILINEAR_SCALE;
+	}
+}
+
+colour sampleTexture(const texture* t, textureFilter filter, float u, float v, float lod) {
+	float c[3];
+	sampleInto( t, filter, u, v, lod, c );
+	return makeColour( c[0], c[1], c[2] );
+}
+
+#ifdef RASTER_SIMD
+
+// Rounds towards minus infinity, for |x| < 2^31.
+static inline __m128 floor4(__m128 x) {
+	__m128 t = _mm_cvtepi32_ps( _mm_cvttps_epi32( x ) );
+	return _mm_sub_ps( t, _mm_and_ps( _mm_cmpgt_ps( t, x ), _mm_set1_ps( 1.0f ) ) );
+}
+
+// Channel shift of texels, as floats.
+static inline __m128 channel4(__m128i texels, int shift) {
+	return _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( texels, shift ), _mm_set1_epi32( 0xff ) ) );
+}
+
+// sampleLevel for four lanes, each from its own level. The arithmetic is
+// the same, lane by lane; only the texel fetches go one at a time.
+static inline void sampleLevel4(const texture* t, const int* levels, bool bilinear, __m128 u, __m128 v, __m128* c) {
+	const textureLevel* l[4];
+	for( int k = 0; k < 4; k++ ) {
+		l[k] = &t->level[levels[k]];
+	}
+	u = _mm_sub_ps( u, floor4( u ) );
+	v = _mm_sub_ps( v, floor4( v ) );
+
+	int scale = bilinear ? 256 : 1;
+	__m128 w = _mm_set_ps( (float)(l[3]->width * scale), (float)(l[2]->width * scale), (float)(l[1]->width * scale), (float)(l[0]->width * scale) );
+	__m128 h = _mm_set_ps( (float)(l[3]->height * scale), (float)(l[2]->height * scale), (float)(l[1]->height * scale), (float)(l[0]->height * scale) );
+	__m128i s = _mm_cvttps_epi32( _mm_mul_ps( u, w ) );
+	__m128i tt = _mm_cvttps_epi32( _mm_mul_ps( v, h ) );
+	if( !bilinear ) {
+		int32_t xs[4], ys[4];
+		uint32_t texels[4];
+		_mm_storeu_si128( (__m128i*)xs, s );
+		_mm_storeu_si128( (__m128i*)ys, tt );
+		for( int k = 0; k < 4; k++ ) {
+			texels[k] = texelAt( l[k], xs[k], ys[k] );
+		}
+		__m128i tx = _mm_loadu_si128( (const __m128i*)texels );
+		__m128 one = _mm_set1_ps( SAMPLE_ONE );
+		for( int k = 0; k < 3; k++ ) {
+			c[k] = _mm_mul_ps( channel4( tx, 8 * k ), one );
+		}
+		return;
+	}
+
+	__m128i half = _mm_set1_epi32( 128 );
+	__m128i frac = _mm_set1_epi32( 255 );
+	s = _mm_sub_epi32( s, half );
+	tt = _mm_sub_epi32( tt, half );
+	int32_t xs[4], ys[4];
+	uint32_t texels[4][4];
+	_mm_storeu_si128( (__m128i*)xs, _mm_srai_epi32( s, 8 ) );
+	_mm_storeu_si128( (__m128i*)ys, _mm_srai_epi32( tt, 8 ) );
+	for( int k = 0; k < 4; k++ ) {
+		texels[0][k] = texelAt( l[k], xs[k], ys[k] );
+		texels[1][k] = texelAt( l[k], xs[k] + 1, ys[k] );
+		texels[2][k] = texelAt( l[k], xs[k], ys[k] + 1 );
+		texels[3][k] = texelAt( l[k], xs[k] + 1, ys[k] + 1 );
+	}
+
+	__m128 fx = _mm_cvtepi32_ps( _mm_and_si128( s, frac ) );
+	__m128 fy = _mm_cvtepi32_ps( _mm_and_si128( tt, frac ) );
+	__m128 full = _mm_set1_ps( 256.0f );
+	__m128 gx = _mm_sub_ps( full, fx );
+	__m128 gy = _mm_sub_ps( full, fy );
+	__m128 weights[4] = { _mm_mul_ps( gx, gy ), _mm_mul_ps( fx, gy ), _mm_mul_ps( gx, fy ), _mm_mul_ps( fx, fy ) };
+	c[0] = c[1] = c[2] = _mm_setzero_ps();
+	for( int i = 0; i < 4; i++ ) {
+		__m128i tx = _mm_loadu_si128( (const __m128i*)texels[i] );
+		for( int k = 0; k < 3; k++ ) {
+			c[k] = _mm_add_ps( c[k], _mm_mul_ps( channel4( tx, 8 * k ), weights[i] ) );
+		}
+	}
+}
+
+void sampleTexture4(const texture* t, textureFilter filter, const float* u, const float* v, const float* lod, int lanes, float* r, float* g, float* b) {
+	int l0[4], l1[4], f[4];
+	for( int k = 0; k < 4; k++ ) {
+		pickLevels( t, filter, (lanes >> k) & 1 ? lod[k] : 0.0f, &l0[k], &l1[k], &f[k] );
+	}
+	__m128 uu = _mm_loadu_ps( u );
+	__m128 vv = _mm_loadu_ps( v );
+	__m128 c[3];
+	sampleLevel4( t, l0, filter != FILTER_NEAREST, uu, vv, c );
+	__m128 scale = _mm_set1_ps( SAMPLE_SCALE );
+	if( filter == FILTER_TRILINEAR ) {
+		__m128 above[3];
+		sampleLevel4( t, l1, true, uu, vv, above );
+		__m128 bw = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*)f ) );
+		__m128 aw = _mm_sub_ps( _mm_set1_ps( 256.0f ), bw );
+		for( int k = 0; k < 3; k++ ) {
+			c[k] = _mm_add_ps( _mm_mul_ps( c[k], aw ), _mm_mul_ps( above[k], bw ) );
+		}
+		scale = _mm_set1_ps( TRILINEAR_SCALE );
+	}
+
+	__m128 keep = _mm_castsi128_ps( _mm_cmpgt_epi32(
+		_mm_and_si128( _mm_set1_epi32( lanes ), _mm_set_epi32( 8, 4, 2, 1 ) ), _mm_setzero_si128() ) );
+	_mm_storeu_ps( r, _mm_and_ps( _mm_mul_ps( c[0], scale ), keep ) );
+	_mm_storeu_ps( g, _mm_and_ps( _mm_mul_ps( c[1], scale ), keep ) );
+	_mm_storeu_ps( b, _mm_and_ps( _mm_mul_ps( c[2], scale ), keep ) );
+}
+
+#else
+
+void sampleTexture4(const texture* t, textureFilter filter, const float* u, const float* v, const float* lod, int lanes, float* r, float* g, float* b) {
+	for( int k = 0; k < 4; k++ ) {
+		float c[3] = { 0.0f, 0.0f, 0.0f };
+		if( (lanes >> k) & 1 ) {
+			sampleInto( t, filter, u[k], v[k], lod[k], c );
+		}
+		r[k] = c[0];
+		g[k] = c[1];
+		b[k] = c[2];
+	}
+}
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * Textures: RGBA8 mip chains in Morton (Z) order, sampled nearest,
+ * bilinear or trilinear with the level picked from screen space
+ * derivatives of the texture coordinates.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __TEXTURES_H__
+#define __TEXTURES_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "colours.h"
+
+// Levels per texture, at most: sides up to 32768 texels.
+#define MAX_TEXTURE_LEVELS 16
+
+// Nearest and bilinear sample the level nearest to the level of detail,
+// trilinear blends the bilinear samples of the two around it.
+typedef enum textureFilter {
+	FILTER_NEAREST,
+	FILTER_BILINEAR,
+	FILTER_TRILINEAR
+} textureFilter;
+
+// One level. Texels are r, g, b, a bytes, low to high, and texel (x, y)
+// is at mortonX[x] | mortonY[y]: the bits of x and y interleaved, so
+// texels close in both directions are close in memory whichever way a
+// triangle walks across them. In levels that are not square, the bits
+// the longer side has on top of the shorter one go above all of those.
+typedef struct textureLevel {
+	int width;
+	int height;
+	uint32_t* texels;
+	uint32_t* mortonX;
+	uint32_t* mortonY;
+} textureLevel;
+
+// Sides are powers of two, and coordinates wrap around: u and v run from
+// 0 to 1 across the texture, v from the bottom row up. Every level is
+// half the size of the one before, box filtered, down to 1x1.
+typedef struct texture {
+	int width;
+	int height;
+	int levels;
+	textureLevel level[MAX_TEXTURE_LEVELS];
+} texture;
+
+// From rows of r, g, b, a bytes, the bottom one first.
+texture makeTexture(int width, int height, const uint8_t* rgba);
+
+// From a binary PPM file, which lists its rows top down.
+texture makeTextureFromFile(const char* file);
+
+// size x size texels of checks x checks squares, alternating a and b.
+texture makeCheckerTexture(int size, int checks, colour a, colour b);
+
+void freeTexture(texture* t);
+
+// Names as used on command lines: nearest, bilinear, trilinear.
+const char* textureFilterName(textureFilter filter);
+bool textureFilterNamed(const char* name, textureFilter* filter);
+
+// Colour at u, v, at the given level of detail: log2 of how many level 0
+// texels one pixel spans. Alpha is 1.
+colour sampleTexture(const texture* t, textureFilter filter, float u, float v, float lod);
+
+// The same for four pixels, the ones set in lanes. Colours of the others
+// are 0.
+void sampleTexture4(const texture* t, textureFilter filter, const float* u, const float* v, const float* lod, int lanes, float* r, float* g, float* b);
+
+// log2, piecewise linear between powers of two, straight from the bits.
+// Plenty for picking levels. Anything drawing with a texture works the
+// level of detail out with this and textureLod, or with the same
+// operations in the same order, so every way of drawing picks the same
+// levels, up to rounding.
+static inline float fastLog2(float x) {
+	int32_t bits;
+	memcpy( &bits, &x, sizeof(bits) );
+	return (float)bits * (1.0f / 8388608.0f) - 127.0f;
+}
+
+// Level of detail from the derivatives of u and v along x and y: the
+// longer of a pixel's two sides, in level 0 texels.
+static inline float textureLod(const texture* t, float dudx, float dvdx, float dudy, float dvdy) {
+	float ax = dudx * (float)t->width;
+	float ay = dvdx * (float)t->height;
+	float bx = dudy * (float)t->width;
+	float by = dvdy * (float)t->height;
+	float rx = ax * ax + ay * ay;
+	float ry = bx * bx + by * by;
+	return 0.5f * fastLog2( rx > ry ? rx : ry );
+}
+
+// Texture coordinates and level of detail of the pixel at fx, fy from a
+// triangle's planes of 1/w, u/w and v/w (value at the origin, d/dx, d/dy).
+// u/w and v/w are linear in screen space, u and v are not; their
+// derivatives follow from the quotient rule.
+static inline void texturePixel(const texture* t, const float* q, const float* su, const float* sv, float fx, float fy, float* u, float* v, float* lod) {
+	float qp = (q[0] + q[2] * fy) + q[1] * fx;
+	float sup = (su[0] + su[2] * fy) + su[1] * fx;
+	float svp = (sv[0] + sv[2] * fy) + sv[1] * fx;
+	float w = 1.0f / qp;
+	*u = sup * w;
+	*v = svp * w;
+	float dudx = (su[1] - *u * q[1]) * w;
+	float dvdx = (sv[1] - *v * q[1]) * w;
+	float dudy = (su[2] - *u * q[2]) * w;
+	float dvdy = (sv[2] - *v * q[2]) * w;
+	*lod = textureLod( t, dudx, dvdx, dudy, dvdy );
+}
+
+#endif
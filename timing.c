@@ -0,0 +1,53 @@
+/**
+ * Clocks and frame time statistics for the headless renderer and the
+ * benchmarks.
+ * (c) L. Diener 2011
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "timing.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+double timeNow() {
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+bool haveCycleCounter() {
+	return HAVE_TSC;
+}
+
+uint64_t cycleCount() {
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int compareTimes(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void sortTimes(double* times, int count) {
+	qsort( times, count, sizeof(double), compareTimes );
+}
+
+double percentile(const double* sorted, int count, double fraction) {
+	int i = (int)(fraction * count + 0.5) - 1;
+	i = i < 0 ? 0 : (i >= count ? count - 1 : i);
+	return sorted[i];
+}
@@ -0,0 +1,26 @@
+/**
+ * Clocks and frame time statistics for the headless renderer and the
+ * benchmarks.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Monotonic time in seconds.
+double timeNow();
+
+// Time stamp counter, if there is one (x86): reference cycles, which
+// tick at a fixed rate whatever the core clock does.
+bool haveCycleCounter();
+uint64_t cycleCount();
+
+void sortTimes(double* times, int count);
+
+// Value at or below which the given fraction of the sorted times fall.
+double percentile(const double* sorted, int count, double fraction);
+
+#endif
@@ -149,8 +149,8 @@ inline scalar dot3(vec3 a, vec3 b) {
 
 inline void cross(vec3 * r, vec3 a, vec3 b) {
 	r->x = a.y * b.z - a.z * b.y;
-	r->y = a.z * b.x - a.x * a.z;
-	r->z = a.x * b.y - a.y * a.x;
+	r->y = a.z * b.x - a.x * b.z;
+	r->z = a.x * b.y - a.y * b.x;
 }
 
 // Vector sizes
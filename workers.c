@@ -0,0 +1,124 @@
+/**
+ * A tiny pthread worker pool. Runs a batch of numbered jobs on all
+ * threads (the caller included) and returns once every job is done.
+ * (c) L. Diener 2011
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "workers.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+// Grab jobs until there are none left.
+static void drainJobs(workerPool* p) {
+	int i;
+	while( (i = __sync_fetch_and_add( &p->nextJob, 1 )) < p->jobCount ) {
+		p->job( p->arg, i );
+	}
+}
+
+static void* workerMain(void* arg) {
+	workerPool* p = (workerPool*)arg;
+	int seen = 0;
+
+	pthread_mutex_lock( &p->lock );
+	while( true ) {
+		while( !p->quit && p->generation == seen ) {
+			pthread_cond_wait( &p->wake, &p->lock );
+		}
+		if( p->quit ) {
+			break;
+		}
+		seen = p->generation;
+		pthread_mutex_unlock( &p->lock );
+
+		drainJobs( p );
+
+		pthread_mutex_lock( &p->lock );
+		if( --p->busy == 0 ) {
+			pthread_cond_signal( &p->done );
+		}
+	}
+	pthread_mutex_unlock( &p->lock );
+	return NULL;
+}
+
+int processorCount() {
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+}
+
+workerPool* makeWorkerPool(int threads) {
+	workerPool* p = (workerPool*)malloc( sizeof(workerPool) );
+	if( threads < 1 ) {
+		threads = processorCount();
+	}
+
+	p->threadCount = threads;
+	p->threads = (pthread_t*)malloc( sizeof(pthread_t) * threads );
+	pthread_mutex_init( &p->lock, NULL );
+	pthread_cond_init( &p->wake, NULL );
+	pthread_cond_init( &p->done, NULL );
+	p->job = NULL;
+	p->arg = NULL;
+	p->jobCount = 0;
+	p->nextJob = 0;
+	p->busy = 0;
+	p->generation = 0;
+	p->quit = false;
+
+	// The calling thread works too, so spawn one less.
+	for( int i = 1; i < threads; i++ ) {
+		pthread_create( &p->threads[i], NULL, workerMain, p );
+	}
+	return p;
+}
+
+int workerCount(workerPool* p) {
+	return p->threadCount;
+}
+
+void runJobs(workerPool* p, workerJob job, void* arg, int jobCount) {
+	if( p->threadCount == 1 || jobCount == 1 ) {
+		for( int i = 0; i < jobCount; i++ ) {
+			job( arg, i );
+		}
+		return;
+	}
+
+	pthread_mutex_lock( &p->lock );
+	p->job = job;
+	p->arg = arg;
+	p->jobCount = jobCount;
+	p->nextJob = 0;
+	p->busy = p->threadCount - 1;
+	p->generation++;
+	pthread_cond_broadcast( &p->wake );
+	pthread_mutex_unlock( &p->lock );
+
+	drainJobs( p );
+
+	pthread_mutex_lock( &p->lock );
+	while( p->busy != 0 ) {
+		pthread_cond_wait( &p->done, &p->lock );
+	}
+	pthread_mutex_unlock( &p->lock );
+}
+
+void freeWorkerPool(workerPool* p) {
+	pthread_mutex_lock( &p->lock );
+	p->quit = true;
+	pthread_cond_broadcast( &p->wake );
+	pthread_mutex_unlock( &p->lock );
+
+	for( int i = 1; i < p->threadCount; i++ ) {
+		pthread_join( p->threads[i], NULL );
+	}
+	pthread_cond_destroy( &p->wake );
+	pthread_cond_destroy( &p->done );
+	pthread_mutex_destroy( &p->lock );
+	free( p->threads );
+	free( p );
+}
@@ -0,0 +1,38 @@
+/**
+ * A tiny pthread worker pool. Runs a batch of numbered jobs on all
+ * threads (the caller included) and returns once every job is done.
+ * (c) L. Diener 2011
+ */
+
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef void (*workerJob)(void* arg, int index);
+
+typedef struct workerPool {
+	int threadCount;
+	pthread_t* threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+
+	workerJob job;
+	void* arg;
+	int jobCount;
+	volatile int nextJob;
+	int busy;
+	int generation;
+	bool quit;
+} workerPool;
+
+workerPool* makeWorkerPool(int threads);
+int workerCount(workerPool* p);
+void runJobs(workerPool* p, workerJob job, void* arg, int jobCount);
+void freeWorkerPool(workerPool* p);
+int processorCount();
+
+#endif